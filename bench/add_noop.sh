@@ -0,0 +1,48 @@
+#!/usr/bin/env bash
+# Times a no-op `mygit add .` (nothing changed since the last add) on a
+# synthetic tree. Set MYGIT_BASELINE to another mygit binary, e.g. one built
+# from an older commit, to compare the two side by side.
+#
+#   bench/add_noop.sh [num_files] [runs]
+set -euo pipefail
+
+FILES=${1:-20000}
+RUNS=${2:-5}
+ROOT=$(cd "$(dirname "$0")/.." && pwd)
+MYGIT=${MYGIT:-$ROOT/mygit}
+WORK=$(mktemp -d)
+trap 'rm -rf "$WORK"' EXIT
+
+now_ms() { echo $(( $(date +%s%N) / 1000000 )); }
+
+make_tree() {
+    local dir=$1
+    mkdir -p "$dir"
+    for ((i = 0; i < FILES; i++)); do
+        local sub="$dir/d$((i % 100))/e$((i % 7))"
+        [ -d "$sub" ] || mkdir -p "$sub"
+        printf 'file %d\n%0200d\n' "$i" "$i" > "$sub/f$i.txt"
+    done
+}
+
+bench_binary() {
+    local label=$1 bin=$2 dir=$WORK/$1
+    cp -r "$WORK/template" "$dir"
+    (cd "$dir" && "$bin" init > /dev/null)
+    local t0 t1 best=
+    t0=$(now_ms); (cd "$dir" && "$bin" add .); t1=$(now_ms)
+    printf '%-10s initial add: %6d ms\n' "$label" $((t1 - t0))
+    for ((r = 0; r < RUNS; r++)); do
+        t0=$(now_ms); (cd "$dir" && "$bin" add .); t1=$(now_ms)
+        local ms=$((t1 - t0))
+        if [ -z "$best" ] || [ "$ms" -lt "$best" ]; then best=$ms; fi
+    done
+    printf '%-10s no-op add:   %6d ms (best of %d)\n' "$label" "$best" "$RUNS"
+}
+
+echo "generating $FILES files..."
+make_tree "$WORK/template"
+if [ -n "${MYGIT_BASELINE:-}" ]; then
+    bench_binary baseline "$MYGIT_BASELINE"
+fi
+bench_binary current "$MYGIT"
@@ -0,0 +1,538 @@
+// End-to-end benchmark: generates a synthetic repository, runs mygit
+// commands against it cold and warm, and writes a JSON report.
+//
+//   bench/mygit-bench [--files N] [--depth D] [--fanout F]
+//                     [--sizes small|mixed|large] [--media PCT] [--history H]
+//                     [--churn PCT] [--runs R] [--seed S] [--mygit PATH]
+//                     [--out FILE] [--keep] [--compression] [--fsync]
+//
+// --media makes that percentage of the files incompressible, like images
+// or archives. --compression adds a sweep of "add (initial)" over the
+// core.compression settings, reporting wall time against the size of the
+// object store for each. --fsync times "add (initial)" and "commit" under
+// each core.fsync mode.
+//
+// "Cold" runs start with the repository's files (and the mygit binary)
+// evicted from the page cache with posix_fadvise(DONTNEED), which needs no
+// privileges; "warm" runs repeat the same command immediately afterwards.
+// Every run gets the same starting state from an untimed setup step.
+// Peak RSS comes from wait4(); object counts come from the MYGIT_STATS file
+// mygit writes on exit.
+
+#include <bits/stdc++.h>
+#include <fcntl.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+using namespace std;
+namespace fs = std::filesystem;
+
+struct Options {
+    long files = 5000;
+    int depth = 3;
+    int fanout = 8;
+    string sizes = "mixed";
+    double media = 0;  // percent of files filled with random bytes
+    int history = 20;
+    double churn = 1.0;  // percent of files modified per commit
+    int runs = 3;
+    uint64_t seed = 42;
+    string mygit = "./mygit";
+    string out = "bench_report.json";
+    bool keep = false;
+    bool compression = false;
+    bool fsync = false;
+};
+
+struct RunResult {
+    int status = 0;
+    double wall_ms = 0;
+    long peak_rss_kb = 0;
+    uint64_t objects_read = 0;
+    uint64_t objects_written = 0;
+};
+
+struct CaseResult {
+    string name;
+    string command;
+    RunResult cold;
+    vector<RunResult> warm;
+};
+
+struct CompressionResult {
+    string setting;
+    double wall_ms;      // median warm "add (initial)"
+    uint64_t store_bytes;  // size of .mygit/objects afterwards
+};
+
+struct FsyncResult {
+    string mode;
+    double add_ms;     // median warm "add (initial)"
+    double commit_ms;  // median warm "commit" of the whole tree
+};
+
+static Options opts;
+static string work_dir, repo_dir, stats_file;
+
+static double now_ms() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+}
+
+static void die(const string &msg) {
+    cerr << "bench: " << msg << "\n";
+    exit(1);
+}
+
+// ---- synthetic repository ----
+
+static mt19937_64 rng;
+
+// Text-like filler so compression behaves roughly like it does on source.
+static string filler;
+
+static void init_filler() {
+    static const char *words[] = {"int", "return", "const", "string", "for", "if", "else", "while",
+                                  "struct", "void", "static", "size_t", "auto", "vector", "{", "}",
+                                  "(", ")", ";", "=", "+", "0", "1", "data", "path", "sha", "entry"};
+    const size_t nwords = sizeof(words) / sizeof(words[0]);
+    filler.reserve(1 << 22);
+    size_t col = 0;
+    while (filler.size() < (1 << 22)) {
+        const char *w = words[rng() % nwords];
+        filler += w;
+        col += strlen(w) + 1;
+        if (col > 60 + rng() % 30) {
+            filler += '\n';
+            col = 0;
+        } else {
+            filler += ' ';
+        }
+    }
+}
+
+static size_t pick_size() {
+    if (opts.sizes == "small") return 64 + rng() % 4032;
+    if (opts.sizes == "large") return (256 << 10) + rng() % (4 << 20);
+    // mixed: log-normal around 4 KiB with a long tail past the 1 MiB
+    // streaming threshold.
+    lognormal_distribution<double> d(log(4096.0), 1.6);
+    return (size_t)min(max(d(rng), 16.0), (double)(8 << 20));
+}
+
+// The header line keeps every file and version distinct, so files never
+// share a blob.
+static string file_body(long id, long version, size_t size, bool media) {
+    if (media) {
+        string body(size, '\0');
+        for (size_t i = 0; i < size; i += 8) {
+            uint64_t r = rng();
+            memcpy(&body[i], &r, min<size_t>(8, size - i));
+        }
+        return body;
+    }
+    string body = "// file " + to_string(id) + " version " + to_string(version) + "\n";
+    while (body.size() < size) {
+        size_t off = rng() % (filler.size() - 4096);
+        size_t n = min(filler.size() - off, size - body.size());
+        body.append(filler, off, n);
+    }
+    return body;
+}
+
+static void write_text(const string &path, const string &data) {
+    ofstream f(path, ios::binary | ios::trunc);
+    f.write(data.data(), data.size());
+    if (!f) die("cannot write " + path);
+}
+
+struct GeneratedFile {
+    string path;  // relative to the repository
+    size_t size;
+    long version;
+    bool media;
+};
+
+static vector<GeneratedFile> generated;
+
+static string dir_for(long i) {
+    string dir;
+    long x = i;
+    for (int level = 0; level < opts.depth; ++level) {
+        dir += "d" + to_string(x % opts.fanout) + "/";
+        x /= opts.fanout;
+    }
+    return dir;
+}
+
+static void generate_tree() {
+    init_filler();
+    for (long i = 0; i < opts.files; ++i) {
+        bool media = rng() % 10000 < opts.media * 100;
+        GeneratedFile f{dir_for(i) + "f" + to_string(i) + (media ? ".bin" : ".txt"), pick_size(), 0, media};
+        fs::create_directories(fs::path(repo_dir + "/" + f.path).parent_path());
+        write_text(repo_dir + "/" + f.path, file_body(i, 0, f.size, f.media));
+        generated.push_back(f);
+    }
+}
+
+static void modify_files() {
+    long n = max(1L, (long)(generated.size() * opts.churn / 100.0));
+    for (long k = 0; k < n; ++k) {
+        long i = rng() % generated.size();
+        GeneratedFile &f = generated[i];
+        write_text(repo_dir + "/" + f.path, file_body(i, ++f.version, f.size, f.media));
+    }
+}
+
+// ---- running commands ----
+
+static void evict_file(const string &path) {
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0) return;
+    posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+    close(fd);
+}
+
+static void evict_caches() {
+    sync();  // only clean pages can be dropped
+    for (auto &e : fs::recursive_directory_iterator(repo_dir)) {
+        if (e.is_regular_file()) evict_file(e.path().string());
+    }
+    evict_file(opts.mygit);
+}
+
+static RunResult run(const vector<string> &args, string *capture = nullptr) {
+    int pipefd[2] = {-1, -1};
+    if (capture && pipe(pipefd) != 0) die("pipe failed");
+    unlink(stats_file.c_str());
+
+    double start = now_ms();
+    pid_t pid = fork();
+    if (pid < 0) die("fork failed");
+    if (pid == 0) {
+        if (chdir(repo_dir.c_str()) != 0) _exit(127);
+        int out = capture ? pipefd[1] : open("/dev/null", O_WRONLY);
+        dup2(out, STDOUT_FILENO);
+        if (capture) close(pipefd[0]);
+        setenv("MYGIT_STATS", stats_file.c_str(), 1);
+        vector<char *> argv;
+        argv.push_back((char *)opts.mygit.c_str());
+        for (auto &a : args) argv.push_back((char *)a.c_str());
+        argv.push_back(nullptr);
+        execv(opts.mygit.c_str(), argv.data());
+        _exit(127);
+    }
+    if (capture) {
+        close(pipefd[1]);
+        char buf[4096];
+        ssize_t n;
+        while ((n = read(pipefd[0], buf, sizeof(buf))) > 0) capture->append(buf, n);
+        close(pipefd[0]);
+    }
+
+    RunResult r;
+    struct rusage ru;
+    int status;
+    if (wait4(pid, &status, 0, &ru) < 0) die("wait4 failed");
+    r.wall_ms = now_ms() - start;
+    r.peak_rss_kb = ru.ru_maxrss;
+    r.status = WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status);
+
+    ifstream sf(stats_file);
+    string line;
+    if (getline(sf, line)) {
+        sscanf(line.c_str(), "{\"objects_read\": %" SCNu64 ", \"objects_written\": %" SCNu64,
+               &r.objects_read, &r.objects_written);
+    }
+    return r;
+}
+
+static string run_ok(const vector<string> &args) {
+    string out;
+    RunResult r = run(args, &out);
+    if (r.status != 0) die("mygit " + args[0] + " failed with status " + to_string(r.status));
+    while (!out.empty() && out.back() == '\n') out.pop_back();
+    return out;
+}
+
+static vector<CaseResult> results;
+
+static string join(const vector<string> &args) {
+    string s;
+    for (auto &a : args) s += (s.empty() ? "" : " ") + a;
+    return s;
+}
+
+// Runs `setup` (untimed) before every run of `args`: once cold, then
+// opts.runs times warm.
+static void bench_case(const string &name, const vector<string> &args, const function<void()> &setup = nullptr) {
+    CaseResult c{name, join(args), {}, {}};
+    if (setup) setup();
+    evict_caches();
+    c.cold = run(args);
+    for (int i = 0; i < opts.runs; ++i) {
+        if (setup) setup();
+        c.warm.push_back(run(args));
+    }
+    if (c.cold.status != 0) cerr << "bench: warning: " << name << " exited with " << c.cold.status << "\n";
+    results.push_back(c);
+
+    vector<double> ms;
+    for (auto &w : c.warm) ms.push_back(w.wall_ms);
+    sort(ms.begin(), ms.end());
+    printf("%-22s cold %9.1f ms   warm %9.1f ms   rss %7ld KiB   read %6" PRIu64 "   written %6" PRIu64 "\n",
+           name.c_str(), c.cold.wall_ms, ms.empty() ? 0.0 : ms[ms.size() / 2], c.cold.peak_rss_kb,
+           c.cold.objects_read, c.cold.objects_written);
+    fflush(stdout);
+}
+
+static uint64_t tree_bytes(const string &dir) {
+    uint64_t total = 0;
+    for (auto &e : fs::recursive_directory_iterator(dir)) {
+        if (e.is_regular_file()) total += e.file_size();
+    }
+    return total;
+}
+
+static double median_warm_ms(const CaseResult &c) {
+    vector<double> ms;
+    for (auto &w : c.warm) ms.push_back(w.wall_ms);
+    sort(ms.begin(), ms.end());
+    return ms.empty() ? c.cold.wall_ms : ms[ms.size() / 2];
+}
+
+// Starts over with an empty repository; `config` is appended to the
+// [core] section init writes.
+static void reinit(const string &config = string()) {
+    fs::remove_all(repo_dir + "/.mygit");
+    run_ok({"init"});
+    if (config.empty()) return;
+    ofstream cfg(repo_dir + "/.mygit/config", ios::app);
+    cfg << config;
+}
+
+static vector<CompressionResult> compression_results;
+
+// Stores the whole tree once per setting: "add (initial)" pays for every
+// byte of compression, so its time and the resulting store size show the
+// trade-off directly.
+static void compression_sweep() {
+    static const pair<const char *, const char *> settings[] = {
+        {"-1", "false"}, {"1", "false"}, {"9", "false"}, {"0", "false"}, {"-1", "true"},
+    };
+    uint64_t input = 0;
+    for (auto &f : generated) input += f.size;
+    for (auto &s : settings) {
+        string name = string("level ") + s.first + (string(s.second) == "true" ? " adaptive" : "");
+        string config = string("\tcompression = ") + s.first + "\n\tadaptiveCompression = " + s.second + "\n";
+        bench_case("add (" + name + ")", {"add", "."}, [&] { reinit(config); });
+        double wall = median_warm_ms(results.back());
+        uint64_t store = tree_bytes(repo_dir + "/.mygit/objects");
+        compression_results.push_back({name, wall, store});
+        printf("  %-20s %8.1f MiB/s   store %8.2f MiB (%.1f%% of %.2f MiB)\n", name.c_str(),
+               wall > 0 ? input / 1048576.0 / (wall / 1e3) : 0.0, store / 1048576.0,
+               input ? 100.0 * store / input : 0.0, input / 1048576.0);
+        fflush(stdout);
+    }
+    fs::remove_all(repo_dir + "/.mygit");
+}
+
+static vector<FsyncResult> fsync_results;
+
+// "add (initial)" writes one object per file; "commit" then writes the
+// trees and the commit and updates a ref, which batch mode precedes with
+// its single flush. Setup ends with sync() so no run pays for writeback
+// left over from the one before it.
+static void fsync_sweep() {
+    for (const char *mode : {"none", "object", "batch"}) {
+        string config = string("\tfsync = ") + mode + "\n";
+        bench_case(string("add (fsync ") + mode + ")", {"add", "."}, [&] {
+            reinit(config);
+            sync();
+        });
+        double add_ms = median_warm_ms(results.back());
+        bench_case(string("commit (fsync ") + mode + ")", {"commit", "-m", "bench"}, [&] {
+            reinit(config);
+            run_ok({"add", "."});
+            sync();
+        });
+        fsync_results.push_back({mode, add_ms, median_warm_ms(results.back())});
+    }
+    fs::remove_all(repo_dir + "/.mygit");
+}
+
+// ---- report ----
+
+static string json_escape(const string &s) {
+    string out;
+    for (char ch : s) {
+        if (ch == '"' || ch == '\\') out += '\\';
+        out += ch;
+    }
+    return out;
+}
+
+static void put_run(ostream &o, const RunResult &r) {
+    o << "{\"wall_ms\": " << fixed << setprecision(3) << r.wall_ms << ", \"peak_rss_kb\": " << r.peak_rss_kb
+      << ", \"objects_read\": " << r.objects_read << ", \"objects_written\": " << r.objects_written
+      << ", \"status\": " << r.status << "}";
+}
+
+static void write_report() {
+    ofstream o(opts.out, ios::trunc);
+    o << "{\n  \"config\": {\"files\": " << opts.files << ", \"depth\": " << opts.depth << ", \"fanout\": "
+      << opts.fanout << ", \"sizes\": \"" << json_escape(opts.sizes) << "\", \"history\": " << opts.history
+      << ", \"churn_percent\": " << opts.churn << ", \"runs\": " << opts.runs << ", \"seed\": " << opts.seed
+      << ", \"media_percent\": " << opts.media << ", \"mygit\": \"" << json_escape(opts.mygit)
+      << "\"},\n  \"results\": [\n";
+    for (size_t i = 0; i < results.size(); ++i) {
+        const CaseResult &c = results[i];
+        vector<double> ms;
+        for (auto &w : c.warm) ms.push_back(w.wall_ms);
+        sort(ms.begin(), ms.end());
+        long rss = 0;
+        for (auto &w : c.warm) rss = max(rss, w.peak_rss_kb);
+        o << "    {\"name\": \"" << json_escape(c.name) << "\", \"command\": \"" << json_escape(c.command)
+          << "\",\n     \"cold\": ";
+        put_run(o, c.cold);
+        o << ",\n     \"warm\": {\"runs\": " << ms.size() << ", \"wall_ms_min\": "
+          << (ms.empty() ? 0.0 : ms.front()) << ", \"wall_ms_median\": " << (ms.empty() ? 0.0 : ms[ms.size() / 2])
+          << ", \"peak_rss_kb\": " << rss << ", \"objects_read\": " << (c.warm.empty() ? 0 : c.warm.back().objects_read)
+          << ", \"objects_written\": " << (c.warm.empty() ? 0 : c.warm.back().objects_written) << "}}"
+          << (i + 1 < results.size() ? "," : "") << "\n";
+    }
+    o << "  ]";
+    if (!compression_results.empty()) {
+        uint64_t input = 0;
+        for (auto &f : generated) input += f.size;
+        o << ",\n  \"compression\": {\"input_bytes\": " << input << ", \"settings\": [\n";
+        for (size_t i = 0; i < compression_results.size(); ++i) {
+            const CompressionResult &c = compression_results[i];
+            o << "    {\"setting\": \"" << c.setting << "\", \"wall_ms\": " << c.wall_ms
+              << ", \"store_bytes\": " << c.store_bytes << "}" << (i + 1 < compression_results.size() ? "," : "")
+              << "\n";
+        }
+        o << "  ]}";
+    }
+    if (!fsync_results.empty()) {
+        o << ",\n  \"fsync\": [\n";
+        for (size_t i = 0; i < fsync_results.size(); ++i) {
+            const FsyncResult &f = fsync_results[i];
+            o << "    {\"mode\": \"" << f.mode << "\", \"add_ms\": " << f.add_ms << ", \"commit_ms\": "
+              << f.commit_ms << "}" << (i + 1 < fsync_results.size() ? "," : "") << "\n";
+        }
+        o << "  ]";
+    }
+    o << "\n}\n";
+    if (!o) die("cannot write " + opts.out);
+}
+
+// ---- main ----
+
+static void usage() {
+    cerr << "usage: mygit-bench [--files N] [--depth D] [--fanout F] [--sizes small|mixed|large]\n"
+            "                   [--media PCT] [--history H] [--churn PCT] [--runs R] [--seed S]\n"
+            "                   [--mygit PATH] [--out FILE] [--keep] [--compression] [--fsync]\n";
+    exit(2);
+}
+
+static void parse_args(int argc, char **argv) {
+    for (int i = 1; i < argc; ++i) {
+        string a = argv[i];
+        auto value = [&]() -> string {
+            if (i + 1 >= argc) usage();
+            return argv[++i];
+        };
+        try {
+            if (a == "--files") opts.files = stol(value());
+            else if (a == "--depth") opts.depth = stoi(value());
+            else if (a == "--fanout") opts.fanout = stoi(value());
+            else if (a == "--sizes") opts.sizes = value();
+            else if (a == "--media") opts.media = stod(value());
+            else if (a == "--history") opts.history = stoi(value());
+            else if (a == "--churn") opts.churn = stod(value());
+            else if (a == "--runs") opts.runs = stoi(value());
+            else if (a == "--seed") opts.seed = stoull(value());
+            else if (a == "--mygit") opts.mygit = value();
+            else if (a == "--out") opts.out = value();
+            else if (a == "--keep") opts.keep = true;
+            else if (a == "--compression") opts.compression = true;
+            else if (a == "--fsync") opts.fsync = true;
+            else usage();
+        } catch (const logic_error &) {
+            usage();
+        }
+    }
+    if (opts.files < 1 || opts.depth < 0 || opts.fanout < 1 || opts.history < 1 || opts.runs < 0) usage();
+    if (opts.media < 0 || opts.media > 100) usage();
+    if (opts.sizes != "small" && opts.sizes != "mixed" && opts.sizes != "large") usage();
+}
+
+int main(int argc, char **argv) {
+    parse_args(argc, argv);
+    opts.mygit = fs::absolute(opts.mygit).lexically_normal().string();
+    if (access(opts.mygit.c_str(), X_OK) != 0) die("cannot execute " + opts.mygit);
+    rng.seed(opts.seed);
+
+    char tmpl[] = "/tmp/mygit-bench-XXXXXX";
+    if (!mkdtemp(tmpl)) die("mkdtemp failed");
+    work_dir = tmpl;
+    repo_dir = work_dir + "/repo";
+    stats_file = work_dir + "/stats.json";
+    fs::create_directories(repo_dir);
+
+    printf("generating %ld files (depth %d, %s sizes) in %s\n", opts.files, opts.depth, opts.sizes.c_str(),
+           repo_dir.c_str());
+    generate_tree();
+    if (opts.compression) compression_sweep();
+    if (opts.fsync) fsync_sweep();
+    run_ok({"init"});
+
+    bench_case("add (initial)", {"add", "."}, [] { reinit(); });
+    bench_case("add (no-op)", {"add", "."});
+    run_ok({"commit", "-m", "initial"});
+    string root = run_ok({"rev-list", "-n", "1"});
+
+    int made = 1;
+    auto change_and_add = [&] {
+        modify_files();
+        run_ok({"add", "."});
+    };
+    bench_case("add (changed)", {"add", "."}, [&] { modify_files(); });
+    run_ok({"commit", "-m", "change"});
+    made++;
+    bench_case("commit", {"commit", "-m", "bench"}, change_and_add);
+    made += 1 + opts.runs;
+    for (; made < opts.history; ++made) {
+        change_and_add();
+        run_ok({"commit", "-m", "history " + to_string(made)});
+    }
+    string head = run_ok({"rev-list", "-n", "1"});
+
+    bench_case("log", {"log"});
+    bench_case("commit-graph write", {"commit-graph", "write"});
+    bench_case("log (commit-graph)", {"log"});
+    bench_case("log -- <path>", {"log", "--", generated[0].path});
+
+    size_t largest = 0;
+    for (size_t i = 1; i < generated.size(); ++i) {
+        if (generated[i].size > generated[largest].size) largest = i;
+    }
+    string tree = run_ok({"write-tree"});
+    string blob = run_ok({"hash-object", generated[largest].path});
+    bench_case("cat-file -p <tree>", {"cat-file", "-p", tree});
+    bench_case("cat-file -p <blob>", {"cat-file", "-p", blob});
+
+    bench_case("checkout (root)", {"checkout", root}, [&] { run_ok({"checkout", head}); });
+    bench_case("checkout (head)", {"checkout", head}, [&] { run_ok({"checkout", root}); });
+
+    write_report();
+    printf("report written to %s\n", opts.out.c_str());
+    if (opts.keep) printf("repository kept at %s\n", repo_dir.c_str());
+    else fs::remove_all(work_dir);
+    return 0;
+}
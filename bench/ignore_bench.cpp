@@ -0,0 +1,143 @@
+// .mygitignore matcher microbenchmark: matches generated paths against a
+// typical ignore file, once with the compiled IgnoreList and once with a
+// straightforward loop calling fnmatch() on every pattern, checks that
+// both agree, and prints paths matched per second.
+//
+//   bench/mygit-ignore-bench [--paths N] [--runs R]
+
+#include "../src/ignore.h"
+
+#include <bits/stdc++.h>
+#include <fnmatch.h>
+
+using namespace std;
+
+static const char *PATTERNS =
+    "# build output\n"
+    "build/\n"
+    "dist\n"
+    "/out\n"
+    "target/\n"
+    "coverage/\n"
+    "node_modules/\n"
+    "vendor/\n"
+    "__pycache__/\n"
+    "*.o\n"
+    "*.obj\n"
+    "*.a\n"
+    "*.so\n"
+    "*.class\n"
+    "*.pyc\n"
+    "*.egg-info/\n"
+    "*.min.js\n"
+    "*.log\n"
+    "!important.log\n"
+    "*.tmp\n"
+    "*~\n"
+    "*.sw[op]\n"
+    "core.[0-9]*\n"
+    "tmp*\n"
+    "cache*\n"
+    "Thumbs.db\n"
+    "/docs/_build\n"
+    "src/generated/*.c\n"
+    "test/fixtures/big?.bin\n";
+
+struct PlainPattern {
+    string glob;
+    bool negate, dir_only, anchored;
+};
+
+// The same rules without any precompilation: every pattern is tried with
+// fnmatch(), last to first.
+static vector<PlainPattern> parse_plain(const string &content) {
+    vector<PlainPattern> out;
+    istringstream in(content);
+    string line;
+    while (getline(in, line)) {
+        if (line.empty() || line[0] == '#') continue;
+        PlainPattern p = {line, false, false, false};
+        if (p.glob[0] == '!') p.negate = true, p.glob.erase(0, 1);
+        if (p.glob.back() == '/') p.dir_only = true, p.glob.pop_back();
+        if (p.glob[0] == '/') p.anchored = true, p.glob.erase(0, 1);
+        if (p.glob.find('/') != string::npos) p.anchored = true;
+        out.push_back(p);
+    }
+    return out;
+}
+
+static bool plain_ignored(const vector<PlainPattern> &patterns, const string &path, bool is_dir) {
+    size_t slash = path.rfind('/');
+    string name = slash == string::npos ? path : path.substr(slash + 1);
+    for (auto it = patterns.rbegin(); it != patterns.rend(); ++it) {
+        if (it->dir_only && !is_dir) continue;
+        const string &s = it->anchored ? path : name;
+        if (fnmatch(it->glob.c_str(), s.c_str(), FNM_PATHNAME) == 0) return !it->negate;
+    }
+    return false;
+}
+
+int main(int argc, char **argv) {
+    size_t count = 1000000;
+    int runs = 3;
+    for (int i = 1; i < argc; ++i) {
+        string a = argv[i];
+        if (a == "--paths" && i + 1 < argc) count = stoul(argv[++i]);
+        else if (a == "--runs" && i + 1 < argc) runs = stoi(argv[++i]);
+        else {
+            cerr << "usage: " << argv[0] << " [--paths N] [--runs R]\n";
+            return 1;
+        }
+    }
+
+    const vector<string> dirs = {"src", "lib", "build", "docs", "test", "node_modules", "pkg", "util",
+                                 "core", "out", "generated", "target", "fixtures", "_build", "a", "b"};
+    const vector<string> names = {"main.c", "util.o", "README.md", "x.log", "important.log", "tmp3",
+                                  "cache.bin", "file.swp", "core.123", "app.min.js", "app.js", "Mod.class",
+                                  "libz.so", "data.txt", "index.html", "big1.bin", "notes~", "setup.py",
+                                  "mod.pyc", "Makefile", "parser.cc", "parser.h", "gen.c", "big10.bin"};
+    mt19937_64 rng(7);
+    vector<pair<string, bool>> paths(count);
+    for (auto &p : paths) {
+        size_t depth = rng() % 5;
+        string path;
+        for (size_t d = 0; d < depth; ++d) path += dirs[rng() % dirs.size()] + "/";
+        bool is_dir = rng() % 8 == 0;
+        path += is_dir ? dirs[rng() % dirs.size()] : names[rng() % names.size()];
+        p = {path, is_dir};
+    }
+
+    IgnoreStack rules = push_ignore_rules(nullptr, "", PATTERNS);
+    vector<PlainPattern> plain = parse_plain(PATTERNS);
+    vector<char> compiled_result(count), plain_result(count);
+
+    auto time_best = [&](const function<void()> &f) {
+        double best = 1e30;
+        for (int r = 0; r < runs; ++r) {
+            auto t0 = chrono::steady_clock::now();
+            f();
+            best = min(best, chrono::duration<double>(chrono::steady_clock::now() - t0).count());
+        }
+        return best;
+    };
+    double compiled = time_best([&] {
+        for (size_t i = 0; i < count; ++i) compiled_result[i] = is_ignored(rules, paths[i].first, paths[i].second);
+    });
+    double naive = time_best([&] {
+        for (size_t i = 0; i < count; ++i) plain_result[i] = plain_ignored(plain, paths[i].first, paths[i].second);
+    });
+
+    size_t ignored = count_if(compiled_result.begin(), compiled_result.end(), [](char c) { return c; });
+    size_t mismatches = 0;
+    for (size_t i = 0; i < count; ++i) {
+        if (compiled_result[i] != plain_result[i]) {
+            if (++mismatches <= 5) cerr << "mismatch: " << paths[i].first << (paths[i].second ? "/" : "") << "\n";
+        }
+    }
+    cout << count << " paths, " << plain.size() << " patterns, " << ignored << " ignored\n";
+    cout << fixed << setprecision(2);
+    cout << "compiled    " << setw(8) << count / compiled / 1e6 << " M paths/s\n";
+    cout << "fnmatch     " << setw(8) << count / naive / 1e6 << " M paths/s\n";
+    if (mismatches) cout << mismatches << " paths matched differently\n";
+    return mismatches ? 1 : 0;
+}
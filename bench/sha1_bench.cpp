@@ -0,0 +1,99 @@
+// SHA-1 microbenchmark: hashes sets of small buffers with every
+// implementation sha1_batch supports on this CPU, checks each digest
+// against OpenSSL's, and prints throughput.
+//
+//   bench/mygit-sha1-bench [--mib N] [--runs R]
+//
+// Each set holds about N MiB (default 64) of buffers of one size, plus a
+// "mixed" set of sizes drawn uniformly from 1..4096 bytes, which is what a
+// tree of source files looks like to the hasher. "batch of 1" hashes the
+// same buffers through sha1_batch one at a time, the cost of calling it
+// where only one buffer is at hand.
+
+#include "../src/sha1_batch.h"
+
+#include <bits/stdc++.h>
+#include <openssl/sha.h>
+
+using namespace std;
+
+typedef unsigned char Digest[20];
+
+static double now_s() {
+    return chrono::duration<double>(chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+int main(int argc, char **argv) {
+    size_t mib = 64;
+    int runs = 3;
+    for (int i = 1; i < argc; ++i) {
+        string a = argv[i];
+        if (a == "--mib" && i + 1 < argc) mib = stoul(argv[++i]);
+        else if (a == "--runs" && i + 1 < argc) runs = stoi(argv[++i]);
+        else {
+            cerr << "usage: " << argv[0] << " [--mib N] [--runs R]\n";
+            return 1;
+        }
+    }
+
+    mt19937_64 rng(42);
+    vector<pair<string, vector<size_t>>> sets;
+    for (size_t size : {64, 256, 1024, 4096}) {
+        sets.push_back({to_string(size) + " B", vector<size_t>((mib << 20) / size, size)});
+    }
+    vector<size_t> mixed;
+    uniform_int_distribution<size_t> dist(1, 4096);
+    for (size_t total = 0; total < (mib << 20);) {
+        mixed.push_back(dist(rng));
+        total += mixed.back();
+    }
+    sets.push_back({"mixed <4K", mixed});
+
+    cout << "best implementation: " << sha1_batch_impl() << "\n";
+    cout << left << setw(12) << "set" << setw(14) << "impl" << right << setw(12) << "MB/s" << "\n";
+    bool all_ok = true;
+    for (auto &[name, sizes] : sets) {
+        size_t total = accumulate(sizes.begin(), sizes.end(), size_t(0));
+        string arena(total, '\0');
+        for (char &c : arena) c = (char)rng();
+        vector<Sha1Input> in(sizes.size());
+        size_t off = 0;
+        for (size_t i = 0; i < sizes.size(); ++i) {
+            in[i] = {arena.data() + off, sizes[i]};
+            off += sizes[i];
+        }
+        vector<array<unsigned char, 20>> expect(in.size()), got(in.size());
+        for (size_t i = 0; i < in.size(); ++i) {
+            SHA1((const unsigned char *)in[i].data, in[i].len, expect[i].data());
+        }
+
+        auto report = [&](const string &impl, const function<void()> &run) {
+            double best = 1e30;
+            for (int r = 0; r < runs; ++r) {
+                fill(got.begin(), got.end(), array<unsigned char, 20>{});
+                double t0 = now_s();
+                run();
+                best = min(best, now_s() - t0);
+            }
+            bool ok = got == expect;
+            all_ok &= ok;
+            cout << left << setw(12) << name << setw(14) << impl << right << setw(12) << fixed
+                 << setprecision(1) << total / best / 1e6 << (ok ? "" : "   DIGEST MISMATCH") << "\n";
+        };
+
+        report("SHA1()", [&] {
+            for (size_t i = 0; i < in.size(); ++i) {
+                SHA1((const unsigned char *)in[i].data, in[i].len, got[i].data());
+            }
+        });
+        for (const char *impl : {"openssl", "sha-ni", "avx2", "avx512"}) {
+            if (!sha1_batch_select(impl)) continue;
+            report(impl, [&] { sha1_batch(in.data(), in.size(), (Digest *)got.data()); });
+        }
+        report("batch of 1", [&] {
+            for (size_t i = 0; i < in.size(); ++i) sha1_batch(&in[i], 1, (Digest *)got[i].data());
+        });
+        sha1_batch_select("avx512") || sha1_batch_select("avx2") || sha1_batch_select("sha-ni");
+    }
+    return all_ok ? 0 : 1;
+}
@@ -0,0 +1,270 @@
+#include "bloom.h"
+#include "git_utils.h"
+
+#include <bits/stdc++.h>
+#include <unistd.h>
+
+using namespace std;
+
+static const uint32_t BLOOM_VERSION = 1;
+static const uint32_t NUM_HASHES = 7;
+static const uint32_t BITS_PER_PATH = 10;
+static const size_t MAX_CHANGED_PATHS = 512;
+static const size_t RAW_SHA_LEN = 20;
+static const size_t HEADER_LEN = 20;
+static const size_t ROW_LEN = RAW_SHA_LEN + 8;
+
+static uint32_t get_be32(const unsigned char *p) {
+    return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | (uint32_t)p[3];
+}
+
+static void put_be32(string &out, uint32_t v) {
+    out.push_back((char)(v >> 24));
+    out.push_back((char)(v >> 16));
+    out.push_back((char)(v >> 8));
+    out.push_back((char)v);
+}
+
+static string bloom_path() {
+    return REPO_DIR + "/objects/info/commit-graph-bloom";
+}
+
+static uint32_t rotl32(uint32_t x, int r) {
+    return (x << r) | (x >> (32 - r));
+}
+
+static uint32_t murmur3_32(const string &key, uint32_t seed) {
+    const uint32_t c1 = 0xcc9e2d51, c2 = 0x1b873593;
+    const unsigned char *data = (const unsigned char *)key.data();
+    size_t len = key.size(), nblocks = len / 4;
+    uint32_t h = seed;
+    for (size_t i = 0; i < nblocks; ++i) {
+        uint32_t k = (uint32_t)data[4 * i] | ((uint32_t)data[4 * i + 1] << 8) |
+                     ((uint32_t)data[4 * i + 2] << 16) | ((uint32_t)data[4 * i + 3] << 24);
+        k *= c1;
+        k = rotl32(k, 15);
+        k *= c2;
+        h ^= k;
+        h = rotl32(h, 13);
+        h = h * 5 + 0xe6546b64;
+    }
+    const unsigned char *tail = data + nblocks * 4;
+    uint32_t k = 0;
+    switch (len & 3) {
+        case 3: k ^= (uint32_t)tail[2] << 16; // fallthrough
+        case 2: k ^= (uint32_t)tail[1] << 8;  // fallthrough
+        case 1:
+            k ^= tail[0];
+            k *= c1;
+            k = rotl32(k, 15);
+            k *= c2;
+            h ^= k;
+    }
+    h ^= (uint32_t)len;
+    h ^= h >> 16;
+    h *= 0x85ebca6b;
+    h ^= h >> 13;
+    h *= 0xc2b2ae35;
+    h ^= h >> 16;
+    return h;
+}
+
+// Double hashing: bit i is h1 + i * h2, modulo the filter size.
+template <typename F>
+static void for_each_bit(const string &key, uint64_t nbits, F fn) {
+    uint32_t h1 = murmur3_32(key, 0x293ae76f);
+    uint32_t h2 = murmur3_32(key, 0x7e646e2c);
+    for (uint32_t i = 0; i < NUM_HASHES; ++i) {
+        fn((uint32_t)(h1 + i * h2) % nbits);
+    }
+}
+
+static bool filter_contains(const string &bits, const string &key) {
+    if (bits.empty()) return false;
+    bool all = true;
+    for_each_bit(key, bits.size() * 8, [&](uint64_t bit) {
+        if (!(bits[bit / 8] & (1 << (bit % 8)))) all = false;
+    });
+    return all;
+}
+
+static void filter_add(string &bits, const string &key) {
+    for_each_bit(key, bits.size() * 8, [&](uint64_t bit) {
+        bits[bit / 8] |= (char)(1 << (bit % 8));
+    });
+}
+
+static void add_with_dirs(const string &path, set<string> &keys) {
+    keys.insert(path);
+    for (size_t slash = path.find('/'); slash != string::npos; slash = path.find('/', slash + 1)) {
+        keys.insert(path.substr(0, slash));
+    }
+}
+
+static string parent_tree(const GraphCommit &commit) {
+    if (commit.parent.empty()) return string();
+    GraphCommit parent;
+    if (!load_commit(commit.parent, parent)) return string();
+    return parent.tree;
+}
+
+ChangedPathFilters::ChangedPathFilters() {
+    file = read_file(bloom_path());
+    const unsigned char *p = (const unsigned char *)file.data();
+    bool ok = file.size() >= HEADER_LEN + RAW_SHA_LEN && memcmp(p, "BLOM", 4) == 0 &&
+              get_be32(p + 4) == BLOOM_VERSION && get_be32(p + 12) == NUM_HASHES &&
+              get_be32(p + 16) == BITS_PER_PATH;
+    if (ok) {
+        count = get_be32(p + 8);
+        ok = file.size() >= HEADER_LEN + (size_t)count * ROW_LEN + RAW_SHA_LEN &&
+             sha1_hex(file.substr(0, file.size() - RAW_SHA_LEN)) ==
+                 to_hex(p + file.size() - RAW_SHA_LEN, RAW_SHA_LEN);
+    }
+    if (!ok) {
+        if (!file.empty()) cerr << "warning: ignoring corrupt " << bloom_path() << "\n";
+        file.clear();
+        count = 0;
+    }
+}
+
+bool ChangedPathFilters::lookup(const string &sha, Filter &out) const {
+    unsigned char raw[RAW_SHA_LEN];
+    if (!count || sha.size() != 2 * RAW_SHA_LEN || !from_hex(sha, raw)) return false;
+    const unsigned char *rows = (const unsigned char *)file.data() + HEADER_LEN;
+    const unsigned char *data = rows + (size_t)count * ROW_LEN;
+    size_t data_len = file.size() - RAW_SHA_LEN - (data - (const unsigned char *)file.data());
+    uint32_t lo = 0, hi = count;
+    while (lo < hi) {
+        uint32_t mid = lo + (hi - lo) / 2;
+        const unsigned char *row = rows + (size_t)mid * ROW_LEN;
+        int cmp = memcmp(row, raw, RAW_SHA_LEN);
+        if (cmp == 0) {
+            uint32_t offset = get_be32(row + RAW_SHA_LEN);
+            uint32_t len = get_be32(row + RAW_SHA_LEN + 4);
+            out.always = offset == BLOOM_ALWAYS;
+            out.bits.clear();
+            if (!out.always) {
+                if ((size_t)offset + len > data_len) return false;
+                out.bits.assign((const char *)data + offset, len);
+            }
+            return true;
+        }
+        if (cmp < 0) lo = mid + 1;
+        else hi = mid;
+    }
+    return false;
+}
+
+bool ChangedPathFilters::build(const GraphCommit &commit, Filter &out) {
+    vector<TreeChange> diff;
+    if (!diff_trees(parent_tree(commit), commit.tree, "", diff)) return false;
+    set<string> keys;
+    for (auto &d : diff) add_with_dirs(d.path, keys);
+
+    out = Filter();
+    if (keys.size() > MAX_CHANGED_PATHS) {
+        out.always = true;
+        return true;
+    }
+    out.bits.assign((keys.size() * BITS_PER_PATH + 7) / 8, '\0');
+    for (const string &k : keys) filter_add(out.bits, k);
+    return true;
+}
+
+bool ChangedPathFilters::maybe_changed(const string &sha, const GraphCommit &commit, const vector<string> &paths) {
+    Filter f;
+    if (!lookup(sha, f)) {
+        auto it = added.find(sha);
+        if (it != added.end()) {
+            f = it->second;
+        } else {
+            if (!build(commit, f)) return true;
+            added[sha] = f;
+        }
+    }
+    if (f.always) return true;
+
+    // Every leading directory of a changed path is in the filter too, so
+    // all of them must hit for the path to possibly have changed.
+    for (const string &path : paths) {
+        set<string> keys;
+        add_with_dirs(path, keys);
+        bool all = true;
+        for (const string &k : keys) {
+            if (!filter_contains(f.bits, k)) {
+                all = false;
+                break;
+            }
+        }
+        if (all) return true;
+    }
+    return false;
+}
+
+bool ChangedPathFilters::compute(const vector<string> &shas) {
+    for (const string &sha : shas) {
+        Filter f;
+        if (added.count(sha) || lookup(sha, f)) continue;
+        GraphCommit commit;
+        if (!load_commit(sha, commit) || !build(commit, f)) {
+            cerr << "error: cannot compute changed paths for " << sha << "\n";
+            return false;
+        }
+        added[sha] = f;
+    }
+    return true;
+}
+
+bool ChangedPathFilters::save() {
+    if (added.empty()) return true;
+
+    map<string, Filter> all;
+    const unsigned char *rows = (const unsigned char *)file.data() + HEADER_LEN;
+    for (uint32_t i = 0; i < count; ++i) {
+        string sha = to_hex(rows + (size_t)i * ROW_LEN, RAW_SHA_LEN);
+        Filter f;
+        if (lookup(sha, f)) all[sha] = f;
+    }
+    for (auto &kv : added) all[kv.first] = kv.second;
+
+    string out = "BLOM";
+    put_be32(out, BLOOM_VERSION);
+    put_be32(out, (uint32_t)all.size());
+    put_be32(out, NUM_HASHES);
+    put_be32(out, BITS_PER_PATH);
+    string data;
+    unsigned char raw[RAW_SHA_LEN];
+    for (auto &kv : all) {
+        from_hex(kv.first, raw);
+        out.append((const char *)raw, RAW_SHA_LEN);
+        put_be32(out, kv.second.always ? BLOOM_ALWAYS : (uint32_t)data.size());
+        put_be32(out, (uint32_t)kv.second.bits.size());
+        data += kv.second.bits;
+    }
+    out += data;
+    Sha1Stream s;
+    s.update(out.data(), out.size());
+    s.final_raw(raw);
+    out.append((const char *)raw, RAW_SHA_LEN);
+
+    string path = bloom_path();
+    string tmp = path + ".lock";
+    ensure_dir(REPO_DIR + "/objects/info");
+    if (!write_file(tmp, out) || rename(tmp.c_str(), path.c_str()) != 0) {
+        unlink(tmp.c_str());
+        cerr << "error: failed to write " << path << "\n";
+        return false;
+    }
+    return true;
+}
+
+bool commit_touches_paths(const GraphCommit &commit, const vector<string> &paths) {
+    string parent = parent_tree(commit);
+    for (const string &path : paths) {
+        string old_mode, old_sha, new_mode, new_sha;
+        tree_entry(parent, path, old_mode, old_sha);
+        tree_entry(commit.tree, path, new_mode, new_sha);
+        if (old_sha != new_sha || old_mode != new_mode) return true;
+    }
+    return false;
+}
@@ -0,0 +1,61 @@
+#ifndef BLOOM_H
+#define BLOOM_H
+
+#include "commit_graph.h"
+
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+using namespace std;
+
+// Changed-path Bloom filters, one per commit, kept next to the commit-graph
+// in .mygit/objects/info/commit-graph-bloom. A commit's filter holds every
+// path its tree diff against the first parent touches, including each
+// leading directory, so "did this commit touch <path>?" can usually be
+// answered "no" without reading a single tree. Layout (big-endian):
+//   "BLOM" | u32 version | u32 commit count | u32 hashes per path | u32 bits per path
+//   per commit, sorted by name: 20-byte name | u32 offset | u32 length
+//   filter bytes
+//   20-byte SHA-1 of everything above
+// An offset of BLOOM_ALWAYS marks a commit that changed too many paths to
+// be worth filtering; it matches every query.
+
+const uint32_t BLOOM_ALWAYS = 0xffffffffu;
+
+class ChangedPathFilters {
+public:
+    ChangedPathFilters();
+
+    // False means the commit definitely did not change any of `paths`;
+    // true means it may have. Filters missing from the file are computed
+    // from the tree diff and kept for save().
+    bool maybe_changed(const string &sha, const GraphCommit &commit, const vector<string> &paths);
+
+    // Computes the filter for every commit in `shas` that lacks one.
+    bool compute(const vector<string> &shas);
+
+    // Rewrites the side file when new filters were computed.
+    bool save();
+
+    size_t computed() const { return added.size(); }
+
+private:
+    struct Filter {
+        bool always = false;
+        string bits;
+    };
+
+    string file;  // contents of the side file, if valid
+    uint32_t count = 0;
+    unordered_map<string, Filter> added;
+
+    bool lookup(const string &sha, Filter &out) const;
+    bool build(const GraphCommit &commit, Filter &out);
+};
+
+// Whether `commit` changed the entry at any of `paths` relative to its
+// first parent. Reads only the trees along those paths.
+bool commit_touches_paths(const GraphCommit &commit, const vector<string> &paths);
+
+#endif // BLOOM_H
@@ -0,0 +1,173 @@
+#include "chunked.h"
+#include "config.h"
+#include "pack.h"
+
+#include <bits/stdc++.h>
+#include <unistd.h>
+
+using namespace std;
+
+uint64_t chunk_threshold() {
+    static uint64_t threshold = (uint64_t)max(0L, config_get_int("core.chunkthreshold", 0));
+    return threshold;
+}
+
+// Gear table: one fixed pseudo-random 64-bit value per byte value. It must
+// never change, or identical content would stop producing identical chunks.
+static const array<uint64_t, 256> &gear() {
+    static const array<uint64_t, 256> table = [] {
+        array<uint64_t, 256> t;
+        uint64_t x = 0x6d79676974636463ULL;  // splitmix64
+        for (auto &v : t) {
+            uint64_t z = (x += 0x9e3779b97f4a7c15ULL);
+            z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+            z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+            v = z ^ (z >> 31);
+        }
+        return t;
+    }();
+    return table;
+}
+
+// Normalised chunking: a cut needs 18 zero bits of the hash before
+// CDC_AVG and only 14 after it, which keeps most chunks close to the
+// average. The gear hash shifts left, so its top bits cover the most
+// recent 64 bytes.
+static const uint64_t MASK_STRICT = ~0ULL << (64 - 18);
+static const uint64_t MASK_LOOSE = ~0ULL << (64 - 14);
+
+size_t cdc_cut_point(const unsigned char *data, size_t len) {
+    if (len <= CDC_MIN) return len;
+    const array<uint64_t, 256> &g = gear();
+    size_t end = min(len, CDC_MAX);
+    size_t normal = min(end, CDC_AVG);
+    uint64_t h = 0;
+    size_t i = CDC_MIN;
+    for (; i < normal; ++i) {
+        h = (h << 1) + g[data[i]];
+        if (!(h & MASK_STRICT)) return i + 1;
+    }
+    for (; i < end; ++i) {
+        h = (h << 1) + g[data[i]];
+        if (!(h & MASK_LOOSE)) return i + 1;
+    }
+    return end;
+}
+
+// Chunks already in the store (from an earlier revision, or repeated
+// within this file) are hashed but not compressed or written again.
+static string store_chunk(const char *data, size_t len) {
+    string buf = build_object_buffer("blob", string(data, len));
+    string sha = sha1_hex(buf);
+    if (object_exists(sha)) return sha;
+    string compressed = compress_data(buf);
+    if (compressed.empty() || !write_loose_object(sha, compressed)) return string();
+    return sha;
+}
+
+// The file is read in 64 KiB pieces into a window that always holds
+// at least CDC_MAX bytes ahead of the next cut, so memory use is bounded
+// by the largest chunk rather than by the file.
+string write_chunked_blob(int fd, uint64_t size, const string &path) {
+    string hdr = "blob " + to_string(size) + '\0';
+    Sha1Stream hash;
+    hash.update(hdr.data(), hdr.size());
+    string manifest = "size " + to_string(size) + "\n";
+
+    string window;
+    size_t pos = 0;
+    uint64_t total = 0;
+    bool eof = false;
+    vector<char> in(64 * 1024);
+    while (true) {
+        while (!eof && window.size() - pos < CDC_MAX) {
+            ssize_t n = read(fd, in.data(), in.size());
+            if (n < 0) {
+                if (errno == EINTR) continue;
+                cerr << "error: cannot read " << path << "\n";
+                return string();
+            }
+            if (n == 0) {
+                eof = true;
+                break;
+            }
+            hash.update(in.data(), n);
+            window.append(in.data(), n);
+            total += n;
+        }
+        if (pos == window.size()) break;
+        size_t len = cdc_cut_point((const unsigned char *)window.data() + pos, window.size() - pos);
+        string chunk_sha = store_chunk(window.data() + pos, len);
+        if (chunk_sha.empty()) {
+            cerr << "error: failed to write a chunk of " << path << "\n";
+            return string();
+        }
+        manifest += chunk_sha + " " + to_string(len) + "\n";
+        pos += len;
+        if (pos >= CDC_MAX) {
+            window.erase(0, pos);
+            pos = 0;
+        }
+    }
+    if (total != size) {
+        cerr << "error: " << path << " changed while it was being read\n";
+        return string();
+    }
+
+    string sha = hash.final_hex();
+    if (object_exists(sha)) return sha;
+    string compressed = compress_data(build_object_buffer(CHUNKED_TYPE, manifest));
+    if (compressed.empty() || !write_loose_object(sha, compressed)) {
+        cerr << "error: failed to write object for " << path << "\n";
+        return string();
+    }
+    return sha;
+}
+
+bool parse_chunk_manifest(const string &manifest, uint64_t &size, vector<BlobChunk> &chunks) {
+    istringstream in(manifest);
+    string word;
+    if (!(in >> word >> size) || word != "size") return false;
+    chunks.clear();
+    uint64_t sum = 0;
+    BlobChunk c;
+    while (in >> c.sha >> c.size) {
+        if (c.sha.size() != 40) return false;
+        sum += c.size;
+        chunks.push_back(c);
+    }
+    return in.eof() && sum == size;
+}
+
+// Chunks are read around the object cache: they are only useful as part
+// of the whole blob, which read_object caches instead.
+bool read_chunked_blob(const string &manifest, string &data) {
+    uint64_t size;
+    vector<BlobChunk> chunks;
+    if (!parse_chunk_manifest(manifest, size, chunks)) return false;
+    data.clear();
+    data.reserve(size);
+    for (const BlobChunk &c : chunks) {
+        pair<string, string> obj;
+        if (!read_packed_object(c.sha, obj.first, obj.second)) obj = read_loose_object(c.sha);
+        if (obj.first != "blob" || obj.second.size() != c.size) return false;
+        data += obj.second;
+    }
+    return true;
+}
+
+bool stream_chunked_blob(const string &manifest, const ObjectSink &sink) {
+    uint64_t size;
+    vector<BlobChunk> chunks;
+    if (!parse_chunk_manifest(manifest, size, chunks)) return false;
+    for (const BlobChunk &c : chunks) {
+        string type;
+        uint64_t got = 0;
+        bool ok = stream_object(c.sha, type, [&](const char *data, size_t len) {
+            got += len;
+            return sink(data, len);
+        });
+        if (!ok || type != "blob" || got != c.size) return false;
+    }
+    return true;
+}
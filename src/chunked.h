@@ -0,0 +1,48 @@
+#ifndef CHUNKED_H
+#define CHUNKED_H
+
+#include "git_utils.h"
+
+#include <string>
+#include <vector>
+
+using namespace std;
+
+// Chunked blobs. With core.chunkThreshold set, a blob at least that large
+// is cut at content-defined boundaries (FastCDC over a gear rolling hash)
+// and each piece is stored as an ordinary blob object. The blob keeps its
+// usual name, but what is stored under it is a "chunked" manifest:
+//   "size <total bytes>\n"
+//   one "<chunk sha> <chunk bytes>\n" line per chunk, in file order
+// An edit only moves the boundaries near it, so a new revision of a large
+// file stores just the chunks it changed. read_object, read_object_header
+// and stream_object reassemble chunked blobs: nothing above the object
+// store sees the difference.
+
+const char CHUNKED_TYPE[] = "chunked";
+
+// Chunk sizes: no cut before CDC_MIN, cuts become likely around CDC_AVG,
+// and a chunk never exceeds CDC_MAX.
+const size_t CDC_MIN = 16 << 10;
+const size_t CDC_AVG = 64 << 10;
+const size_t CDC_MAX = 256 << 10;
+
+// core.chunkThreshold in bytes; 0 (the default) turns chunking off.
+uint64_t chunk_threshold();
+
+// Length of the first chunk of `data`, at most CDC_MAX.
+size_t cdc_cut_point(const unsigned char *data, size_t len);
+
+// Stores the `size` bytes read from `fd` as a chunked blob and returns
+// its name, or "" on failure.
+string write_chunked_blob(int fd, uint64_t size, const string &path);
+
+struct BlobChunk {
+    string sha;
+    uint64_t size;
+};
+bool parse_chunk_manifest(const string &manifest, uint64_t &size, vector<BlobChunk> &chunks);
+bool read_chunked_blob(const string &manifest, string &data);
+bool stream_chunked_blob(const string &manifest, const ObjectSink &sink);
+
+#endif // CHUNKED_H
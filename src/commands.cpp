@@ -1,5 +1,16 @@
 #include "commands.h"
 #include "git_utils.h"
+#include "pack.h"
+#include "commit_graph.h"
+#include "bloom.h"
+#include "parallel.h"
+#include "trace.h"
+#include "tree.h"
+#include "config.h"
+#include "fsmonitor.h"
+#include "walker.h"
+#include "ignore.h"
+#include "diff.h"
 
 #include <bits/stdc++.h>
 #include <unistd.h>
@@ -19,6 +30,7 @@ int cmd_init() {
     ensure_dir(REPO_DIR + "/objects");
     ensure_dir(REPO_DIR + "/refs/heads");
     write_file(REPO_DIR + "/HEAD", string("ref: refs/heads/master\n"));
+    write_initial_config();
     cout << "Initialized empty mygit repository in " << REPO_DIR << "\n";
     return 0;
 }
@@ -34,46 +46,128 @@ int cmd_hash_object(const vector<string> &args) {
         cerr << "usage: mygit hash-object [-w] <file>\n";
         return 1;
     }
-    string data = read_file(file);
-    if (data.empty() && access(file.c_str(), F_OK) != 0) {
+    if (access(file.c_str(), R_OK) != 0) {
         cerr << "error: cannot read file: " << file << "\n";
         return 1;
     }
-    string sha = hash_object_from_data("blob", data, write);
+    string sha = hash_object_from_file(file, write);
+    if (sha.empty()) {
+        cerr << "error: failed to hash file: " << file << "\n";
+        return 1;
+    }
     cout << sha << "\n";
     return 0;
 }
 
+// Serves one object name per stdin line until EOF, in git's batch format:
+// "<sha> <type> <size>\n", then (unless check_only) the raw body and a
+// newline; unknown names get "<name> missing\n". stdout is fully buffered
+// and flushed after every request, so a caller can interleave writes and
+// reads over a pipe.
+static int cat_file_batch(bool check_only) {
+    static char buf[1 << 16];
+    setvbuf(stdout, buf, _IOFBF, sizeof(buf));
+    string line;
+    while (getline(cin, line)) {
+        while (!line.empty() && (line.back() == '\r' || line.back() == ' ')) line.pop_back();
+        string type;
+        uint64_t size;
+        if (line.empty() || !read_object_header(line, type, size)) {
+            printf("%s missing\n", line.c_str());
+            fflush(stdout);
+            continue;
+        }
+        printf("%s %s %llu\n", line.c_str(), type.c_str(), (unsigned long long)size);
+        if (!check_only) {
+            uint64_t written = 0;
+            bool ok = stream_object(line, type, [&](const char *data, size_t len) {
+                written += len;
+                return fwrite(data, 1, len, stdout) == len;
+            });
+            if (!ok || written != size) {
+                fflush(stdout);
+                cerr << "fatal: failed to read object: " << line << "\n";
+                return 1;
+            }
+            fputc('\n', stdout);
+        }
+        if (fflush(stdout) != 0) return 1;
+    }
+    return 0;
+}
+
 int cmd_cat_file(const vector<string> &args) {
     if (!repo_exists()) {
         cerr << "fatal: not a mygit repository (or any parent up to mount point)\n";
         return 1;
     }
+    if (args.size() == 1 && (args[0] == "--batch" || args[0] == "--batch-check")) {
+        return cat_file_batch(args[0] == "--batch-check");
+    }
     if (args.size() < 2) {
         cerr << "usage: mygit cat-file <flag> <object_sha>\n";
+        cerr << "       mygit cat-file (--batch | --batch-check) < <object_shas>\n";
         cerr << "  -p : print contents\n";
         cerr << "  -t : print type\n";
         cerr << "  -s : print size in bytes\n";
+        cerr << "  --batch       : print \"<sha> <type> <size>\" and the contents of each object named on stdin\n";
+        cerr << "  --batch-check : print only \"<sha> <type> <size>\" for each object named on stdin\n";
         return 1;
     }
     string flag = args[0];
     string sha = args[1];
-    auto p = read_object(sha);
-    if (p.first.empty()) {
+    if (flag != "-p" && flag != "-t" && flag != "-s") {
+        cerr << "unknown flag: " << flag << "\n";
+        return 1;
+    }
+
+    // -t and -s only need the object header; the body is never inflated.
+    if (flag != "-p") {
+        string type;
+        uint64_t size;
+        if (!read_object_header(sha, type, size)) {
+            cerr << "error: object not found: " << sha << "\n";
+            return 1;
+        }
+        if (flag == "-t") cout << type << "\n";
+        else cout << size << "\n";
+        return 0;
+    }
+
+    // Binary trees are printed one "mode name\tsha" line per entry, the
+    // same text the original tree format stored.
+    string type;
+    uint64_t size;
+    if (read_object_header(sha, type, size) && type == "tree") {
+        auto p = read_object(sha);
+        TreeIterator it(p.second);
+        TreeEntry e;
+        while (it.next(e)) cout << e.mode << " " << e.name << "\t" << e.sha_hex() << "\n";
+        if (it.bad()) {
+            cerr << "error: malformed tree: " << sha << "\n";
+            return 1;
+        }
+        return 0;
+    }
+
+    cout.flush();
+    char last = '\n';
+    bool empty = true;
+    bool ok = stream_object(sha, type, [&](const char *data, size_t len) {
+        empty = false;
+        last = data[len - 1];
+        return fwrite(data, 1, len, stdout) == len;
+    });
+    if (!ok && empty) {
         cerr << "error: object not found: " << sha << "\n";
         return 1;
     }
-    if (flag == "-p") {
-        cout << p.second;
-        if (p.second.empty() || p.second.back() != '\n') cout << '\n';
-    } else if (flag == "-t") {
-        cout << p.first << "\n";
-    } else if (flag == "-s") {
-        cout << p.second.size() << "\n";
-    } else {
-        cerr << "unknown flag: " << flag << "\n";
+    if (!ok) {
+        cerr << "error: failed to read object: " << sha << "\n";
         return 1;
     }
+    if (empty || last != '\n') fputc('\n', stdout);
+    fflush(stdout);
     return 0;
 }
 
@@ -122,75 +216,407 @@ int cmd_ls_tree(const vector<string> &args) {
         return 1;
     }
 
-    istringstream ss(p.second);
-    string line;
-    while (getline(ss, line)) {
-        if (line.empty()) continue;
-        size_t tab = line.find('\t');
-        string left = (tab == string::npos) ? line : line.substr(0, tab);
-        string entry_sha = (tab == string::npos) ? string() : line.substr(tab + 1);
-
-        size_t sp = left.find(' ');
-        string mode, name;
-        if (sp != string::npos) {
-            mode = left.substr(0, sp);
-            name = left.substr(sp + 1);
+    TreeIterator it(p.second);
+    TreeEntry e;
+    while (it.next(e)) {
+        if (name_only) cout << e.name << "\n";
+        else cout << e.mode << " " << e.name << "\t" << e.sha_hex() << "\n";
+    }
+    if (it.bad()) {
+        cerr << "error: malformed tree: " << sha << "\n";
+        return 1;
+    }
+    return 0;
+}
+
+int cmd_add(const vector<string> &args) {
+    if (!repo_exists()) {
+        cerr << "fatal: not a mygit repository\n";
+        return 1;
+    }
+    vector<string> files;
+    vector<string> paths;
+    unsigned jobs = default_jobs();
+    for (size_t i = 0; i < args.size(); ++i) {
+        if (args[i] == "-j" || (args[i].size() > 2 && args[i].compare(0, 2, "-j") == 0)) {
+            string value = args[i].size() > 2 ? args[i].substr(2) : (i + 1 < args.size() ? args[++i] : string());
+            jobs = parse_jobs(value);
+            if (jobs == 0) {
+                cerr << "error: invalid thread count: " << value << "\n";
+                return 1;
+            }
+        } else {
+            paths.push_back(args[i]);
+        }
+    }
+    if (paths.size() == 0) {
+        cerr << "usage: mygit add [-j <threads>] . | <paths...>\n";
+        return 1;
+    }
+    filesystem::path cwd = filesystem::current_path();
+    
+    // "add ." asks the fsmonitor daemon, when one runs, what changed since
+    // the token saved by the previous "add ." and only looks at those
+    // paths; otherwise it walks the whole tree.
+    // Tracked files gone from beneath a scanned directory are removed from
+    // the index, and tracked files the walk skipped as ignored are still
+    // checked, so "add ." leaves it matching the working tree.
+    bool all = paths.size() == 1 && paths[0] == ".";
+    bool incremental = false;
+    string new_token;
+    vector<string> prune;
+    {
+        vector<string> changed;
+        if (all && (incremental = fsmonitor_query(read_index_fsmonitor_token(), new_token, changed))) {
+            for (const string &c : changed) {
+                struct stat st;
+                if (lstat(c.c_str(), &st) != 0) continue;
+                if (S_ISDIR(st.st_mode)) {
+                    vector<string> sub = walk_worktree(c, jobs);
+                    files.insert(files.end(), sub.begin(), sub.end());
+                } else if (S_ISREG(st.st_mode) && !path_ignored(c, false)) {
+                    files.push_back(c);
+                }
+            }
+            sort(files.begin(), files.end());
+            files.erase(unique(files.begin(), files.end()), files.end());
+            prune = changed;
+            if (getenv("MYGIT_DEBUG")) {
+                cerr << "[DEBUG] fsmonitor: " << changed.size() << " changed paths, " << files.size() << " files\n";
+            }
+        } else if (all) {
+            files = walk_worktree("", jobs);
+            prune.push_back("");
+        } else {
+            for (auto &a: paths) {
+                filesystem::path p(a);
+                if (!filesystem::exists(p)) {
+                    cerr << "warning: path does not exist: " << a << "\n";
+                    continue;
+                }
+                if (filesystem::is_directory(p)) {
+                    string rel = filesystem::relative(p, cwd).lexically_normal().generic_string();
+                    if (rel == ".") rel.clear();
+                    vector<string> sub = walk_worktree(rel, jobs);
+                    files.insert(files.end(), sub.begin(), sub.end());
+                    prune.push_back(rel);
+                } else if (filesystem::is_regular_file(p)) {
+                    filesystem::path rel = filesystem::relative(p, cwd);
+                    files.push_back(rel.string());
+                }
+            }
+        }
+    }
+    if (files.empty() && prune.empty() && (incremental || new_token.empty())) return 0;
+    if (!add_files_to_index(files, jobs, new_token.empty() ? nullptr : &new_token, &prune)) {
+        cerr << "error: failed to add files to index\n";
+        return 1;
+    }
+    return 0;
+}
+
+// Porcelain output, one "XY path" line per changed tracked path sorted by
+// path, where X compares the index with HEAD and Y the working tree with
+// the index, then one "?? path" line per untracked file. With an fsmonitor token in the index only the paths the
+// daemon reports are looked at; otherwise every index entry is stat'ed (in
+// parallel) and the whole tree is walked for untracked files.
+int cmd_status(const vector<string> &args) {
+    if (!repo_exists()) {
+        cerr << "fatal: not a mygit repository\n";
+        return 1;
+    }
+    unsigned jobs = default_jobs();
+    for (size_t i = 0; i < args.size(); ++i) {
+        if (args[i] == "--porcelain") {
+            continue;
+        } else if (args[i] == "-j" || (args[i].size() > 2 && args[i].compare(0, 2, "-j") == 0)) {
+            string value = args[i].size() > 2 ? args[i].substr(2) : (i + 1 < args.size() ? args[++i] : string());
+            jobs = parse_jobs(value);
+            if (jobs == 0) {
+                cerr << "error: invalid thread count: " << value << "\n";
+                return 1;
+            }
         } else {
-            name = left;
+            cerr << "usage: mygit status [--porcelain] [-j <threads>]\n";
+            return 1;
         }
-        if (name_only) cout << name << "\n";
-        else cout << mode << " " << name << "\t" << entry_sha << "\n";
     }
+
+    string head = read_head();
+    string head_commit = head.find("refs/") == 0 ? read_ref(head) : head;
+    string head_tree = head_commit.empty() ? string() : get_tree_sha_from_commit(head_commit);
+    if (!head_commit.empty() && head_tree.empty()) {
+        cerr << "error: cannot read HEAD commit " << head_commit << "\n";
+        return 1;
+    }
+
+    CacheTree cache_tree;
+    string token;
+    vector<IndexEntry> entries;
+    if (!read_index(entries, &cache_tree, &token)) return 1;
+    vector<StatusChange> staged, unstaged;
+    if (!diff_index_against_tree(entries, cache_tree, head_tree, staged)) {
+        cerr << "error: cannot compare the index with HEAD\n";
+        return 1;
+    }
+
+    unordered_set<string> tracked;
+    tracked.reserve(entries.size());
+    for (auto &e : entries) tracked.insert(e.path);
+
+    vector<size_t> which;
+    vector<string> files;
+    string new_token;
+    vector<string> changed;
+    if (!token.empty() && fsmonitor_query(token, new_token, changed)) {
+        // A reported path may be a file or a directory, existing or gone;
+        // index entries at or beneath it are checked, files beneath it
+        // may be untracked.
+        sort(changed.begin(), changed.end());
+        for (size_t i = 0; i < entries.size(); ++i) {
+            const string &p = entries[i].path;
+            bool hit = false;
+            for (string cur = p;;) {
+                if (binary_search(changed.begin(), changed.end(), cur)) {
+                    hit = true;
+                    break;
+                }
+                size_t slash = cur.rfind('/');
+                if (slash == string::npos) break;
+                cur.resize(slash);
+            }
+            if (hit) which.push_back(i);
+        }
+        for (const string &c : changed) {
+            struct stat st;
+            if (lstat(c.c_str(), &st) != 0) continue;
+            if (S_ISDIR(st.st_mode)) {
+                vector<string> sub = walk_worktree(c, jobs);
+                files.insert(files.end(), sub.begin(), sub.end());
+            } else if (S_ISREG(st.st_mode) && !path_ignored(c, false)) {
+                files.push_back(c);
+            }
+        }
+    } else {
+        which.resize(entries.size());
+        iota(which.begin(), which.end(), 0);
+        files = walk_worktree("", jobs);
+    }
+
+    bool refreshed = check_worktree(entries, which, jobs, unstaged);
+    if (refreshed) write_index(entries, &cache_tree, token.empty() ? nullptr : &token);
+
+    map<string, pair<char, char>> lines;
+    for (auto &s : staged) lines[s.path].first = s.code;
+    for (auto &u : unstaged) lines[u.path].second = u.code;
+    string out;
+    for (auto &kv : lines) {
+        out += kv.second.first ? kv.second.first : ' ';
+        out += kv.second.second ? kv.second.second : ' ';
+        out += ' ';
+        out += kv.first;
+        out += '\n';
+    }
+    // Untracked paths follow on lines of their own, so a path staged for
+    // deletion that is back on disk shows both "D " and "??".
+    sort(files.begin(), files.end());
+    files.erase(unique(files.begin(), files.end()), files.end());
+    for (auto &f : files) {
+        if (!tracked.count(f)) out += "?? " + f + "\n";
+    }
+    fwrite(out.data(), 1, out.size(), stdout);
     return 0;
 }
 
-static void collect_files_recursive(const filesystem::path &path, const filesystem::path &base, vector<string> &out) {
-    for (auto &p: filesystem::directory_iterator(path)) {
-        string filename = p.path().filename().string();
-        if (filename[0] == '.') continue;
-        
-        if (filesystem::is_directory(p.path())) {
-            collect_files_recursive(p.path(), base, out);
-        } else if (filesystem::is_regular_file(p.path())) {
-            filesystem::path rel = filesystem::relative(p.path(), base);
-            out.push_back(rel.string());
+// core.bigFileThreshold: files at least this large are reported by diff
+// as differing without being read or line-diffed, as git does.
+static uint64_t big_file_threshold() {
+    static uint64_t threshold = (uint64_t)max(1L, config_get_int("core.bigfilethreshold", 512L << 20));
+    return threshold;
+}
+
+// One side of a file diff: a blob, a working-tree file (`worktree` set,
+// `sha` its blob name), or nothing (`sha` empty).
+struct DiffSide {
+    string sha;
+    string worktree;
+};
+
+static bool diff_side_size(const DiffSide &side, uint64_t &size) {
+    size = 0;
+    if (side.sha.empty()) return true;
+    if (!side.worktree.empty()) {
+        struct stat st;
+        if (stat(side.worktree.c_str(), &st) != 0) return false;
+        size = st.st_size;
+        return true;
+    }
+    string type;
+    return read_object_header(side.sha, type, size);
+}
+
+static bool load_diff_side(const DiffSide &side, string &data) {
+    data.clear();
+    if (side.sha.empty()) return true;
+    if (!side.worktree.empty()) {
+        data = read_file(side.worktree);
+        return !data.empty() || access(side.worktree.c_str(), F_OK) == 0;
+    }
+    auto obj = read_object(side.sha);
+    data = std::move(obj.second);
+    return obj.first == "blob";
+}
+
+// Appends the "diff --git" section for one file. Blobs are only read once
+// both sides are known to be below core.bigFileThreshold.
+static bool append_file_diff(const string &path, const DiffSide &from, const DiffSide &to, int context,
+                             string &out) {
+    string a = from.sha.empty() ? "/dev/null" : "a/" + path;
+    string b = to.sha.empty() ? "/dev/null" : "b/" + path;
+    out += "diff --git a/" + path + " b/" + path + "\n";
+    if (from.sha.empty()) out += "new file mode 100644\n";
+    else if (to.sha.empty()) out += "deleted file mode 100644\n";
+    out += "index " + (from.sha.empty() ? string(7, '0') : from.sha.substr(0, 7)) + ".." +
+           (to.sha.empty() ? string(7, '0') : to.sha.substr(0, 7)) +
+           (from.sha.empty() || to.sha.empty() ? "" : " 100644") + "\n";
+
+    uint64_t from_size, to_size;
+    if (!diff_side_size(from, from_size) || !diff_side_size(to, to_size)) {
+        cerr << "error: cannot read " << path << "\n";
+        return false;
+    }
+    string from_data, to_data;
+    bool binary = max(from_size, to_size) >= big_file_threshold();
+    if (!binary) {
+        if (!load_diff_side(from, from_data) || !load_diff_side(to, to_data)) {
+            cerr << "error: cannot read " << path << "\n";
+            return false;
         }
+        binary = is_binary_data(from_data) || is_binary_data(to_data);
+    }
+    if (binary) {
+        out += "Binary files " + a + " and " + b + " differ\n";
+        return true;
     }
+    string hunks;
+    diff_lines(from_data, to_data, context, hunks);
+    if (!hunks.empty()) out += "--- " + a + "\n+++ " + b + "\n" + hunks;
+    return true;
 }
 
-int cmd_add(const vector<string> &args) {
+// "HEAD" or a commit sha; sets `tree` to the commit's tree.
+static bool resolve_diff_commit(const string &name, string &tree) {
+    string sha = name;
+    if (name == "HEAD") {
+        string head = read_head();
+        sha = head.find("refs/") == 0 ? read_ref(head) : head;
+        if (sha.empty()) {
+            tree.clear();  // no commits yet: compare with an empty tree
+            return true;
+        }
+    }
+    tree = get_tree_sha_from_commit(sha);
+    if (tree.empty()) {
+        cerr << "error: not a commit: " << name << "\n";
+        return false;
+    }
+    return true;
+}
+
+// Unified diff of the working tree against the index, of the index
+// against a commit (--cached, HEAD by default), or of two commits. Only
+// files whose blob names differ are read; working-tree files are only
+// hashed when their stat data no longer matches the index.
+int cmd_diff(const vector<string> &args) {
     if (!repo_exists()) {
         cerr << "fatal: not a mygit repository\n";
         return 1;
     }
-    vector<string> files;
-    if (args.size() == 0) {
-        cerr << "usage: mygit add . | <paths...>\n";
+    const char *usage = "usage: mygit diff [-U<n>] [--cached [<commit>] | <commit> <commit>]\n";
+    bool cached = false;
+    int context = 3;
+    vector<string> commits;
+    for (const string &a : args) {
+        if (a == "--cached" || a == "--staged") {
+            cached = true;
+        } else if (a.compare(0, 2, "-U") == 0 || a.compare(0, 10, "--unified=") == 0) {
+            string value = a.substr(a[1] == 'U' ? 2 : 10);
+            if (value.empty() || value.find_first_not_of("0123456789") != string::npos) {
+                cerr << "error: invalid context length: " << value << "\n";
+                return 1;
+            }
+            context = (int)min(stol(value), 1L << 20);
+        } else if (!a.empty() && a[0] == '-') {
+            cerr << usage;
+            return 1;
+        } else {
+            commits.push_back(a);
+        }
+    }
+    if ((cached && commits.size() > 1) || (!cached && commits.size() != 0 && commits.size() != 2)) {
+        cerr << usage;
         return 1;
     }
-    filesystem::path cwd = filesystem::current_path();
-    
-    if (args.size() == 1 && args[0] == ".") {
-        collect_files_recursive(cwd, cwd, files);
+
+    vector<tuple<string, DiffSide, DiffSide>> files;
+    if (commits.size() == 2) {
+        string from_tree, to_tree;
+        if (!resolve_diff_commit(commits[0], from_tree) || !resolve_diff_commit(commits[1], to_tree)) return 1;
+        vector<TreeChange> changes;
+        if (!diff_trees(from_tree, to_tree, "", changes)) {
+            cerr << "error: cannot compare the trees\n";
+            return 1;
+        }
+        for (auto &c : changes) files.emplace_back(c.path, DiffSide{c.old_sha, ""}, DiffSide{c.new_sha, ""});
     } else {
-        for (auto &a: args) {
-            filesystem::path p(a);
-            if (!filesystem::exists(p)) {
-                cerr << "warning: path does not exist: " << a << "\n";
-                continue;
+        CacheTree cache_tree;
+        string token;
+        vector<IndexEntry> entries;
+        if (!read_index(entries, &cache_tree, &token)) return 1;
+        vector<StatusChange> changes;
+        if (cached) {
+            string tree;
+            if (!resolve_diff_commit(commits.empty() ? "HEAD" : commits[0], tree)) return 1;
+            if (!diff_index_against_tree(entries, cache_tree, tree, changes)) {
+                cerr << "error: cannot compare the index with " << (commits.empty() ? "HEAD" : commits[0]) << "\n";
+                return 1;
+            }
+            for (auto &c : changes) {
+                DiffSide from, to;
+                string mode;
+                if (c.code != 'A' && !tree_entry(tree, c.path, mode, from.sha)) {
+                    cerr << "error: cannot find " << c.path << " in the tree\n";
+                    return 1;
+                }
+                if (c.code != 'D') {
+                    auto it = lower_bound(entries.begin(), entries.end(), c.path,
+                                          [](const IndexEntry &e, const string &p) { return e.path < p; });
+                    to.sha = it->sha;
+                }
+                files.emplace_back(c.path, from, to);
+            }
+        } else {
+            vector<size_t> which(entries.size());
+            iota(which.begin(), which.end(), 0);
+            if (check_worktree(entries, which, default_jobs(), changes)) {
+                write_index(entries, &cache_tree, token.empty() ? nullptr : &token);
             }
-            if (filesystem::is_directory(p)) {
-                collect_files_recursive(p, cwd, files);
-            } else if (filesystem::is_regular_file(p)) {
-                filesystem::path rel = filesystem::relative(p, cwd);
-                files.push_back(rel.string());
+            for (auto &c : changes) {
+                auto it = lower_bound(entries.begin(), entries.end(), c.path,
+                                      [](const IndexEntry &e, const string &p) { return e.path < p; });
+                DiffSide to;
+                if (c.code != 'D') to = {hash_object_from_file(c.path, false), c.path};
+                files.emplace_back(c.path, DiffSide{it->sha, ""}, to);
             }
         }
     }
-    if (files.empty()) return 0;
-    if (!add_files_to_index(files)) {
-        cerr << "error: failed to add files to index\n";
-        return 1;
+
+    sort(files.begin(), files.end(), [](const auto &x, const auto &y) { return get<0>(x) < get<0>(y); });
+    string out;
+    for (auto &[path, from, to] : files) {
+        if (!append_file_diff(path, from, to, context, out)) return 1;
+        cout << out;
+        out.clear();
     }
     return 0;
 }
@@ -238,63 +664,234 @@ int cmd_commit(const vector<string> &args) {
         cerr << "error: failed to write ref\n";
         return 1;
     }
+    // Keeping the graph current lets log and rev-list walk new history
+    // without inflating it; the commit itself stands either way.
+    if (config_get_bool("core.commitgraph", true)) {
+        ChangedPathFilters filters;
+        if (write_commit_graph() < 0 || !filters.compute({commit_sha}) || !filters.save()) {
+            cerr << "warning: failed to update the commit-graph\n";
+        }
+    }
     cout << commit_sha << "\n";
     return 0;
 }
 
-int cmd_log(const vector<string> &args) {
-    if (!repo_exists()) {
-        cerr << "fatal: not a mygit repository\n";
-        return 1;
+// Resolves the starting commit shared by log and rev-list: an explicit
+// sha, or the commit HEAD points at.
+static bool resolve_start_commit(const string &arg, string &sha) {
+    if (!arg.empty()) {
+        sha = arg;
+        return true;
     }
-
     string head_ref = read_head();
     if (head_ref.empty()) {
         cerr << "fatal: no HEAD\n";
+        return false;
+    }
+    sha = head_ref.find("refs/") == 0 ? read_ref(head_ref) : head_ref;
+    if (sha.empty()) {
+        cerr << "fatal: no commits on this branch\n";
+        return false;
+    }
+    return true;
+}
+
+// Strips "./" and trailing slashes so pathspecs match tree paths.
+static string normalize_pathspec(string path) {
+    while (path.compare(0, 2, "./") == 0) path.erase(0, 2);
+    while (!path.empty() && path.back() == '/') path.pop_back();
+    return path;
+}
+
+// Parses "[-n <count>] [<commit>] [-- <path>...]". A negative limit means
+// no limit. Paths are only accepted when `paths` is given.
+static bool parse_history_args(const vector<string> &args, const string &usage, long &limit, string &start,
+                               vector<string> *paths = nullptr) {
+    limit = -1;
+    for (size_t i = 0; i < args.size(); ++i) {
+        if (args[i] == "--" && paths) {
+            for (++i; i < args.size(); ++i) {
+                string path = normalize_pathspec(args[i]);
+                if (path.empty() || path == ".") {
+                    paths->clear();  // the whole tree: no limiting
+                    break;
+                }
+                paths->push_back(path);
+            }
+            break;
+        } else if (args[i] == "-n" && i + 1 < args.size()) {
+            try {
+                limit = stol(args[++i]);
+            } catch (...) {
+                cerr << usage;
+                return false;
+            }
+        } else if (!args[i].empty() && args[i][0] != '-' && start.empty()) {
+            start = args[i];
+        } else {
+            cerr << usage;
+            return false;
+        }
+    }
+    return true;
+}
+
+// Parents come from the commit-graph when it covers a commit; the commit
+// object is only read for the author and message being printed. With
+// "-- <path>", the changed-path Bloom filters rule out most commits before
+// any tree is read; a filter hit is confirmed by comparing the entries at
+// those paths with the parent's.
+int cmd_log(const vector<string> &args) {
+    if (!repo_exists()) {
+        cerr << "fatal: not a mygit repository\n";
         return 1;
     }
 
-    string current_sha = read_ref(head_ref);
-    if (current_sha.empty()) {
-        cerr << "fatal: no commits on this branch\n";
+    long limit;
+    string start, current_sha;
+    vector<string> paths;
+    if (!parse_history_args(args, "usage: mygit log [-n <count>] [<commit_sha>] [-- <path>...]\n", limit, start,
+                            &paths)) {
         return 1;
     }
+    if (!resolve_start_commit(start, current_sha)) return 1;
 
-    int count = 0;
-    while (!current_sha.empty() && count < 100) {  
-        auto p = read_object(current_sha);
-        if (p.first.empty() || p.first != "commit") {
+    ChangedPathFilters filters;
+    size_t filtered = 0, false_positives = 0;
+    long count = 0;
+    while (!current_sha.empty() && (limit < 0 || count < limit)) {
+        GraphCommit gc;
+        if (!load_commit(current_sha, gc)) {
+            break;
+        }
+        if (!paths.empty()) {
+            if (!filters.maybe_changed(current_sha, gc, paths)) {
+                filtered++;
+                current_sha = gc.parent;
+                continue;
+            }
+            if (!commit_touches_paths(gc, paths)) {
+                false_positives++;
+                current_sha = gc.parent;
+                continue;
+            }
+        }
+        string author, message;
+        if (!load_commit_text(current_sha, author, message)) {
             break;
         }
-        CommitInfo info = parse_commit(p.second);
         cout << "commit " << current_sha << "\n";
-        cout << "Author: " << info.author << "\n";
-        cout << "Message: " << info.message << "\n";
+        cout << "Author: " << author << "\n";
+        cout << "Message: " << message << "\n";
         cout << "\n";
-        current_sha = info.parent;
+        current_sha = gc.parent;
         count++;
     }
+    if (!paths.empty()) {
+        if (getenv("MYGIT_DEBUG")) {
+            cerr << "[DEBUG] bloom: " << filtered << " skipped, " << false_positives << " false positives, "
+                 << filters.computed() << " filters computed\n";
+        }
+        filters.save();
+    }
     return 0;
 }
 
-int cmd_checkout(const vector<string> &args) {
+// Lists commit names only, so commits covered by the commit-graph are
+// walked without touching any object.
+int cmd_rev_list(const vector<string> &args) {
     if (!repo_exists()) {
         cerr << "fatal: not a mygit repository\n";
         return 1;
     }
-    if (args.size() < 1) {
-        cerr << "usage: mygit checkout [--dry-run] <commit_sha>\n";
+
+    long limit;
+    string start, current_sha;
+    if (!parse_history_args(args, "usage: mygit rev-list [-n <count>] [<commit_sha>]\n", limit, start)) return 1;
+    if (!resolve_start_commit(start, current_sha)) return 1;
+
+    long count = 0;
+    while (!current_sha.empty() && (limit < 0 || count < limit)) {
+        GraphCommit gc;
+        if (!load_commit(current_sha, gc)) {
+            cerr << "error: commit not found: " << current_sha << "\n";
+            return 1;
+        }
+        cout << current_sha << "\n";
+        current_sha = gc.parent;
+        count++;
+    }
+    return 0;
+}
+
+int cmd_commit_graph(const vector<string> &args) {
+    if (!repo_exists()) {
+        cerr << "fatal: not a mygit repository\n";
+        return 1;
+    }
+    if (args.size() != 1 || args[0] != "write") {
+        cerr << "usage: mygit commit-graph write\n";
+        return 1;
+    }
+    vector<string> commits;
+    long n = write_commit_graph(&commits);
+    if (n < 0) return 1;
+    ChangedPathFilters filters;
+    if (!filters.compute(commits) || !filters.save()) return 1;
+    cout << "Wrote commit-graph with " << n << " commits (" << filters.computed() << " new changed-path filters)\n";
+    return 0;
+}
+
+int cmd_fsmonitor(const vector<string> &args) {
+    if (!repo_exists()) {
+        cerr << "fatal: not a mygit repository\n";
+        return 1;
+    }
+    if (args.size() == 1 && args[0] == "start") return fsmonitor_start();
+    if (args.size() == 1 && args[0] == "stop") return fsmonitor_stop();
+    if (args.size() == 1 && args[0] == "status") return fsmonitor_status();
+    cerr << "usage: mygit fsmonitor (start | stop | status)\n";
+    return 1;
+}
+
+int cmd_merge_base(const vector<string> &args) {
+    if (!repo_exists()) {
+        cerr << "fatal: not a mygit repository\n";
+        return 1;
+    }
+    if (args.size() != 3 || args[0] != "--is-ancestor") {
+        cerr << "usage: mygit merge-base --is-ancestor <commit> <commit>\n";
+        return 2;
+    }
+    return is_ancestor(args[1], args[2]) ? 0 : 1;
+}
+
+int cmd_checkout(const vector<string> &args) {
+    if (!repo_exists()) {
+        cerr << "fatal: not a mygit repository\n";
         return 1;
     }
-    
     bool dry_run = false;
+    unsigned jobs = default_jobs();
     string target_commit_sha;
     
-    if (args.size() >= 2 && args[0] == "--dry-run") {
-        dry_run = true;
-        target_commit_sha = args[1];
-    } else {
-        target_commit_sha = args[0];
+    for (size_t i = 0; i < args.size(); ++i) {
+        if (args[i] == "--dry-run") {
+            dry_run = true;
+        } else if (args[i] == "-j" || (args[i].size() > 2 && args[i].compare(0, 2, "-j") == 0)) {
+            string value = args[i].size() > 2 ? args[i].substr(2) : (i + 1 < args.size() ? args[++i] : string());
+            jobs = parse_jobs(value);
+            if (jobs == 0) {
+                cerr << "error: invalid thread count: " << value << "\n";
+                return 1;
+            }
+        } else {
+            target_commit_sha = args[i];
+        }
+    }
+    if (target_commit_sha.empty()) {
+        cerr << "usage: mygit checkout [--dry-run] [-j <threads>] <commit_sha>\n";
+        return 1;
     }
     
     auto target_commit_obj = read_object(target_commit_sha);
@@ -328,36 +925,32 @@ int cmd_checkout(const vector<string> &args) {
         current_commit_sha = read_ref(head_ref);
     }
     
-    vector<CheckoutChange> changes = plan_checkout(target_tree_sha, current_commit_sha);
+    vector<CheckoutChange> changes;
+    if (!plan_checkout(target_tree_sha, current_commit_sha, changes)) {
+        cerr << "error: cannot plan the checkout; nothing was changed\n";
+        return 1;
+    }
+    string current_tree_sha = current_commit_sha.empty() ? string() : get_tree_sha_from_commit(current_commit_sha);
     
-    // DEBUG: Show what's in each tree
-    cerr << "\n[DEBUG] Tree contents:\n";
-    unordered_map<string, string> target_files, current_files;
-    collect_tree_files(target_tree_sha, "", target_files);
-    if (!current_commit_sha.empty()) {
-        string current_tree_sha;
-        auto curr_commit = read_object(current_commit_sha);
-        if (!curr_commit.first.empty()) {
-            istringstream css(curr_commit.second);
-            string cline;
-            while (getline(css, cline)) {
-                if (cline.find("tree ") == 0) {
-                    current_tree_sha = cline.substr(5);
-                    break;
-                }
-            }
-            if (!current_tree_sha.empty()) {
-                collect_tree_files(current_tree_sha, "", current_files);
-            }
+    // The full listing walks both trees completely, so it is opt-in.
+    if (getenv("MYGIT_DEBUG")) {
+        cerr << "\n[DEBUG] Tree contents:\n";
+        unordered_map<string, string> target_files, current_files;
+        collect_tree_files(target_tree_sha, "", target_files);
+        if (!current_tree_sha.empty()) {
+            collect_tree_files(current_tree_sha, "", current_files);
         }
+        cerr << "  Target tree files (" << target_files.size() << "): ";
+        for (auto &kv : target_files) cerr << kv.first << " ";
+        cerr << "\n";
+        cerr << "  Current tree files (" << current_files.size() << "): ";
+        for (auto &kv : current_files) cerr << kv.first << " ";
+        cerr << "\n";
+        ObjectCacheStats cache = object_cache_stats();
+        cerr << "  Object cache: " << cache.hits << " hits, " << cache.misses << " misses, "
+             << cache.entries << " objects (" << cache.bytes << " bytes)\n";
+        cerr << "\n";
     }
-    cerr << "  Target tree files (" << target_files.size() << "): ";
-    for (auto &kv : target_files) cerr << kv.first << " ";
-    cerr << "\n";
-    cerr << "  Current tree files (" << current_files.size() << "): ";
-    for (auto &kv : current_files) cerr << kv.first << " ";
-    cerr << "\n";
-    cerr << "\n";
     
     cout << "Checkout plan for commit " << target_commit_sha.substr(0, 7) << ":\n";
     cout << "Target tree SHA: " << target_tree_sha.substr(0, 7) << "\n";
@@ -384,41 +977,25 @@ int cmd_checkout(const vector<string> &args) {
         return 0;
     }
     
+    // The index is read up front so a damaged one stops the checkout
+    // before any file is touched.
+    vector<IndexEntry> index;
+    CacheTree cache_tree;
+    if (!read_index(index, &cache_tree)) {
+        cerr << "error: cannot read the index; nothing was checked out\n";
+        return 1;
+    }
+
     cout << "Applying changes...\n";
     
-    unordered_map<string, string> target_tree_files;
-    collect_tree_files(target_tree_sha, "", target_tree_files);
-    
-    for (auto &change: changes) {
-        if (change.action == "restore") {
-            const string &path = change.path;
-            string blob_sha = target_tree_files[path];
-            
-            // Create parent directories
-            size_t last_slash = path.rfind('/');
-            if (last_slash != string::npos) {
-                string dir = path.substr(0, last_slash);
-                ensure_dir(dir);
-            }
-            
-            auto blob_obj = read_object(blob_sha);
-            if (blob_obj.first.empty()) {
-                cerr << "error: failed to read blob: " << blob_sha << "\n";
-                continue;
-            }
-            write_file(path, blob_obj.second);
-        } else if (change.action == "delete") {
-            const string &path = change.path;
-            
-            if (filesystem::exists(path)) {
-                try {
-                    filesystem::remove(path);
-                } catch (...) {
-                    cerr << "warning: failed to delete: " << path << "\n";
-                }
-            }
-        }
+    CheckoutResult result;
+    if (!apply_checkout(changes, jobs, result)) {
+        cerr << "warning: " << result.failed << " files could not be written\n";
     }
+    double rate = result.seconds > 0 ? result.written / result.seconds : 0;
+    cout << "Wrote " << result.written << " files, deleted " << result.deleted << " in "
+         << fixed << setprecision(3) << result.seconds << "s (" << setprecision(0) << rate << " files/s)\n";
+    cout.unsetf(ios::floatfield);
     
     // Update HEAD to point to the new commit
     if (!write_ref(head_ref, target_commit_sha)) {
@@ -426,13 +1003,29 @@ int cmd_checkout(const vector<string> &args) {
         return 1;
     }
     
-    // Update index to match target tree
-    vector<tuple<string,string,string>> index_entries;
-    for (auto &kv: target_tree_files) {
-        index_entries.emplace_back(kv.first, "100644", kv.second);
+    if (!update_index_for_checkout(current_tree_sha, target_tree_sha, changes, result.stats, index, cache_tree)) {
+        cerr << "error: failed to update index\n";
+        return 1;
     }
-    write_index(index_entries);
     
     cout << "Checkout complete! HEAD detached at " << target_commit_sha.substr(0, 7) << "\n";
     return 0;
 }
+
+int cmd_repack() {
+    if (!repo_exists()) {
+        cerr << "fatal: not a mygit repository\n";
+        return 1;
+    }
+    size_t deltas = 0, pruned = 0;
+    long packed = repack_loose_objects(deltas, pruned);
+    if (packed < 0) {
+        cerr << "error: repack failed\n";
+        return 1;
+    }
+    if (packed == 0) cout << "Nothing new to pack";
+    else cout << "Packed " << packed << " objects (" << deltas << " deltas)";
+    if (pruned) cout << ", removed " << pruned << " loose objects";
+    cout << "\n";
+    return 0;
+}
@@ -13,5 +13,12 @@ int cmd_add(const std::vector<std::string> &args);
 int cmd_commit(const std::vector<std::string> &args);
 int cmd_log(const std::vector<std::string> &args);
 int cmd_checkout(const std::vector<std::string> &args);
+int cmd_repack();
+int cmd_rev_list(const std::vector<std::string> &args);
+int cmd_commit_graph(const std::vector<std::string> &args);
+int cmd_merge_base(const std::vector<std::string> &args);
+int cmd_fsmonitor(const std::vector<std::string> &args);
+int cmd_status(const std::vector<std::string> &args);
+int cmd_diff(const std::vector<std::string> &args);
 
 #endif // COMMANDS_H
@@ -0,0 +1,336 @@
+#include "commit_graph.h"
+#include "git_utils.h"
+
+#include <bits/stdc++.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <unistd.h>
+
+using namespace std;
+
+static const size_t RAW_SHA_LEN = 20;
+static const size_t RECORD_LEN = RAW_SHA_LEN + 4 + 4 + 4 + 8;
+static const uint32_t GRAPH_VERSION = 2;
+
+static uint32_t get_be32(const unsigned char *p) {
+    return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | (uint32_t)p[3];
+}
+
+static uint64_t get_be64(const unsigned char *p) {
+    return ((uint64_t)get_be32(p) << 32) | get_be32(p + 4);
+}
+
+static void put_be32(string &out, uint32_t v) {
+    out.push_back((char)(v >> 24));
+    out.push_back((char)(v >> 16));
+    out.push_back((char)(v >> 8));
+    out.push_back((char)v);
+}
+
+static void put_be64(string &out, uint64_t v) {
+    put_be32(out, (uint32_t)(v >> 32));
+    put_be32(out, (uint32_t)v);
+}
+
+static string graph_path() {
+    return REPO_DIR + "/objects/info/commit-graph";
+}
+
+class CommitGraphFile {
+public:
+    CommitGraphFile() { load(); }
+
+    void load() {
+        int fd = open(graph_path().c_str(), O_RDONLY);
+        if (fd < 0) return;
+        struct stat st;
+        if (fstat(fd, &st) == 0 && st.st_size > 0) {
+            void *p = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (p != MAP_FAILED) {
+                data = (const unsigned char *)p;
+                size = st.st_size;
+            }
+        }
+        close(fd);
+        if (data && !validate()) {
+            cerr << "warning: ignoring corrupt commit-graph\n";
+            unload();
+        }
+    }
+
+    void unload() {
+        if (data) munmap((void *)data, size);
+        data = nullptr;
+        size = 0;
+        count = 0;
+    }
+
+    bool find(const unsigned char *raw, uint32_t &pos) const {
+        if (!data) return false;
+        uint32_t lo = raw[0] ? get_be32(fanout + 4 * (raw[0] - 1)) : 0;
+        uint32_t hi = get_be32(fanout + 4 * raw[0]);
+        while (lo < hi) {
+            uint32_t mid = lo + (hi - lo) / 2;
+            int cmp = memcmp(names + (size_t)mid * RAW_SHA_LEN, raw, RAW_SHA_LEN);
+            if (cmp == 0) {
+                pos = mid;
+                return true;
+            }
+            if (cmp < 0) lo = mid + 1;
+            else hi = mid;
+        }
+        return false;
+    }
+
+    bool has_text() const { return text_ends != nullptr; }
+
+    void get_text(uint32_t pos, string &author, string &message) const {
+        uint64_t from = pos ? get_be64(text_ends + 8 * ((size_t)pos - 1)) : 0;
+        uint64_t to = get_be64(text_ends + 8 * (size_t)pos);
+        const char *s = (const char *)text + from;
+        const char *nl = (const char *)memchr(s, '\n', to - from);
+        size_t author_len = nl ? nl - s : to - from;
+        author.assign(s, author_len);
+        message.assign(nl ? nl + 1 : s + author_len, s + (to - from));
+    }
+
+    void get(uint32_t pos, GraphCommit &out) const {
+        const unsigned char *r = records + (size_t)pos * RECORD_LEN;
+        out.tree = to_hex(r, RAW_SHA_LEN);
+        uint32_t parent = get_be32(r + RAW_SHA_LEN);
+        out.parent = parent < count ? to_hex(names + (size_t)parent * RAW_SHA_LEN, RAW_SHA_LEN) : string();
+        out.generation = get_be32(r + RAW_SHA_LEN + 8);
+        out.time = (int64_t)get_be64(r + RAW_SHA_LEN + 12);
+    }
+
+private:
+    const unsigned char *data = nullptr;
+    size_t size = 0;
+    uint32_t count = 0;
+    const unsigned char *fanout = nullptr;
+    const unsigned char *names = nullptr;
+    const unsigned char *records = nullptr;
+    const unsigned char *text_ends = nullptr;  // null in a version 1 file
+    const unsigned char *text = nullptr;
+
+    bool validate() {
+        if (size < 12 + 256 * 4 + RAW_SHA_LEN || memcmp(data, "CGPH", 4) != 0) return false;
+        uint32_t version = get_be32(data + 4);
+        if (version != 1 && version != GRAPH_VERSION) return false;
+        count = get_be32(data + 8);
+        fanout = data + 12;
+        names = fanout + 256 * 4;
+        records = names + (size_t)count * RAW_SHA_LEN;
+        size_t fixed = 12 + 256 * 4 + (size_t)count * (RAW_SHA_LEN + RECORD_LEN) + RAW_SHA_LEN;
+        if (get_be32(fanout + 255 * 4) != count || size < fixed) return false;
+        text_ends = nullptr;
+        if (version == 1) {
+            if (size != fixed) return false;
+        } else {
+            if (size - fixed < 8 * (size_t)count) return false;
+            text_ends = records + (size_t)count * RECORD_LEN;
+            text = text_ends + 8 * (size_t)count;
+            size_t text_len = size - fixed - 8 * (size_t)count;
+            uint64_t prev = 0;
+            for (uint32_t i = 0; i < count; ++i) {
+                uint64_t end = get_be64(text_ends + 8 * (size_t)i);
+                if (end < prev || end > text_len) return false;
+                prev = end;
+            }
+            if (prev != text_len) return false;
+        }
+        // A torn or damaged file would send history walks down wrong
+        // parents, so the trailing checksum is verified before any use.
+        unsigned char digest[RAW_SHA_LEN];
+        Sha1Stream s;
+        s.update(data, size - RAW_SHA_LEN);
+        s.final_raw(digest);
+        return memcmp(digest, data + size - RAW_SHA_LEN, RAW_SHA_LEN) == 0;
+    }
+};
+
+static CommitGraphFile &graph() {
+    static CommitGraphFile g;
+    return g;
+}
+
+void reload_commit_graph() {
+    graph().unload();
+    graph().load();
+}
+
+bool commit_graph_lookup(const string &sha, GraphCommit &out) {
+    unsigned char raw[RAW_SHA_LEN];
+    if (sha.size() != 2 * RAW_SHA_LEN || !from_hex(sha, raw)) return false;
+    uint32_t pos;
+    if (!graph().find(raw, pos)) return false;
+    graph().get(pos, out);
+    return true;
+}
+
+static bool load_commit_info(const string &sha, CommitInfo &info) {
+    auto p = read_object(sha);
+    if (p.first != "commit") return false;
+    info = parse_commit(p.second);
+    return true;
+}
+
+bool load_commit(const string &sha, GraphCommit &out) {
+    if (commit_graph_lookup(sha, out)) return true;
+    CommitInfo info;
+    if (!load_commit_info(sha, info)) return false;
+    out.tree = info.tree;
+    out.parent = info.parent;
+    out.generation = 0;
+    out.time = info.time;
+    return true;
+}
+
+bool load_commit_text(const string &sha, string &author, string &message) {
+    unsigned char raw[RAW_SHA_LEN];
+    uint32_t pos;
+    if (graph().has_text() && sha.size() == 2 * RAW_SHA_LEN && from_hex(sha, raw) && graph().find(raw, pos)) {
+        graph().get_text(pos, author, message);
+        return true;
+    }
+    CommitInfo info;
+    if (!load_commit_info(sha, info)) return false;
+    author = std::move(info.author);
+    message = std::move(info.message);
+    return true;
+}
+
+// Walks first parents from `descendant`. Generations only shrink along the
+// walk, so once it reaches a commit no newer than `ancestor` without having
+// met it, `ancestor` cannot be further down.
+bool is_ancestor(const string &ancestor, const string &descendant) {
+    GraphCommit target;
+    uint32_t min_gen = commit_graph_lookup(ancestor, target) ? target.generation : 0;
+    string cur = descendant;
+    while (!cur.empty()) {
+        if (cur == ancestor) return true;
+        GraphCommit c;
+        if (!load_commit(cur, c)) return false;
+        if (min_gen && c.generation && c.generation <= min_gen) return false;
+        cur = c.parent;
+    }
+    return false;
+}
+
+static vector<string> ref_tips() {
+    vector<string> tips;
+    string head = read_head();
+    if (!head.empty()) {
+        string sha = head.find("refs/") == 0 ? read_ref(head) : head;
+        if (!sha.empty()) tips.push_back(sha);
+    }
+    string heads = REPO_DIR + "/refs/heads";
+    DIR *d = opendir(heads.c_str());
+    if (d) {
+        while (struct dirent *de = readdir(d)) {
+            if (de->d_name[0] == '.') continue;
+            string sha = read_ref(string("refs/heads/") + de->d_name);
+            if (!sha.empty()) tips.push_back(sha);
+        }
+        closedir(d);
+    }
+    return tips;
+}
+
+long write_commit_graph(vector<string> *written) {
+    unordered_map<string, GraphCommit> commits;
+    unordered_map<string, string> texts;  // "author\nmessage"
+    vector<string> stack = ref_tips();
+    while (!stack.empty()) {
+        string sha = stack.back();
+        stack.pop_back();
+        if (commits.count(sha)) continue;
+        GraphCommit c;
+        string author, message;
+        if (!graph().has_text() || !commit_graph_lookup(sha, c) || !load_commit_text(sha, author, message)) {
+            CommitInfo info;
+            if (!load_commit_info(sha, info)) {
+                cerr << "error: cannot read commit " << sha << "\n";
+                return -1;
+            }
+            c = {info.tree, info.parent, 0, info.time};
+            author = std::move(info.author);
+            message = std::move(info.message);
+        }
+        if (!c.parent.empty()) stack.push_back(c.parent);
+        commits[sha] = c;
+        texts[sha] = author + "\n" + message;
+    }
+
+    // Generations, assigned from the roots up along each parent chain.
+    unordered_map<string, uint32_t> gen;
+    for (auto &kv : commits) {
+        vector<string> chain;
+        string cur = kv.first;
+        while (!cur.empty() && !gen.count(cur)) {
+            chain.push_back(cur);
+            cur = commits[cur].parent;
+        }
+        uint32_t g = cur.empty() ? 0 : gen[cur];
+        for (auto it = chain.rbegin(); it != chain.rend(); ++it) gen[*it] = ++g;
+    }
+
+    vector<string> names;
+    names.reserve(commits.size());
+    for (auto &kv : commits) names.push_back(kv.first);
+    sort(names.begin(), names.end());
+    unordered_map<string, uint32_t> pos;
+    for (size_t i = 0; i < names.size(); ++i) pos[names[i]] = (uint32_t)i;
+
+    string out = "CGPH";
+    put_be32(out, GRAPH_VERSION);
+    put_be32(out, (uint32_t)names.size());
+    uint32_t counts[256] = {0};
+    unsigned char raw[RAW_SHA_LEN];
+    for (auto &n : names) {
+        from_hex(n, raw);
+        counts[raw[0]]++;
+    }
+    uint32_t running = 0;
+    for (int i = 0; i < 256; ++i) {
+        running += counts[i];
+        put_be32(out, running);
+    }
+    for (auto &n : names) {
+        from_hex(n, raw);
+        out.append((const char *)raw, RAW_SHA_LEN);
+    }
+    for (auto &n : names) {
+        const GraphCommit &c = commits[n];
+        memset(raw, 0, sizeof(raw));
+        from_hex(c.tree, raw);
+        out.append((const char *)raw, RAW_SHA_LEN);
+        put_be32(out, c.parent.empty() ? GRAPH_NO_PARENT : pos[c.parent]);
+        put_be32(out, GRAPH_NO_PARENT);
+        put_be32(out, gen[n]);
+        put_be64(out, (uint64_t)c.time);
+    }
+    uint64_t text_end = 0;
+    for (auto &n : names) {
+        text_end += texts[n].size();
+        put_be64(out, text_end);
+    }
+    for (auto &n : names) out += texts[n];
+    Sha1Stream s;
+    s.update(out.data(), out.size());
+    s.final_raw(raw);
+    out.append((const char *)raw, RAW_SHA_LEN);
+
+    string path = graph_path();
+    string tmp = path + ".lock";
+    if (!write_file(tmp, out) || rename(tmp.c_str(), path.c_str()) != 0) {
+        unlink(tmp.c_str());
+        cerr << "error: failed to write " << path << "\n";
+        return -1;
+    }
+    reload_commit_graph();
+    if (written) *written = names;
+    return (long)names.size();
+}
@@ -0,0 +1,52 @@
+#ifndef COMMIT_GRAPH_H
+#define COMMIT_GRAPH_H
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+using namespace std;
+
+// .mygit/objects/info/commit-graph caches the parts of every commit that
+// history walks need, so they can be answered from one mmapped file
+// instead of inflating commit objects. Layout (integers big-endian):
+//   "CGPH" | u32 version | u32 commit count
+//   u32 fanout[256] over the first byte of the commit names
+//   sorted 20-byte commit names
+//   one 40-byte record per commit, in name order:
+//     20-byte tree | u32 parent position | u32 second parent position |
+//     u32 generation | u64 commit time
+//   version 2 only: u64 text end[count], then the text of every commit in
+//     name order, "author\nmessage", commit i spanning end[i-1]..end[i]
+//   20-byte SHA-1 of everything above, checked when the file is opened
+// Parent positions index the same table (GRAPH_NO_PARENT when absent); the
+// graph is closed under parents. A commit's generation is one more than
+// the largest generation of its parents, so an ancestor always has a
+// strictly smaller generation than its descendants. Version 1 files, which
+// have no text, are still read.
+
+const uint32_t GRAPH_NO_PARENT = 0xffffffffu;
+
+struct GraphCommit {
+    string tree;
+    string parent;        // empty for a root commit
+    uint32_t generation;  // 0 when the commit is not in the graph
+    int64_t time;
+};
+
+bool commit_graph_lookup(const string &sha, GraphCommit &out);
+// Looks the commit up in the graph and falls back to reading the object.
+bool load_commit(const string &sha, GraphCommit &out);
+// The author line and message of a commit, the same way.
+bool load_commit_text(const string &sha, string &author, string &message);
+bool is_ancestor(const string &ancestor, const string &descendant);
+
+// Rewrites the graph to cover every commit reachable from HEAD and
+// refs/heads. Returns the number of commits written, or -1 on error; the
+// commit names are stored in `written` when it is given. Commits already
+// in the graph are copied from it, so only new ones are read as objects;
+// commit calls this after every commit unless core.commitGraph is false.
+long write_commit_graph(vector<string> *written = nullptr);
+void reload_commit_graph();
+
+#endif // COMMIT_GRAPH_H
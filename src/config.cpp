@@ -0,0 +1,94 @@
+#include "config.h"
+#include "git_utils.h"
+
+#include <bits/stdc++.h>
+
+using namespace std;
+
+static string lower(string s) {
+    for (char &c : s) c = (char)tolower((unsigned char)c);
+    return s;
+}
+
+static string trim(const string &s) {
+    size_t b = s.find_first_not_of(" \t\r");
+    if (b == string::npos) return string();
+    size_t e = s.find_last_not_of(" \t\r");
+    return s.substr(b, e - b + 1);
+}
+
+static const map<string, string> &config() {
+    static map<string, string> values = [] {
+        map<string, string> v;
+        istringstream in(read_file(REPO_DIR + "/config"));
+        string line, section;
+        while (getline(in, line)) {
+            line = trim(line);
+            if (line.empty() || line[0] == '#' || line[0] == ';') continue;
+            if (line[0] == '[') {
+                size_t close = line.find(']');
+                section = lower(trim(line.substr(1, close == string::npos ? string::npos : close - 1)));
+                continue;
+            }
+            size_t eq = line.find('=');
+            string key = lower(trim(line.substr(0, eq)));
+            string value = eq == string::npos ? string("true") : trim(line.substr(eq + 1));
+            v[section.empty() ? key : section + "." + key] = value;
+        }
+        return v;
+    }();
+    return values;
+}
+
+string config_get(const string &key, const string &def) {
+    auto it = config().find(lower(key));
+    return it == config().end() ? def : it->second;
+}
+
+long config_get_int(const string &key, long def) {
+    string v = config_get(key);
+    if (v.empty()) return def;
+    try {
+        size_t used = 0;
+        long n = stol(v, &used);
+        if (used == v.size()) return n;
+        if (used + 1 == v.size()) {
+            switch (tolower((unsigned char)v[used])) {
+                case 'k': return n << 10;
+                case 'm': return n << 20;
+                case 'g': return n << 30;
+            }
+        }
+    } catch (...) {}
+    cerr << "warning: ignoring bad value for " << key << ": " << v << "\n";
+    return def;
+}
+
+bool config_get_bool(const string &key, bool def) {
+    string v = lower(config_get(key));
+    if (v.empty()) return def;
+    if (v == "true" || v == "yes" || v == "on" || v == "1") return true;
+    if (v == "false" || v == "no" || v == "off" || v == "0") return false;
+    cerr << "warning: ignoring bad value for " << key << ": " << v << "\n";
+    return def;
+}
+
+int repository_format_version() {
+    static int version = (int)config_get_int("core.repositoryformatversion", 0);
+    return version;
+}
+
+bool check_repository_format() {
+    int v = repository_format_version();
+    if (v < 0 || v > REPO_FORMAT_VERSION) {
+        cerr << "fatal: repository format version " << v << " is not supported (this mygit knows up to "
+             << REPO_FORMAT_VERSION << ")\n";
+        return false;
+    }
+    return true;
+}
+
+bool write_initial_config() {
+    return write_file(REPO_DIR + "/config",
+                      "[core]\n\trepositoryformatversion = " + to_string(REPO_FORMAT_VERSION) + "\n");
+}
@@ -0,0 +1,28 @@
+#ifndef CONFIG_H
+#define CONFIG_H
+
+#include <string>
+
+using namespace std;
+
+// .mygit/config uses git's syntax: "[section]" headers followed by
+// "key = value" lines; '#' and ';' start comments. Keys are looked up as
+// "section.key", case-insensitively. The file is read once per process.
+string config_get(const string &key, const string &def = string());
+// Integers may carry a k, m or g suffix (powers of 1024).
+long config_get_int(const string &key, long def);
+// true/yes/on/1 and false/no/off/0; a key without "= value" is true.
+bool config_get_bool(const string &key, bool def);
+
+// core.repositoryformatversion records how objects are encoded:
+//   0  trees are text, one "mode name\tHEXSHA\n" line per entry
+//   1  trees are binary, "mode name\0" followed by the 20-byte SHA
+// Repositories without a config file are version 0. New repositories are
+// created at REPO_FORMAT_VERSION.
+const int REPO_FORMAT_VERSION = 1;
+int repository_format_version();
+// Fails, with a message, when the repository needs a newer mygit.
+bool check_repository_format();
+bool write_initial_config();
+
+#endif // CONFIG_H
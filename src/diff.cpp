@@ -0,0 +1,238 @@
+#include "diff.h"
+
+#include <bits/stdc++.h>
+
+using namespace std;
+
+bool is_binary_data(const string &data) {
+    return memchr(data.data(), 0, min<size_t>(data.size(), 8000)) != nullptr;
+}
+
+// Each line keeps its '\n'; only the last one may lack it.
+static void split_lines(const string &s, vector<string_view> &lines) {
+    const char *p = s.data(), *end = p + s.size();
+    while (p < end) {
+        const char *nl = (const char *)memchr(p, '\n', end - p);
+        const char *next = nl ? nl + 1 : end;
+        lines.emplace_back(p, next - p);
+        p = next;
+    }
+}
+
+// ---- Myers over line ids ----
+
+struct MyersContext {
+    const uint32_t *a, *b;
+    char *del, *ins;
+    vector<long> kv;
+    long *kvdf, *kvdb;  // furthest x reached on each diagonal x - y
+    long max_cost;
+};
+
+struct Split {
+    long i1, i2;
+    bool min_lo, min_hi;  // whether each half must still be diffed minimally
+};
+
+// Finds a point on an optimal path through a[off1, lim1) x b[off2, lim2)
+// by searching forwards from the start and backwards from the end until
+// the two searches meet.
+static void split(MyersContext &c, long off1, long lim1, long off2, long lim2, bool need_min, Split &spl) {
+    const uint32_t *a = c.a, *b = c.b;
+    long *kvdf = c.kvdf, *kvdb = c.kvdb;
+    long dmin = off1 - lim2, dmax = lim1 - off2;
+    long fmid = off1 - off2, bmid = lim1 - lim2;
+    bool odd = (fmid - bmid) & 1;
+    long fmin = fmid, fmax = fmid, bmin = bmid, bmax = bmid;
+    kvdf[fmid] = off1;
+    kvdb[bmid] = lim1;
+    for (long cost = 1;; ++cost) {
+        if (fmin > dmin) kvdf[--fmin - 1] = -1;
+        else ++fmin;
+        if (fmax < dmax) kvdf[++fmax + 1] = -1;
+        else --fmax;
+        for (long d = fmax; d >= fmin; d -= 2) {
+            long i1 = kvdf[d - 1] >= kvdf[d + 1] ? kvdf[d - 1] + 1 : kvdf[d + 1];
+            long i2 = i1 - d;
+            while (i1 < lim1 && i2 < lim2 && a[i1] == b[i2]) ++i1, ++i2;
+            kvdf[d] = i1;
+            if (odd && bmin <= d && d <= bmax && kvdb[d] <= i1) {
+                spl = {i1, i2, true, true};
+                return;
+            }
+        }
+
+        if (bmin > dmin) kvdb[--bmin - 1] = LONG_MAX;
+        else ++bmin;
+        if (bmax < dmax) kvdb[++bmax + 1] = LONG_MAX;
+        else --bmax;
+        for (long d = bmax; d >= bmin; d -= 2) {
+            long i1 = kvdb[d - 1] < kvdb[d + 1] ? kvdb[d - 1] : kvdb[d + 1] - 1;
+            long i2 = i1 - d;
+            while (i1 > off1 && i2 > off2 && a[i1 - 1] == b[i2 - 1]) --i1, --i2;
+            kvdb[d] = i1;
+            if (!odd && fmin <= d && d <= fmax && i1 <= kvdf[d]) {
+                spl = {i1, i2, true, true};
+                return;
+            }
+        }
+        if (need_min || cost < c.max_cost) continue;
+
+        // Too expensive: split at whichever search got furthest and let
+        // that half be diffed without the cost limit.
+        long fbest = -1, fbest1 = -1;
+        for (long d = fmax; d >= fmin; d -= 2) {
+            long i1 = min(kvdf[d], lim1), i2 = i1 - d;
+            if (lim2 < i2) i1 = lim2 + d, i2 = lim2;
+            if (fbest < i1 + i2) fbest = i1 + i2, fbest1 = i1;
+        }
+        long bbest = LONG_MAX, bbest1 = LONG_MAX;
+        for (long d = bmax; d >= bmin; d -= 2) {
+            long i1 = max(off1, kvdb[d]), i2 = i1 - d;
+            if (i2 < off2) i1 = off2 + d, i2 = off2;
+            if (i1 + i2 < bbest) bbest = i1 + i2, bbest1 = i1;
+        }
+        if ((lim1 + lim2) - bbest < fbest - (off1 + off2)) spl = {fbest1, fbest - fbest1, true, false};
+        else spl = {bbest1, bbest - bbest1, false, true};
+        return;
+    }
+}
+
+static void compare(MyersContext &c, long off1, long lim1, long off2, long lim2, bool need_min) {
+    while (off1 < lim1 && off2 < lim2 && c.a[off1] == c.b[off2]) ++off1, ++off2;
+    while (off1 < lim1 && off2 < lim2 && c.a[lim1 - 1] == c.b[lim2 - 1]) --lim1, --lim2;
+    if (off1 == lim1) {
+        fill(c.ins + off2, c.ins + lim2, 1);
+        return;
+    }
+    if (off2 == lim2) {
+        fill(c.del + off1, c.del + lim1, 1);
+        return;
+    }
+    Split spl;
+    split(c, off1, lim1, off2, lim2, need_min, spl);
+    compare(c, off1, spl.i1, off2, spl.i2, spl.min_lo);
+    compare(c, spl.i1, lim1, spl.i2, lim2, spl.min_hi);
+}
+
+// Marks del[i] for every line of `la` and ins[j] for every line of `lb`
+// that is not part of the common subsequence.
+static void diff_line_arrays(const vector<string_view> &la, const vector<string_view> &lb, vector<char> &del,
+                             vector<char> &ins) {
+    size_t na = la.size(), nb = lb.size();
+    del.assign(na, 0);
+    ins.assign(nb, 0);
+
+    // Common head and tail lines are compared as text and never hashed;
+    // for a small edit to a large file that is almost all of it.
+    size_t pre = 0, suf = 0;
+    while (pre < na && pre < nb && la[pre] == lb[pre]) ++pre;
+    while (suf < na - pre && suf < nb - pre && la[na - 1 - suf] == lb[nb - 1 - suf]) ++suf;
+
+    unordered_map<string_view, uint32_t> ids;
+    ids.reserve(na + nb - 2 * (pre + suf));
+    vector<uint32_t> ia, ib;
+    ia.reserve(na - pre - suf);
+    ib.reserve(nb - pre - suf);
+    for (size_t i = pre; i < na - suf; ++i) ia.push_back(ids.emplace(la[i], (uint32_t)ids.size()).first->second);
+    for (size_t j = pre; j < nb - suf; ++j) ib.push_back(ids.emplace(lb[j], (uint32_t)ids.size()).first->second);
+    vector<char> in_a(ids.size(), 0), in_b(ids.size(), 0);
+    for (uint32_t id : ia) in_a[id] = 1;
+    for (uint32_t id : ib) in_b[id] = 1;
+
+    // Lines found on one side only are changes whatever the alignment;
+    // the search runs over the rest, remembering where each came from.
+    vector<uint32_t> ca, cb;
+    vector<size_t> ra, rb;
+    for (size_t i = 0; i < ia.size(); ++i) {
+        if (!in_b[ia[i]]) del[pre + i] = 1;
+        else ca.push_back(ia[i]), ra.push_back(pre + i);
+    }
+    for (size_t j = 0; j < ib.size(); ++j) {
+        if (!in_a[ib[j]]) ins[pre + j] = 1;
+        else cb.push_back(ib[j]), rb.push_back(pre + j);
+    }
+
+    long n = (long)ca.size(), m = (long)cb.size();
+    long ndiags = n + m + 3;
+    vector<char> cdel(n, 0), cins(m, 0);
+    MyersContext c;
+    c.a = ca.data();
+    c.b = cb.data();
+    c.del = cdel.data();
+    c.ins = cins.data();
+    c.kv.assign(2 * ndiags + 2, 0);
+    c.kvdf = c.kv.data() + m + 1;
+    c.kvdb = c.kvdf + ndiags;
+    c.max_cost = max(256L, (long)sqrt((double)ndiags));
+    compare(c, 0, n, 0, m, false);
+    for (long i = 0; i < n; ++i) {
+        if (cdel[i]) del[ra[i]] = 1;
+    }
+    for (long j = 0; j < m; ++j) {
+        if (cins[j]) ins[rb[j]] = 1;
+    }
+}
+
+// ---- unified output ----
+
+struct Change {
+    size_t a0, a1, b0, b1;
+};
+
+static string hunk_range(size_t start, size_t count) {
+    if (count == 1) return to_string(start + 1);
+    return to_string(count ? start + 1 : start) + "," + to_string(count);
+}
+
+static void emit_line(char prefix, string_view line, string &out) {
+    out += prefix;
+    out.append(line.data(), line.size());
+    if (line.empty() || line.back() != '\n') out += "\n\\ No newline at end of file\n";
+}
+
+void diff_lines(const string &a, const string &b, int context, string &out) {
+    vector<string_view> la, lb;
+    split_lines(a, la);
+    split_lines(b, lb);
+    vector<char> del, ins;
+    diff_line_arrays(la, lb, del, ins);
+
+    vector<Change> changes;
+    size_t na = la.size(), nb = lb.size();
+    for (size_t i = 0, j = 0; i < na || j < nb;) {
+        if ((i < na && del[i]) || (j < nb && ins[j])) {
+            Change ch = {i, i, j, j};
+            while (i < na && del[i]) ++i;
+            while (j < nb && ins[j]) ++j;
+            ch.a1 = i;
+            ch.b1 = j;
+            changes.push_back(ch);
+        } else {
+            ++i;
+            ++j;
+        }
+    }
+
+    size_t ctx = (size_t)max(context, 0);
+    for (size_t k = 0; k < changes.size();) {
+        size_t last = k;
+        while (last + 1 < changes.size() && changes[last + 1].a0 - changes[last].a1 <= 2 * ctx) ++last;
+        const Change &first = changes[k], &end = changes[last];
+        size_t a_start = first.a0 - min(ctx, first.a0);
+        size_t b_start = first.b0 - (first.a0 - a_start);
+        size_t a_end = min(end.a1 + ctx, na);
+        size_t b_end = end.b1 + (a_end - end.a1);
+        out += "@@ -" + hunk_range(a_start, a_end - a_start) + " +" + hunk_range(b_start, b_end - b_start) + " @@\n";
+        size_t pos = a_start;
+        for (size_t h = k; h <= last; ++h) {
+            const Change &ch = changes[h];
+            for (; pos < ch.a0; ++pos) emit_line(' ', la[pos], out);
+            for (size_t i = ch.a0; i < ch.a1; ++i) emit_line('-', la[i], out);
+            for (size_t j = ch.b0; j < ch.b1; ++j) emit_line('+', lb[j], out);
+            pos = ch.a1;
+        }
+        for (; pos < a_end; ++pos) emit_line(' ', la[pos], out);
+        k = last + 1;
+    }
+}
@@ -0,0 +1,27 @@
+#ifndef DIFF_H
+#define DIFF_H
+
+#include <string>
+
+using namespace std;
+
+// Line diff engine behind `mygit diff`. Each side is split into lines once
+// and every distinct line is interned to a small integer id, so the
+// comparison works on two arrays of ids rather than on text. Lines that
+// occur on only one side cannot be part of a common subsequence; they are
+// marked changed up front and left out of the search. What remains goes
+// through Myers' O(ND) algorithm in its linear-space form (recursive
+// middle-snake splits, as in xdiff). A split whose cost passes about the
+// square root of the input size settles for the furthest-reaching path
+// found so far, which keeps heavily rewritten multi-MB files fast at the
+// price of a diff that may not be minimal.
+
+// Appends the unified-diff hunks ("@@ -a,b +c,d @@" and their lines, with
+// `context` unchanged lines around each change) turning `a` into `b`.
+// Appends nothing when they are equal.
+void diff_lines(const string &a, const string &b, int context, string &out);
+
+// git's test: a NUL byte within the first 8000 bytes makes data binary.
+bool is_binary_data(const string &data);
+
+#endif // DIFF_H
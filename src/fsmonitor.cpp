@@ -0,0 +1,425 @@
+#include "fsmonitor.h"
+#include "git_utils.h"
+#include "ignore.h"
+
+#include <bits/stdc++.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/inotify.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+using namespace std;
+
+// Changed paths remembered at most; past this the older half is dropped
+// and tokens from before it are answered "full".
+static const size_t MAX_CHANGED = 1 << 20;
+
+static const uint32_t WATCH_MASK = IN_CREATE | IN_DELETE | IN_MODIFY | IN_CLOSE_WRITE | IN_ATTRIB |
+                                   IN_MOVED_FROM | IN_MOVED_TO | IN_DELETE_SELF | IN_MOVE_SELF |
+                                   IN_ONLYDIR | IN_DONT_FOLLOW | IN_EXCL_UNLINK;
+
+static string socket_path() {
+    return REPO_DIR + "/fsmonitor.sock";
+}
+
+static bool socket_address(sockaddr_un &addr) {
+    string path = socket_path();
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (path.size() >= sizeof(addr.sun_path)) return false;
+    memcpy(addr.sun_path, path.c_str(), path.size());
+    return true;
+}
+
+// Sends one request and reads the reply until the daemon closes the
+// connection. False when no daemon is listening.
+static bool request(const string &req, string &reply) {
+    sockaddr_un addr;
+    if (!socket_address(addr)) return false;
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) return false;
+    struct timeval tv = {5, 0};
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    if (connect(fd, (sockaddr *)&addr, sizeof(addr)) != 0 ||
+        write(fd, req.data(), req.size()) != (ssize_t)req.size()) {
+        close(fd);
+        return false;
+    }
+    shutdown(fd, SHUT_WR);
+    reply.clear();
+    char buf[65536];
+    ssize_t n;
+    while ((n = read(fd, buf, sizeof(buf))) > 0) reply.append(buf, n);
+    close(fd);
+    return n == 0 && !reply.empty();
+}
+
+bool fsmonitor_query(const string &token, string &new_token, vector<string> &changed) {
+    new_token.clear();
+    changed.clear();
+    string reply;
+    if (!request("query " + token + "\n", reply)) return false;
+    istringstream in(reply);
+    string status, line;
+    in >> status >> new_token;
+    getline(in, line);
+    if (status != "ok") {
+        if (status != "full") new_token.clear();
+        return false;
+    }
+    while (getline(in, line)) {
+        if (!line.empty()) changed.push_back(line);
+    }
+    return true;
+}
+
+// ---- daemon ----
+
+class Watcher {
+public:
+    bool init(string &err) {
+        fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+        if (fd < 0) {
+            err = string("inotify_init1: ") + strerror(errno);
+            return false;
+        }
+        char id[64];
+        snprintf(id, sizeof(id), "%x%llx", (unsigned)getpid(), (unsigned long long)time(nullptr));
+        instance = id;
+        watch_tree("");
+        if (dirs.empty()) {
+            err = string("cannot watch the working tree: ") + strerror(errno);
+            return false;
+        }
+        return true;
+    }
+
+    int inotify_fd() const { return fd; }
+    size_t watched() const { return dirs.size(); }
+    size_t unwatched() const { return failed.size(); }
+    bool root_gone() const { return gone; }
+
+    // Reads every queued event; called before each answer so changes
+    // made before the query are always reported.
+    void drain() {
+        alignas(struct inotify_event) char buf[65536];
+        while (true) {
+            ssize_t n = read(fd, buf, sizeof(buf));
+            if (n <= 0) return;
+            for (char *p = buf; p < buf + n;) {
+                auto *ev = (struct inotify_event *)p;
+                handle(*ev);
+                p += sizeof(struct inotify_event) + ev->len;
+            }
+        }
+    }
+
+    string answer(const string &req) {
+        drain();
+        if (!failed.empty()) retry_failed();
+        string cur = token();
+        if (req.compare(0, 6, "query ") == 0) {
+            string t = req.substr(6);
+            size_t colon = t.find(':');
+            uint64_t since = 0;
+            bool ours = colon != string::npos && t.compare(0, colon, instance) == 0;
+            if (ours) {
+                try {
+                    since = stoull(t.substr(colon + 1));
+                } catch (...) {
+                    ours = false;
+                }
+            }
+            if (!ours || since > seq || overflow_seq > since || !failed.empty()) return "full " + cur + "\n";
+            string out = "ok " + cur + "\n";
+            for (auto it = by_seq.upper_bound(since); it != by_seq.end(); ++it) out += *it->second + "\n";
+            return out;
+        }
+        if (req == "status") {
+            return "ok " + cur + " " + to_string(dirs.size()) + " " + to_string(changed.size()) + " " +
+                   to_string(failed.size()) + "\n";
+        }
+        if (req == "stop") {
+            stopping = true;
+            return "ok\n";
+        }
+        return "error unknown request\n";
+    }
+
+    bool stopping = false;
+
+private:
+    int fd = -1;
+    string instance;
+    uint64_t seq = 0;
+    uint64_t overflow_seq = 0;  // tokens older than this get "full"
+    bool gone = false;
+    unordered_map<int, string> dirs;  // watch descriptor -> directory ("" is the top)
+    unordered_map<string, uint64_t> changed;  // path -> seq of its last event
+    map<uint64_t, const string *> by_seq;     // the same, ordered by seq
+    // Directories that could not be watched (usually once
+    // fs.inotify.max_user_watches is used up). Nothing under them is seen,
+    // so every query is answered "full" until all are watched again.
+    set<string> failed;
+
+    string token() const { return instance + ":" + to_string(seq); }
+
+    void mark(const string &path) {
+        auto ins = changed.emplace(path, 0);
+        if (!ins.second) by_seq.erase(ins.first->second);
+        ins.first->second = ++seq;
+        by_seq.emplace(seq, &ins.first->first);
+        if (changed.size() > MAX_CHANGED) {
+            auto mid = next(by_seq.begin(), by_seq.size() / 2);
+            invalidate_before(mid->first);
+        }
+    }
+
+    // Tokens from before `s` will be answered "full", so the paths changed
+    // up to it are no longer needed.
+    void invalidate_before(uint64_t s) {
+        overflow_seq = max(overflow_seq, s);
+        auto stop = by_seq.upper_bound(overflow_seq);
+        for (auto it = by_seq.begin(); it != stop; ++it) changed.erase(changed.find(*it->second));
+        by_seq.erase(by_seq.begin(), stop);
+    }
+
+    // Called while queries are answered "full": once every directory
+    // that failed is watched, nothing from before that point can be
+    // vouched for, but later tokens are incremental again.
+    void retry_failed() {
+        set<string> retry;
+        retry.swap(failed);
+        for (const string &d : retry) watch_tree(d);
+        if (failed.empty()) invalidate_before(++seq);
+    }
+
+    // Hidden entries are skipped the way the working-tree walk skips them,
+    // which also keeps .mygit itself out of the event stream. A directory
+    // that cannot be watched is recorded in `failed`.
+    void watch_tree(const string &dir) {
+        int wd = inotify_add_watch(fd, dir.empty() ? "." : dir.c_str(), WATCH_MASK);
+        if (wd < 0) {
+            if (errno != ENOENT && errno != ENOTDIR) failed.insert(dir);  // gone already: the event covers it
+            return;
+        }
+        dirs[wd] = dir;
+        DIR *d = opendir(dir.empty() ? "." : dir.c_str());
+        if (!d) return;
+        while (struct dirent *de = readdir(d)) {
+            if (de->d_name[0] == '.') continue;
+            string path = dir.empty() ? string(de->d_name) : dir + "/" + de->d_name;
+            bool is_dir = de->d_type == DT_DIR;
+            if (de->d_type == DT_UNKNOWN) {
+                struct stat st;
+                is_dir = lstat(path.c_str(), &st) == 0 && S_ISDIR(st.st_mode);
+            }
+            if (is_dir) watch_tree(path);
+        }
+        closedir(d);
+    }
+
+    static bool at_or_under(const string &p, const string &dir) {
+        return p == dir || (p.size() > dir.size() && p.compare(0, dir.size(), dir) == 0 && p[dir.size()] == '/');
+    }
+
+    void unwatch_tree(const string &dir) {
+        for (auto it = dirs.begin(); it != dirs.end();) {
+            if (at_or_under(it->second, dir)) {
+                inotify_rm_watch(fd, it->first);
+                it = dirs.erase(it);
+            } else {
+                ++it;
+            }
+        }
+        for (auto it = failed.begin(); it != failed.end();) {
+            if (at_or_under(*it, dir)) it = failed.erase(it);
+            else ++it;
+        }
+    }
+
+    void handle(const struct inotify_event &ev) {
+        if (ev.mask & IN_Q_OVERFLOW) {
+            invalidate_before(++seq);
+            return;
+        }
+        auto it = dirs.find(ev.wd);
+        if (it == dirs.end()) return;
+        string dir = it->second;
+        if (ev.mask & IN_IGNORED) {
+            dirs.erase(it);
+            if (dir.empty()) gone = true;
+            return;
+        }
+        if (ev.len == 0) {
+            if ((ev.mask & (IN_DELETE_SELF | IN_MOVE_SELF)) && dir.empty()) gone = true;
+            return;  // the parent's watch reports the same change by name
+        }
+        const char *name = ev.name;
+        if (!strcmp(name, IGNORE_FILE)) {
+            // New ignore rules change what a scan of the directory finds.
+            if (dir.empty()) invalidate_before(++seq);
+            else mark(dir);
+            return;
+        }
+        if (name[0] == '.') return;
+        string path = dir.empty() ? string(name) : dir + "/" + name;
+        if (ev.mask & IN_ISDIR) {
+            if (ev.mask & IN_MOVED_FROM) unwatch_tree(path);
+            if (ev.mask & (IN_CREATE | IN_MOVED_TO)) watch_tree(path);
+        }
+        mark(path);
+    }
+};
+
+static void serve_client(Watcher &w, int cfd) {
+    string req;
+    char buf[4096];
+    struct pollfd pfd = {cfd, POLLIN, 0};
+    while (req.find('\n') == string::npos && poll(&pfd, 1, 2000) > 0) {
+        ssize_t n = read(cfd, buf, sizeof(buf));
+        if (n <= 0) break;
+        req.append(buf, n);
+    }
+    size_t nl = req.find('\n');
+    if (nl != string::npos) {
+        string reply = w.answer(req.substr(0, nl));
+        const char *p = reply.data();
+        size_t left = reply.size();
+        while (left > 0) {
+            ssize_t n = write(cfd, p, left);
+            if (n <= 0) break;
+            p += n;
+            left -= n;
+        }
+    }
+    close(cfd);
+}
+
+// Runs in the daemon process; reports readiness (or an error) on
+// `ready_fd` and then serves until stopped.
+[[noreturn]] static void run_daemon(int ready_fd) {
+    Watcher w;
+    string err;
+    sockaddr_un addr;
+    int lfd = -1;
+    if (w.init(err)) {
+        lfd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        unlink(socket_path().c_str());
+        if (lfd < 0 || !socket_address(addr) || bind(lfd, (sockaddr *)&addr, sizeof(addr)) != 0 ||
+            listen(lfd, 16) != 0) {
+            err = string("cannot listen on ") + socket_path() + ": " + strerror(errno);
+        }
+    }
+    string msg = err.empty() ? "ok " + to_string(getpid()) + " " + to_string(w.watched()) + " " +
+                                   to_string(w.unwatched())
+                             : "error " + err;
+    if (write(ready_fd, msg.data(), msg.size()) < 0) {}
+    close(ready_fd);
+    if (!err.empty()) _exit(1);
+
+    int devnull = open("/dev/null", O_RDWR);
+    dup2(devnull, STDIN_FILENO);
+    dup2(devnull, STDOUT_FILENO);
+    dup2(devnull, STDERR_FILENO);
+    if (devnull > STDERR_FILENO) close(devnull);
+
+    struct pollfd fds[2] = {{lfd, POLLIN, 0}, {w.inotify_fd(), POLLIN, 0}};
+    while (!w.stopping && !w.root_gone()) {
+        if (poll(fds, 2, -1) < 0) {
+            if (errno == EINTR) continue;
+            break;
+        }
+        if (fds[1].revents & POLLIN) w.drain();
+        if (fds[0].revents & POLLIN) {
+            int cfd = accept4(lfd, nullptr, nullptr, SOCK_CLOEXEC);
+            if (cfd >= 0) serve_client(w, cfd);
+        }
+    }
+    close(lfd);
+    unlink(socket_path().c_str());
+    _exit(0);
+}
+
+int fsmonitor_start() {
+    string reply;
+    if (request("status\n", reply)) {
+        cerr << "fsmonitor is already running\n";
+        return 1;
+    }
+    int p[2];
+    if (pipe2(p, O_CLOEXEC) != 0) {
+        cerr << "error: pipe: " << strerror(errno) << "\n";
+        return 1;
+    }
+    cout.flush();
+    pid_t child = fork();
+    if (child < 0) {
+        cerr << "error: fork: " << strerror(errno) << "\n";
+        return 1;
+    }
+    if (child == 0) {
+        // Detach twice so the daemon is neither our child nor a session
+        // leader that could reacquire a terminal.
+        close(p[0]);
+        setsid();
+        signal(SIGHUP, SIG_IGN);
+        pid_t grandchild = fork();
+        if (grandchild != 0) _exit(grandchild < 0 ? 1 : 0);
+        run_daemon(p[1]);
+    }
+    close(p[1]);
+    waitpid(child, nullptr, 0);
+    string msg;
+    char buf[512];
+    ssize_t n;
+    while ((n = read(p[0], buf, sizeof(buf))) > 0) msg.append(buf, n);
+    close(p[0]);
+
+    istringstream in(msg);
+    string status, pid, dirs, unwatched;
+    in >> status >> pid >> dirs >> unwatched;
+    if (status != "ok") {
+        cerr << "error: fsmonitor failed to start" << (msg.size() > 6 ? ": " + msg.substr(6) : string()) << "\n";
+        return 1;
+    }
+    cout << "fsmonitor started (pid " << pid << ", watching " << dirs << " directories)\n";
+    if (unwatched != "0") {
+        cerr << "warning: " << unwatched << " directories could not be watched (see fs.inotify.max_user_watches); "
+             << "add and status will scan the whole tree until they are\n";
+    }
+    return 0;
+}
+
+int fsmonitor_stop() {
+    string reply;
+    if (!request("stop\n", reply)) {
+        cerr << "fsmonitor is not running\n";
+        return 1;
+    }
+    cout << "fsmonitor stopped\n";
+    return 0;
+}
+
+int fsmonitor_status() {
+    string reply;
+    if (!request("status\n", reply)) {
+        cout << "fsmonitor is not running\n";
+        return 1;
+    }
+    istringstream in(reply);
+    string status, token, dirs, paths, unwatched;
+    in >> status >> token >> dirs >> paths >> unwatched;
+    cout << "fsmonitor is running: watching " << dirs << " directories, " << paths
+         << " paths changed, token " << token << "\n";
+    if (!unwatched.empty() && unwatched != "0") {
+        cout << unwatched << " directories could not be watched; queries fall back to a full scan\n";
+    }
+    return 0;
+}
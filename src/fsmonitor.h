@@ -0,0 +1,34 @@
+#ifndef FSMONITOR_H
+#define FSMONITOR_H
+
+#include <string>
+#include <vector>
+
+using namespace std;
+
+// Optional filesystem-watcher daemon. `mygit fsmonitor start` forks a
+// process that watches every non-hidden directory of the working tree with
+// inotify and answers queries on the Unix socket .mygit/fsmonitor.sock.
+//
+// A token names a point in the daemon's event stream ("<instance>:<seq>").
+// "query <token>" returns every path changed since that token plus a new
+// token; a path may name a directory, in which case everything beneath it
+// must be rescanned. The daemon answers "full" instead when it cannot vouch
+// for the interval: the token comes from another daemon instance, the
+// kernel event queue overflowed since, or some directory is not watched
+// (inotify_add_watch failed, typically for lack of watches; the daemon
+// retries on each query and answers "full" until every directory is
+// watched again). The index records the token of the last complete scan
+// in its FSMN extension.
+
+// Asks the daemon what changed since `token`. Returns true and fills
+// `changed` (paths relative to the top of the working tree) when the answer
+// is incremental; false when the caller must walk the whole tree.
+// `new_token` is set whenever a daemon answered, even with "full".
+bool fsmonitor_query(const string &token, string &new_token, vector<string> &changed);
+
+int fsmonitor_start();
+int fsmonitor_stop();
+int fsmonitor_status();
+
+#endif // FSMONITOR_H
@@ -1,11 +1,21 @@
 #include "git_utils.h"
+#include "pack.h"
+#include "commit_graph.h"
+#include "parallel.h"
+#include "trace.h"
+#include "tree.h"
+#include "config.h"
+#include "chunked.h"
+#include "sha1_batch.h"
 
 #include <bits/stdc++.h>
 #include <openssl/sha.h>
+#include <openssl/evp.h>
 #include <zlib.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <dirent.h>
+#include <fcntl.h>
 #include <unistd.h>
 #include <filesystem>
 #include <ctime>
@@ -26,16 +36,102 @@ string to_hex(const unsigned char *hash, size_t len) {
     return s;
 }
 
-string sha1_hex(const string &data) {
+bool from_hex(const string &hex, unsigned char *out) {
+    if (hex.size() % 2 != 0) return false;
+    auto nibble = [](char c) -> int {
+        if (c >= '0' && c <= '9') return c - '0';
+        if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+        if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+        return -1;
+    };
+    for (size_t i = 0; i < hex.size(); i += 2) {
+        int hi = nibble(hex[i]), lo = nibble(hex[i + 1]);
+        if (hi < 0 || lo < 0) return false;
+        out[i / 2] = (unsigned char)((hi << 4) | lo);
+    }
+    return true;
+}
+
+Sha1Stream::Sha1Stream() {
+    EVP_MD_CTX *c = EVP_MD_CTX_new();
+    EVP_DigestInit_ex(c, EVP_sha1(), nullptr);
+    ctx = c;
+}
+
+Sha1Stream::~Sha1Stream() {
+    EVP_MD_CTX_free((EVP_MD_CTX *)ctx);
+}
+
+void Sha1Stream::update(const void *data, size_t len) {
+    TraceTimer t(TRACE_SHA1);
+    trace_count(TRACE_BYTES_HASHED, len);
+    EVP_DigestUpdate((EVP_MD_CTX *)ctx, data, len);
+}
+
+void Sha1Stream::final_raw(unsigned char *out) {
+    unsigned int len = 0;
+    EVP_DigestFinal_ex((EVP_MD_CTX *)ctx, out, &len);
+}
+
+string Sha1Stream::final_hex() {
     unsigned char hash[SHA_DIGEST_LENGTH];
-    SHA1((const unsigned char*)data.data(), data.size(), hash);
+    final_raw(hash);
     return to_hex(hash, SHA_DIGEST_LENGTH);
 }
 
+// A batch of one still takes the SHA-NI path, which for small objects is
+// several times faster than a one-shot SHA1() call.
+string sha1_hex(const string &data) {
+    Sha1Input in = {data.data(), data.size()};
+    unsigned char hash[1][SHA_DIGEST_LENGTH];
+    sha1_batch(&in, 1, hash);
+    return to_hex(hash[0], SHA_DIGEST_LENGTH);
+}
+
+// core.compression: a zlib level from 1 (fastest) to 9 (smallest), 0 to
+// store objects uncompressed, or -1 for zlib's default.
+static int compression_level() {
+    static int level = [] {
+        long l = config_get_int("core.compression", Z_DEFAULT_COMPRESSION);
+        if (l < -1 || l > 9) {
+            cerr << "warning: ignoring bad value for core.compression: " << l << "\n";
+            return Z_DEFAULT_COMPRESSION;
+        }
+        return (int)l;
+    }();
+    return level;
+}
+
+// With core.adaptiveCompression, the first ADAPTIVE_SAMPLE bytes of every
+// object of at least ADAPTIVE_MIN bytes are deflated at level 1 before the
+// real compression starts. Data that barely shrinks (already-compressed media) is stored
+// as is, and data that shrinks only a little is written at level 1, where
+// higher levels would burn CPU for nothing.
+static const size_t ADAPTIVE_SAMPLE = 8 << 10;
+static const size_t ADAPTIVE_MIN = 16 << 10;
+
+int compression_level_for(const void *data, size_t len) {
+    static bool adaptive = config_get_bool("core.adaptivecompression", false);
+    int level = compression_level();
+    if (!adaptive || level == 0 || len < ADAPTIVE_MIN) return level;
+    uLongf sample_size = compressBound(ADAPTIVE_SAMPLE);
+    vector<unsigned char> sample(sample_size);
+    if (compress2(sample.data(), &sample_size, (const unsigned char *)data, ADAPTIVE_SAMPLE, 1) != Z_OK) {
+        return level;
+    }
+    double ratio = (double)sample_size / ADAPTIVE_SAMPLE;
+    if (ratio > 0.95) return 0;
+    if (ratio > 0.80) return 1;
+    return level;
+}
+
 string compress_data(const string &data) {
+    TraceTimer t(TRACE_COMPRESS);
+    trace_count(TRACE_BYTES_DEFLATED, data.size());
+    int level = compression_level_for(data.data(), data.size());
     uLongf compressed_size = compressBound(data.size());
     unsigned char *compressed = new unsigned char[compressed_size];
-    int ret = compress2(compressed, &compressed_size, (const unsigned char *)data.data(), data.size(), Z_DEFAULT_COMPRESSION);
+    int ret = compress2(compressed, &compressed_size, (const unsigned char *)data.data(), data.size(), level);
     if (ret != Z_OK) {
         delete[] compressed;
         return string();  // compression failed
@@ -45,25 +141,9 @@ string compress_data(const string &data) {
     return result;
 }
 
-string decompress_data(const string &data) {
-
-    uLongf uncompressed_size = data.size() * 10; 
-    for (int attempt = 0; attempt < 5; ++attempt) {
-        unsigned char *uncompressed = new unsigned char[uncompressed_size];
-        int ret = uncompress(uncompressed, &uncompressed_size, (const unsigned char *)data.data(), data.size());
-        if (ret == Z_OK) {
-            string result((char *)uncompressed, uncompressed_size);
-            delete[] uncompressed;
-            return result;
-        }
-        delete[] uncompressed;
-        if (ret != Z_BUF_ERROR) return string();  
-        uncompressed_size *= 2; 
-    }
-    return string(); 
-}
-
 bool ensure_dir(const string &path) {
+    TraceTimer t(TRACE_ENSURE_DIR);
+    trace_count(TRACE_STAT_CALLS);
     struct stat st;
     if (stat(path.c_str(), &st) == 0) {
         if (S_ISDIR(st.st_mode)) return true;
@@ -75,8 +155,10 @@ bool ensure_dir(const string &path) {
         pos = path.find('/', pos + 1);
         string sub = path.substr(0, pos == string::npos ? path.size() : pos);
         if (sub.size() == 0) continue;
+        trace_count(TRACE_STAT_CALLS);
         if (stat(sub.c_str(), &st) != 0) {
-            if (mkdir(sub.c_str(), 0755) != 0) {
+            // Another thread may have created it since the stat.
+            if (mkdir(sub.c_str(), 0755) != 0 && errno != EEXIST) {
                 return false;
             }
         }
@@ -86,25 +168,93 @@ bool ensure_dir(const string &path) {
 }
 
 string read_file(const string &path) {
+    TraceTimer t(TRACE_READ_FILE);
     ifstream ifs(path, ios::binary);
     if (!ifs) return string();
     ostringstream ss;
     ss << ifs.rdbuf();
-    return ss.str();
+    string data = ss.str();
+    trace_count(TRACE_BYTES_READ, data.size());
+    return data;
 }
 
-bool write_file(const string &path, const string &data) {
-    size_t p = path.rfind('/');
-    if (p != string::npos) {
-        string parent = path.substr(0, p);
-        ensure_dir(parent);
+static bool write_all(int fd, const unsigned char *data, size_t len) {
+    while (len > 0) {
+        ssize_t n = write(fd, data, len);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return false;
+        }
+        data += n;
+        len -= n;
     }
-    ofstream ofs(path, ios::binary);
-    if (!ofs) return false;
-    ofs.write(data.data(), data.size());
     return true;
 }
 
+enum FsyncMode { FSYNC_NONE, FSYNC_OBJECT, FSYNC_BATCH };
+
+static FsyncMode fsync_mode() {
+    static FsyncMode mode = [] {
+        string v = config_get("core.fsync", "batch");
+        if (v == "none") return FSYNC_NONE;
+        if (v == "object") return FSYNC_OBJECT;
+        if (v != "batch") cerr << "warning: ignoring bad value for core.fsync: " << v << "\n";
+        return FSYNC_BATCH;
+    }();
+    return mode;
+}
+
+// Set by every write in batch mode until sync_written_files() runs.
+static atomic<bool> unsynced_writes{false};
+
+// Batch mode follows git's: each file only has its writeback started
+// (sync_file_range does not wait and issues no cache flush), and the one
+// fsync at the end commits the filesystem journal, which orders the data
+// of those files before the renames that published them, and flushes the
+// disk cache once for all of them. syncfs() would give the same guarantee
+// but also flushes every unrelated dirty file on the filesystem.
+bool sync_new_file(int fd) {
+    FsyncMode mode = fsync_mode();
+    if (mode == FSYNC_NONE) return true;
+    TraceTimer t(TRACE_FSYNC);
+    if (mode == FSYNC_OBJECT) return fsync(fd) == 0;
+    unsynced_writes = true;
+    sync_file_range(fd, 0, 0, SYNC_FILE_RANGE_WRITE);
+    return true;
+}
+
+bool sync_written_files() {
+    if (!unsynced_writes.exchange(false)) return true;
+    TraceTimer t(TRACE_FSYNC);
+    int fd = open(REPO_DIR.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    bool ok = fd >= 0 && fsync(fd) == 0;
+    if (fd >= 0) close(fd);
+    if (!ok) cerr << "error: cannot sync " << REPO_DIR << ": " << strerror(errno) << "\n";
+    return ok;
+}
+
+// The temp file sits next to `path`, so the rename never crosses a
+// filesystem. Its name is hidden, so one left behind by a crash is skipped
+// by everything that lists refs or objects.
+static bool write_file_in(const string &dir, const string &path, const string &data) {
+    string tmp = dir + "/.tmp_XXXXXX";
+    int fd = mkstemp(&tmp[0]);
+    if (fd < 0) return false;
+    bool ok = fchmod(fd, 0644) == 0 && write_all(fd, (const unsigned char *)data.data(), data.size()) &&
+              sync_new_file(fd);
+    if (close(fd) != 0) ok = false;
+    if (ok) ok = rename(tmp.c_str(), path.c_str()) == 0;
+    if (!ok) unlink(tmp.c_str());
+    return ok;
+}
+
+bool write_file(const string &path, const string &data) {
+    size_t p = path.rfind('/');
+    string dir = p == string::npos ? string(".") : path.substr(0, p);
+    if (p != string::npos) ensure_dir(dir);
+    return write_file_in(dir, path, data);
+}
+
 string object_path_for_sha(const string &sha) {
     string dir = REPO_DIR + "/objects/" + sha.substr(0, 2);
     string file = sha.substr(2);
@@ -116,52 +266,538 @@ string build_object_buffer(const string &type, const string &data) {
     return hdr + data;
 }
 
+static atomic<uint64_t> objects_read{0};
+static atomic<uint64_t> objects_written{0};
+
+ObjectIoStats object_io_stats() {
+    return {objects_read.load(), objects_written.load()};
+}
+
+// Loose object names, one set per fan-out directory, each read with a
+// single readdir the first time an object in it is looked up and kept up
+// to date with what this process writes. Packed objects are looked up in
+// the mmapped pack indexes, which need no copy.
+class KnownObjects {
+public:
+    bool contains(const string &sha) {
+        lock_guard<mutex> lk(m);
+        const Fanout &f = load(sha);
+        return f.names.count(sha.substr(2)) > 0;
+    }
+
+    // Makes sure the fan-out directory for `sha` exists, creating it at
+    // most once per process.
+    bool ensure_fanout(const string &sha) {
+        lock_guard<mutex> lk(m);
+        Fanout &f = load(sha);
+        if (!f.exists) f.exists = ensure_dir(REPO_DIR + "/objects/" + sha.substr(0, 2));
+        return f.exists;
+    }
+
+    void add(const string &sha) {
+        lock_guard<mutex> lk(m);
+        load(sha).names.insert(sha.substr(2));
+    }
+
+    void forget() {
+        lock_guard<mutex> lk(m);
+        fanouts.clear();
+    }
+
+private:
+    struct Fanout {
+        bool exists = false;
+        unordered_set<string> names;
+    };
+    mutex m;
+    unordered_map<string, Fanout> fanouts;  // keyed by the two-digit directory name
+
+    Fanout &load(const string &sha) {
+        string prefix = sha.substr(0, 2);
+        auto it = fanouts.find(prefix);
+        if (it != fanouts.end()) return it->second;
+        Fanout &f = fanouts[prefix];
+        DIR *d = opendir((REPO_DIR + "/objects/" + prefix).c_str());
+        if (!d) return f;
+        f.exists = true;
+        while (struct dirent *de = readdir(d)) {
+            if (strlen(de->d_name) == 38) f.names.insert(de->d_name);
+        }
+        closedir(d);
+        return f;
+    }
+};
+
+static KnownObjects &known_objects() {
+    static KnownObjects known;
+    return known;
+}
+
+bool object_exists(const string &sha) {
+    if (sha.size() != 40) return false;
+    return known_objects().contains(sha) || has_packed_object(sha);
+}
+
+void forget_known_objects() {
+    known_objects().forget();
+}
+
+bool write_loose_object(const string &sha, const string &compressed) {
+    if (!known_objects().ensure_fanout(sha)) return false;
+    if (!write_file_in(REPO_DIR + "/objects/" + sha.substr(0, 2), object_path_for_sha(sha), compressed)) {
+        return false;
+    }
+    known_objects().add(sha);
+    objects_written++;
+    return true;
+}
+
+// Compresses and stores `buf`, a complete object buffer named `sha`.
+static bool write_object_buffer(const string &sha, const string &buf) {
+    string compressed = compress_data(buf);
+    if (compressed.empty()) {
+        cerr << "error: failed to compress object\n";
+        return false;
+    }
+    if (!write_loose_object(sha, compressed)) {
+        cerr << "error: failed to write object " << sha << "\n";
+        return false;
+    }
+    return true;
+}
+
+// Objects already in the store are neither compressed nor written again.
 string hash_object_from_data(const string &type, const string &data, bool write) {
     string buf = build_object_buffer(type, data);
     string sha = sha1_hex(buf);
+    if (write && !object_exists(sha) && !write_object_buffer(sha, buf)) return string();
+    return sha;
+}
+
+static const size_t STREAM_CHUNK = 64 * 1024;
+
+// Reads `fd` to EOF in STREAM_CHUNK pieces, feeding each piece to an
+// incremental SHA-1 and, when writing, to a deflate stream that goes to a
+// temp file in the objects directory. The temp file is renamed into place
+// once the object name is known, so memory use does not grow with the size
+// of the blob. Deflate starts with the first block read, which picks the
+// compression level.
+static string stream_blob_from_fd(int fd, uint64_t size, bool write, const string &path) {
+    string hdr = "blob " + to_string(size) + '\0';
+    Sha1Stream hash;
+    hash.update(hdr.data(), hdr.size());
+
+    string tmp;
+    int out_fd = -1;
+    z_stream zs;
+    memset(&zs, 0, sizeof(zs));
     if (write) {
-        string dir = REPO_DIR + "/objects/" + sha.substr(0,2);
-        ensure_dir(dir);
-        string path = object_path_for_sha(sha);
-    
-        string compressed = compress_data(buf);
-        if (compressed.empty()) {
-            cerr << "error: failed to compress object\n";
+        tmp = REPO_DIR + "/objects/tmp_obj_XXXXXX";
+        out_fd = mkstemp(&tmp[0]);
+        if (out_fd < 0) {
+            cerr << "error: cannot create temp object in " << REPO_DIR << "/objects\n";
             return string();
         }
-        write_file(path, compressed);
     }
+
+    vector<unsigned char> in(STREAM_CHUNK), out(STREAM_CHUNK);
+    bool ok = true;
+    auto deflate_chunk = [&](const unsigned char *data, size_t len, int flush) {
+        TraceTimer t(TRACE_COMPRESS);
+        trace_count(TRACE_BYTES_DEFLATED, len);
+        zs.next_in = (Bytef *)data;
+        zs.avail_in = (uInt)len;
+        do {
+            zs.next_out = out.data();
+            zs.avail_out = (uInt)out.size();
+            if (deflate(&zs, flush) == Z_STREAM_ERROR) {
+                ok = false;
+                return;
+            }
+            size_t have = out.size() - zs.avail_out;
+            if (have && !write_all(out_fd, out.data(), have)) {
+                ok = false;
+                return;
+            }
+        } while (zs.avail_out == 0);
+    };
+
+    bool zinit = false;
+    auto start_deflate = [&](const unsigned char *first, size_t len) {
+        if (deflateInit(&zs, compression_level_for(first, len)) != Z_OK) {
+            ok = false;
+            return;
+        }
+        zinit = true;
+        deflate_chunk((const unsigned char *)hdr.data(), hdr.size(), Z_NO_FLUSH);
+    };
+    uint64_t total = 0;
+    while (ok) {
+        ssize_t n = read(fd, in.data(), in.size());
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            ok = false;
+            break;
+        }
+        if (n == 0) break;
+        total += n;
+        hash.update(in.data(), n);
+        if (write && !zinit) start_deflate(in.data(), n);
+        if (write && ok) deflate_chunk(in.data(), n, Z_NO_FLUSH);
+    }
+    if (ok && total != size) {
+        cerr << "error: " << path << " changed while it was being read\n";
+        ok = false;
+    }
+
+    string sha = hash.final_hex();
+    if (!write) return ok ? sha : string();
+
+    if (ok && !zinit) start_deflate(nullptr, 0);
+    if (ok) deflate_chunk(nullptr, 0, Z_FINISH);
+    if (zinit) deflateEnd(&zs);
+    if (ok && !sync_new_file(out_fd)) ok = false;
+    if (close(out_fd) != 0) ok = false;
+    if (ok) {
+        ok = known_objects().ensure_fanout(sha) && rename(tmp.c_str(), object_path_for_sha(sha).c_str()) == 0;
+        if (ok) {
+            known_objects().add(sha);
+            objects_written++;
+        }
+    }
+    if (!ok) {
+        unlink(tmp.c_str());
+        cerr << "error: failed to write object for " << path << "\n";
+        return string();
+    }
+    return sha;
+}
+
+string hash_object_from_file(const string &path, bool write) {
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0) return string();
+    struct stat st;
+    trace_count(TRACE_STAT_CALLS);
+    if (fstat(fd, &st) != 0) {
+        close(fd);
+        return string();
+    }
+    uint64_t chunk_min = chunk_threshold();
+    bool chunked = write && chunk_min > 0 && (uint64_t)st.st_size >= chunk_min;
+    if ((uint64_t)st.st_size < STREAM_THRESHOLD && !chunked) {
+        close(fd);
+        return hash_object_from_data("blob", read_file(path), write);
+    }
+    // Hashing is cheap next to deflate, so a large file is hashed on its
+    // own first and only compressed when the object is new.
+    if (write) {
+        string sha = stream_blob_from_fd(fd, st.st_size, false, path);
+        if (sha.empty() || object_exists(sha)) {
+            close(fd);
+            return sha;
+        }
+        if (lseek(fd, 0, SEEK_SET) != 0) {
+            cerr << "error: cannot rewind " << path << ": " << strerror(errno) << "\n";
+            close(fd);
+            return string();
+        }
+    }
+    string sha = chunked ? write_chunked_blob(fd, st.st_size, path) : stream_blob_from_fd(fd, st.st_size, write, path);
+    close(fd);
     return sha;
 }
 
+// Inflates a loose object incrementally from its file: the "type size\0"
+// header can be parsed without touching the body, and the body can then be
+// pulled in caller-sized pieces.
+class LooseObjectReader {
+public:
+    explicit LooseObjectReader(const string &sha) : in(STREAM_CHUNK) {
+        memset(&zs, 0, sizeof(zs));
+        if (sha.size() < 3) return;
+        fd = open(object_path_for_sha(sha).c_str(), O_RDONLY);
+        if (fd >= 0) {
+            trace_count(TRACE_OBJECTS_OPENED);
+            zinit = inflateInit(&zs) == Z_OK;
+        }
+    }
+
+    ~LooseObjectReader() {
+        if (zinit) inflateEnd(&zs);
+        if (fd >= 0) close(fd);
+    }
+
+    bool ok() const { return fd >= 0 && zinit; }
+
+    bool read_header(string &type, uint64_t &size) {
+        if (!ok()) return false;
+        unsigned char buf[64];
+        string hdr;
+        while (true) {
+            ssize_t n = inflate_into(buf, sizeof(buf));
+            if (n <= 0) return false;
+            hdr.append((const char *)buf, n);
+            size_t nul = hdr.find('\0');
+            if (nul != string::npos) {
+                pending = hdr.substr(nul + 1);
+                hdr.resize(nul);
+                break;
+            }
+            if (hdr.size() > 64) return false;
+        }
+        size_t sp = hdr.find(' ');
+        if (sp == string::npos) return false;
+        type = hdr.substr(0, sp);
+        char *end = nullptr;
+        size = strtoull(hdr.c_str() + sp + 1, &end, 10);
+        return end && *end == '\0' && sp + 1 < hdr.size();
+    }
+
+    // Reads up to `len` body bytes. Returns the count, 0 at the end of the
+    // object, or -1 on error.
+    ssize_t read(unsigned char *out, size_t len) {
+        if (pending_pos < pending.size()) {
+            size_t n = min(len, pending.size() - pending_pos);
+            memcpy(out, pending.data() + pending_pos, n);
+            pending_pos += n;
+            return n;
+        }
+        return inflate_into(out, len);
+    }
+
+private:
+    int fd = -1;
+    bool zinit = false;
+    bool eof_in = false;
+    bool stream_end = false;
+    z_stream zs;
+    vector<unsigned char> in;
+    string pending;  // body bytes inflated together with the header
+    size_t pending_pos = 0;
+
+    ssize_t inflate_into(unsigned char *out, size_t len) {
+        if (stream_end || len == 0) return 0;
+        TraceTimer t(TRACE_DECOMPRESS);
+        zs.next_out = out;
+        zs.avail_out = (uInt)min<size_t>(len, UINT_MAX);
+        size_t want = zs.avail_out;
+        while (true) {
+            if (zs.avail_in == 0 && !eof_in) {
+                ssize_t n;
+                do {
+                    n = ::read(fd, in.data(), in.size());
+                } while (n < 0 && errno == EINTR);
+                if (n < 0) return -1;
+                if (n == 0) eof_in = true;
+                zs.next_in = in.data();
+                zs.avail_in = (uInt)n;
+            }
+            int ret = inflate(&zs, Z_NO_FLUSH);
+            size_t produced = want - zs.avail_out;
+            trace_count(TRACE_BYTES_INFLATED, produced);
+            if (ret == Z_STREAM_END) {
+                stream_end = true;
+                return produced;
+            }
+            if (ret != Z_OK && ret != Z_BUF_ERROR) return -1;
+            if (produced > 0) return produced;
+            if (eof_in && zs.avail_in == 0) return -1;  // truncated object
+        }
+    }
+};
+
+bool read_loose_object_header(const string &sha, string &type, uint64_t &size) {
+    LooseObjectReader r(sha);
+    return r.read_header(type, size);
+}
+
+static bool stream_loose_object(const string &sha, string &type, const ObjectSink &sink) {
+    LooseObjectReader r(sha);
+    uint64_t size;
+    if (!r.read_header(type, size)) return false;
+    bool chunked = type == CHUNKED_TYPE;
+    string manifest;
+    vector<unsigned char> buf(STREAM_CHUNK);
+    uint64_t total = 0;
+    while (true) {
+        ssize_t n = r.read(buf.data(), buf.size());
+        if (n < 0) return false;
+        if (n == 0) break;
+        total += n;
+        if (chunked) manifest.append((const char *)buf.data(), n);
+        else if (!sink((const char *)buf.data(), n)) return false;
+    }
+    if (total != size) return false;
+    if (!chunked) return true;
+    type = "blob";
+    return stream_chunked_blob(manifest, sink);
+}
+
+// Size-bounded LRU of decoded objects, shared by everything that runs in
+// the process. Objects are immutable, so entries never go stale.
+class ObjectCache {
+public:
+    explicit ObjectCache(size_t capacity) : capacity(capacity) {}
+
+    bool get(const string &sha, pair<string,string> &out) {
+        lock_guard<mutex> lk(m);
+        auto it = index.find(sha);
+        if (it == index.end()) {
+            misses++;
+            return false;
+        }
+        hits++;
+        lru.splice(lru.begin(), lru, it->second);
+        out = it->second->second;
+        return true;
+    }
+
+    void put(const string &sha, const pair<string,string> &obj) {
+        size_t cost = entry_cost(sha, obj);
+        if (cost > capacity / 4) return;
+        lock_guard<mutex> lk(m);
+        if (index.count(sha)) return;
+        lru.emplace_front(sha, obj);
+        index[sha] = lru.begin();
+        bytes += cost;
+        while (bytes > capacity && !lru.empty()) {
+            auto &victim = lru.back();
+            bytes -= entry_cost(victim.first, victim.second);
+            index.erase(victim.first);
+            lru.pop_back();
+        }
+    }
+
+    ObjectCacheStats stats() {
+        lock_guard<mutex> lk(m);
+        return {hits, misses, index.size(), bytes};
+    }
+
+private:
+    typedef list<pair<string, pair<string,string>>> Lru;
+
+    static size_t entry_cost(const string &sha, const pair<string,string> &obj) {
+        return sha.size() + obj.first.size() + obj.second.size() + 64;
+    }
+
+    mutex m;
+    Lru lru;
+    unordered_map<string, Lru::iterator> index;
+    size_t capacity;
+    size_t bytes = 0;
+    uint64_t hits = 0;
+    uint64_t misses = 0;
+};
+
+static ObjectCache &object_cache() {
+    static ObjectCache cache(OBJECT_CACHE_BYTES);
+    return cache;
+}
+
+ObjectCacheStats object_cache_stats() {
+    return object_cache().stats();
+}
+
+// Packed objects are looked up first; most objects live in packs once a
+// repository has been repacked, and the idx lookup is a binary search in
+// an mmapped table instead of an open() per object.
 pair<string,string> read_object(const string &sha) {
-    string path = object_path_for_sha(sha);
-    string compressed = read_file(path);
-    if (compressed.empty()) return {"",""};
-    
-    string buf = decompress_data(compressed);
-    if (buf.empty()) return {"",""};
-    size_t pos = buf.find('\0');
-    if (pos == string::npos) return {"",""};
-    string hdr = buf.substr(0, pos);
-    string data = buf.substr(pos + 1);
-    size_t sp = hdr.find(' ');
-    if (sp == string::npos) return {"",""};
-    string type = hdr.substr(0, sp);
+    pair<string,string> obj;
+    if (object_cache().get(sha, obj)) return obj;
+    if (!read_packed_object(sha, obj.first, obj.second)) {
+        obj = read_loose_object(sha);
+    }
+    if (obj.first == CHUNKED_TYPE) {
+        string data;
+        obj = read_chunked_blob(obj.second, data) ? make_pair(string("blob"), std::move(data))
+                                                  : pair<string, string>();
+    }
+    if (!obj.first.empty()) {
+        objects_read++;
+        object_cache().put(sha, obj);
+    }
+    return obj;
+}
+
+// The header gives the exact body size, so the body is inflated straight
+// into a buffer of that size.
+pair<string,string> read_loose_object(const string &sha) {
+    LooseObjectReader r(sha);
+    string type;
+    uint64_t size;
+    if (!r.read_header(type, size)) return {"",""};
+    string data(size, '\0');
+    size_t got = 0;
+    while (got < size) {
+        ssize_t n = r.read((unsigned char *)&data[got], size - got);
+        if (n <= 0) return {"",""};
+        got += n;
+    }
+    unsigned char extra;
+    if (r.read(&extra, 1) != 0) return {"",""};
     return {type, data};
 }
 
+bool read_object_header(const string &sha, string &type, uint64_t &size) {
+    if (read_packed_object_header(sha, type, size)) return true;
+    if (!read_loose_object_header(sha, type, size)) return false;
+    if (type != CHUNKED_TYPE) return true;
+    vector<BlobChunk> chunks;
+    type = "blob";
+    return parse_chunk_manifest(read_loose_object(sha).second, size, chunks);
+}
+
+bool stream_object(const string &sha, string &type, const ObjectSink &sink) {
+    objects_read++;
+    if (has_packed_object(sha)) return stream_packed_object(sha, type, sink);
+    return stream_loose_object(sha, type, sink);
+}
+
+bool write_blob_to_file(const string &sha, const string &path) {
+    int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) return false;
+    string type;
+    bool ok = stream_object(sha, type, [&](const char *data, size_t len) {
+        return write_all(fd, (const unsigned char *)data, len);
+    });
+    if (close(fd) != 0) ok = false;
+    return ok && type == "blob";
+}
+
 bool repo_exists() {
     struct stat st;
+    trace_count(TRACE_STAT_CALLS);
     return stat(REPO_DIR.c_str(), &st) == 0 && S_ISDIR(st.st_mode);
 }
 
-vector<tuple<string,string,string>> read_index() {
-    vector<tuple<string,string,string>> entries;
-    string index_path = REPO_DIR + "/index";
-    string content = read_file(index_path);
-    if (content.empty()) return entries;
-    
+// Index format v2 (binary, all integers big-endian):
+//   "MGIX" | u32 version | u32 entry count
+//   per entry: u32 ctime_sec, ctime_nsec, mtime_sec, mtime_nsec, dev, ino,
+//              st_mode, file mode | u64 size | 20-byte sha | u16 path length | path
+//   optional extensions: 4-byte signature | u32 payload length | payload
+//   20-byte SHA-1 of everything above
+// Paths longer than the u16 length can hold are refused rather than cut.
+// Extensions a reader does not know are skipped. "TREE" holds the cache
+// tree: for each directory whose tree object is known to match the index,
+// path NUL | u32 entry count | 20-byte tree sha. "FSMN" holds the
+// fsmonitor token the entries were last checked against (see fsmonitor.h).
+// Version 1 is the original text format ("mode path\tsha" per line); it is
+// still read so existing repositories keep working, and is replaced by v2
+// on the next write.
+static const char INDEX_MAGIC[4] = {'M', 'G', 'I', 'X'};
+static const uint32_t INDEX_VERSION = 2;
+
+static void index_put_be32(string &out, uint32_t v) {
+    char b[4] = {(char)(v >> 24), (char)(v >> 16), (char)(v >> 8), (char)v};
+    out.append(b, 4);
+}
+
+static uint32_t index_get_be32(const unsigned char *p) {
+    return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | (uint32_t)p[3];
+}
+
+static vector<IndexEntry> parse_text_index(const string &content) {
+    vector<IndexEntry> entries;
     istringstream iss(content);
     string line;
     while (getline(iss, line)) {
@@ -175,114 +811,722 @@ vector<tuple<string,string,string>> read_index() {
         size_t space_pos = mode_path.find(' ');
         if (space_pos == string::npos) continue;
         
-        string mode = mode_path.substr(0, space_pos);
-        string filepath = mode_path.substr(space_pos + 1);
-        
-        entries.emplace_back(filepath, mode, sha);
+        IndexEntry e;
+        e.mode = mode_path.substr(0, space_pos);
+        e.path = mode_path.substr(space_pos + 1);
+        e.sha = sha;
+        entries.push_back(std::move(e));
     }
     return entries;
 }
 
-string build_tree_from_index_entries(const vector<tuple<string,string,string>> &entries) {
-    if (entries.empty()) return string();
-    
-    map<string, vector<tuple<string,string,string>>> dir_entries;
-    
-    for (const auto &entry : entries) {
-        string filepath = get<0>(entry);
-        string mode = get<1>(entry);
-        string sha = get<2>(entry);
-        
-        size_t last_slash = filepath.rfind('/');
-        string dir = (last_slash == string::npos) ? "" : filepath.substr(0, last_slash);
-        string filename = (last_slash == string::npos) ? filepath : filepath.substr(last_slash + 1);
-        
-        dir_entries[dir].emplace_back(filename, mode, sha);
+static bool parse_cache_tree(const unsigned char *p, const unsigned char *end, CacheTree &ct) {
+    while (p < end) {
+        const unsigned char *nul = (const unsigned char *)memchr(p, '\0', end - p);
+        if (!nul || (size_t)(end - nul - 1) < 4 + SHA_DIGEST_LENGTH) return false;
+        string dir((const char *)p, nul - p);
+        CachedTree t;
+        t.entry_count = index_get_be32(nul + 1);
+        t.sha = to_hex(nul + 5, SHA_DIGEST_LENGTH);
+        ct[dir] = t;
+        p = nul + 5 + SHA_DIGEST_LENGTH;
     }
-    
-    map<string, string> dir_tree_shas;
-    
-    vector<string> dirs;
-    for (auto &kv : dir_entries) {
-        dirs.push_back(kv.first);
+    return true;
+}
+
+static bool parse_binary_index(const string &content, vector<IndexEntry> &entries, CacheTree *ct,
+                               string *fsmonitor_token) {
+    const unsigned char *p = (const unsigned char *)content.data();
+    const unsigned char *end = p + content.size();
+    if (content.size() < 12 + SHA_DIGEST_LENGTH) return false;
+    if (index_get_be32(p + 4) != INDEX_VERSION) {
+        cerr << "error: unsupported index version " << index_get_be32(p + 4) << "\n";
+        return false;
     }
-    sort(dirs.begin(), dirs.end(), [](const string &a, const string &b) {
-        return count(a.begin(), a.end(), '/') > count(b.begin(), b.end(), '/');
-    });
-    
-    for (const string &dir : dirs) {
-        vector<tuple<string,string,string>> tree_entries = dir_entries[dir];
-        
-        for (auto &entry : tree_entries) {
-            string name = get<0>(entry);
-            string mode = get<1>(entry);
-            string sha = get<2>(entry);
-            
-            string child_dir = dir.empty() ? name : dir + "/" + name;
-            if (dir_tree_shas.find(child_dir) != dir_tree_shas.end()) {
-                get<1>(entry) = "40000";
-                get<2>(entry) = dir_tree_shas[child_dir];
+
+    unsigned char digest[SHA_DIGEST_LENGTH];
+    {
+        TraceTimer t(TRACE_SHA1);
+        trace_count(TRACE_BYTES_HASHED, content.size() - SHA_DIGEST_LENGTH);
+        SHA1(p, content.size() - SHA_DIGEST_LENGTH, digest);
+    }
+    if (memcmp(digest, end - SHA_DIGEST_LENGTH, SHA_DIGEST_LENGTH) != 0) {
+        cerr << "error: index checksum mismatch\n";
+        return false;
+    }
+    end -= SHA_DIGEST_LENGTH;
+
+    uint32_t count = index_get_be32(p + 8);
+    p += 12;
+    entries.reserve(count);
+    const size_t fixed = 8 * 4 + 8 + SHA_DIGEST_LENGTH + 2;
+    for (uint32_t i = 0; i < count; ++i) {
+        if ((size_t)(end - p) < fixed) return false;
+        IndexEntry e;
+        e.st.ctime_sec = index_get_be32(p);
+        e.st.ctime_nsec = index_get_be32(p + 4);
+        e.st.mtime_sec = index_get_be32(p + 8);
+        e.st.mtime_nsec = index_get_be32(p + 12);
+        e.st.dev = index_get_be32(p + 16);
+        e.st.ino = index_get_be32(p + 20);
+        e.st.mode = index_get_be32(p + 24);
+        char mode_buf[16];
+        snprintf(mode_buf, sizeof(mode_buf), "%o", index_get_be32(p + 28));
+        e.mode = mode_buf;
+        e.st.size = ((uint64_t)index_get_be32(p + 32) << 32) | index_get_be32(p + 36);
+        e.sha = to_hex(p + 40, SHA_DIGEST_LENGTH);
+        size_t path_len = ((size_t)p[60] << 8) | p[61];
+        p += fixed;
+        if ((size_t)(end - p) < path_len) return false;
+        e.path.assign((const char *)p, path_len);
+        p += path_len;
+        entries.push_back(std::move(e));
+    }
+
+    while ((size_t)(end - p) >= 8) {
+        string sig((const char *)p, 4);
+        size_t len = index_get_be32(p + 4);
+        p += 8;
+        if ((size_t)(end - p) < len) return false;
+        if (sig == "TREE" && ct && !parse_cache_tree(p, p + len, *ct)) return false;
+        if (sig == "FSMN" && fsmonitor_token) fsmonitor_token->assign((const char *)p, len);
+        p += len;
+    }
+    return p == end;
+}
+
+bool read_index(vector<IndexEntry> &entries, CacheTree *cache_tree, string *fsmonitor_token) {
+    entries.clear();
+    if (cache_tree) cache_tree->clear();
+    if (fsmonitor_token) fsmonitor_token->clear();
+    string index_path = REPO_DIR + "/index";
+    string content = read_file(index_path);
+    if (content.empty()) {
+        if (access(index_path.c_str(), F_OK) == 0 && access(index_path.c_str(), R_OK) != 0) {
+            cerr << "error: cannot read " << index_path << "\n";
+            return false;
+        }
+        return true;
+    }
+
+    if (content.size() < 4 || memcmp(content.data(), INDEX_MAGIC, 4) != 0) {
+        entries = parse_text_index(content);
+        return true;
+    }
+    if (!parse_binary_index(content, entries, cache_tree, fsmonitor_token)) {
+        cerr << "error: corrupt index " << index_path << "\n";
+        entries.clear();
+        if (cache_tree) cache_tree->clear();
+        if (fsmonitor_token) fsmonitor_token->clear();
+        return false;
+    }
+
+    // An entry modified in the same timestamp tick the index was written in
+    // could change again without its stat data changing ("racy clean").
+    // Forget the stat data of such entries so they are always rehashed.
+    struct stat ist;
+    if (stat(index_path.c_str(), &ist) == 0) {
+        for (auto &e : entries) {
+            if (e.st.mtime_sec > (uint32_t)ist.st_mtim.tv_sec ||
+                (e.st.mtime_sec == (uint32_t)ist.st_mtim.tv_sec &&
+                 e.st.mtime_nsec >= (uint32_t)ist.st_mtim.tv_nsec)) {
+                e.st = IndexStat();
             }
         }
-        
-        sort(tree_entries.begin(), tree_entries.end(),
-            [](const auto &a, const auto &b) { return get<0>(a) < get<0>(b); });
-        
-        ostringstream ss;
-        for (auto &e : tree_entries) {
-            ss << get<1>(e) << " " << get<0>(e) << '\t' << get<2>(e) << '\n';
+    }
+    return true;
+}
+
+// Skips over the entries to the extensions without decoding them; the
+// checksum is left to the full read that follows.
+string read_index_fsmonitor_token() {
+    string content = read_file(REPO_DIR + "/index");
+    if (content.size() < 12 + SHA_DIGEST_LENGTH || memcmp(content.data(), INDEX_MAGIC, 4) != 0) return string();
+    const unsigned char *p = (const unsigned char *)content.data();
+    const unsigned char *end = p + content.size() - SHA_DIGEST_LENGTH;
+    uint32_t count = index_get_be32(p + 8);
+    p += 12;
+    const size_t fixed = 8 * 4 + 8 + SHA_DIGEST_LENGTH + 2;
+    for (uint32_t i = 0; i < count; ++i) {
+        if ((size_t)(end - p) < fixed) return string();
+        size_t path_len = ((size_t)p[60] << 8) | p[61];
+        p += fixed + path_len;
+        if (p > end) return string();
+    }
+    while ((size_t)(end - p) >= 8) {
+        size_t len = index_get_be32(p + 4);
+        if ((size_t)(end - p - 8) < len) break;
+        if (memcmp(p, "FSMN", 4) == 0) return string((const char *)p + 8, len);
+        p += 8 + len;
+    }
+    return string();
+}
+
+void fill_index_stat(IndexStat &ist, const struct stat &st) {
+    ist.ctime_sec = (uint32_t)st.st_ctim.tv_sec;
+    ist.ctime_nsec = (uint32_t)st.st_ctim.tv_nsec;
+    ist.mtime_sec = (uint32_t)st.st_mtim.tv_sec;
+    ist.mtime_nsec = (uint32_t)st.st_mtim.tv_nsec;
+    ist.dev = (uint32_t)st.st_dev;
+    ist.ino = (uint32_t)st.st_ino;
+    ist.mode = (uint32_t)st.st_mode;
+    ist.size = (uint64_t)st.st_size;
+}
+
+bool index_stat_matches(const IndexStat &ist, const struct stat &st) {
+    if (ist.mtime_sec == 0 && ist.size == 0 && ist.ino == 0) return false;
+    IndexStat cur;
+    fill_index_stat(cur, st);
+    return cur.ctime_sec == ist.ctime_sec && cur.ctime_nsec == ist.ctime_nsec &&
+           cur.mtime_sec == ist.mtime_sec && cur.mtime_nsec == ist.mtime_nsec &&
+           cur.dev == ist.dev && cur.ino == ist.ino &&
+           cur.mode == ist.mode && cur.size == ist.size;
+}
+
+void invalidate_cache_tree(CacheTree &cache_tree, const string &path) {
+    string dir = path;
+    while (true) {
+        size_t slash = dir.rfind('/');
+        if (slash == string::npos) break;
+        dir.resize(slash);
+        cache_tree.erase(dir);
+    }
+    cache_tree.erase("");
+}
+
+void append_tree_entry(string &body, const string &mode, const string &name, const string &sha) {
+    body += mode;
+    body += ' ';
+    body += name;
+    if (repository_format_version() >= 1) {
+        unsigned char raw[20];
+        from_hex(sha, raw);
+        body += '\0';
+        body.append((const char *)raw, sizeof(raw));
+    } else {
+        body += '\t';
+        body += sha;
+        body += '\n';
+    }
+}
+
+// A directory of the tree being built from the index. Entries are sorted
+// by name; a subdirectory's sha is filled in from `subtree` (an index into
+// the plan) once that tree has been written.
+struct PendingTree {
+    string dir;
+    uint32_t entry_count;  // index entries beneath the directory
+    size_t depth;
+    vector<tuple<string, string, string, long>> items;  // name, mode, sha, subtree or -1
+    string sha;  // from the cache tree, or once written
+};
+
+// Plans the tree for entries[lo, hi), which all live under `dir` ("" is
+// the root) and are sorted by path, so every subdirectory is a contiguous
+// run. A directory whose cached tree still covers the same number of
+// entries is taken from the cache without visiting its children.
+static size_t plan_tree_range(const vector<IndexEntry> &entries, size_t lo, size_t hi, const string &dir,
+                              size_t depth, const CacheTree *cache_tree, vector<PendingTree> &plan) {
+    size_t id = plan.size();
+    plan.push_back({dir, (uint32_t)(hi - lo), depth, {}, string()});
+    if (cache_tree) {
+        auto it = cache_tree->find(dir);
+        if (it != cache_tree->end() && it->second.entry_count == hi - lo) {
+            plan[id].sha = it->second.sha;
+            return id;
         }
-        string tree_data = ss.str();
-        string tree_sha = hash_object_from_data("tree", tree_data, true);
-        dir_tree_shas[dir] = tree_sha;
     }
-    
-    return dir_tree_shas[""];
+
+    size_t prefix_len = dir.empty() ? 0 : dir.size() + 1;
+    vector<tuple<string, string, string, long>> items;
+    size_t i = lo;
+    while (i < hi) {
+        const string &path = entries[i].path;
+        size_t slash = path.find('/', prefix_len);
+        if (slash == string::npos) {
+            items.emplace_back(path.substr(prefix_len), entries[i].mode, entries[i].sha, -1);
+            ++i;
+            continue;
+        }
+        size_t j = i + 1;
+        while (j < hi && entries[j].path.compare(0, slash + 1, path, 0, slash + 1) == 0) ++j;
+        string sub = path.substr(0, slash);
+        long child = (long)plan_tree_range(entries, i, j, sub, depth + 1, cache_tree, plan);
+        items.emplace_back(sub.substr(prefix_len), "40000", string(), child);
+        i = j;
+    }
+    sort(items.begin(), items.end(), [](const auto &a, const auto &b) { return get<0>(a) < get<0>(b); });
+    plan[id].items = std::move(items);
+    return id;
+}
+
+// Writes the trees bottom-up, one depth at a time: every directory at a
+// depth depends only on deeper ones, so all of them are hashed with a
+// single sha1_batch call.
+static string build_tree_range(const vector<IndexEntry> &entries, CacheTree *cache_tree) {
+    vector<PendingTree> plan;
+    plan_tree_range(entries, 0, entries.size(), "", 0, cache_tree, plan);
+
+    vector<vector<size_t>> levels;
+    for (size_t i = 0; i < plan.size(); ++i) {
+        if (!plan[i].sha.empty()) continue;
+        if (levels.size() <= plan[i].depth) levels.resize(plan[i].depth + 1);
+        levels[plan[i].depth].push_back(i);
+    }
+    for (size_t d = levels.size(); d-- > 0;) {
+        const vector<size_t> &level = levels[d];
+        vector<string> bufs(level.size());
+        vector<const string *> ptrs(level.size());
+        for (size_t k = 0; k < level.size(); ++k) {
+            string body;
+            for (auto &item : plan[level[k]].items) {
+                long child = get<3>(item);
+                append_tree_entry(body, get<1>(item), get<0>(item), child < 0 ? get<2>(item) : plan[child].sha);
+            }
+            bufs[k] = build_object_buffer("tree", body);
+            ptrs[k] = &bufs[k];
+        }
+        vector<string> shas = sha1_hex_batch(ptrs);
+        for (size_t k = 0; k < level.size(); ++k) {
+            if (!object_exists(shas[k]) && !write_object_buffer(shas[k], bufs[k])) return string();
+            PendingTree &t = plan[level[k]];
+            t.sha = shas[k];
+            if (cache_tree) (*cache_tree)[t.dir] = {t.sha, t.entry_count};
+        }
+    }
+    return plan[0].sha;
+}
+
+string build_tree_from_index_entries(const vector<IndexEntry> &entries, CacheTree *cache_tree) {
+    if (entries.empty()) return string();
+    auto by_path = [](const IndexEntry &a, const IndexEntry &b) { return a.path < b.path; };
+    if (!is_sorted(entries.begin(), entries.end(), by_path)) {
+        vector<IndexEntry> sorted_entries = entries;
+        sort(sorted_entries.begin(), sorted_entries.end(), by_path);
+        return build_tree_range(sorted_entries, nullptr);
+    }
+    return build_tree_range(entries, cache_tree);
 }
 
 string write_tree_recursive(const string &path) {
-    vector<tuple<string,string,string>> entries = read_index();
-    return build_tree_from_index_entries(entries);
+    return build_tree_from_index();
 }
 
-bool write_index(const vector<tuple<string,string,string>> &entries) {
-    ostringstream ss;
+bool write_index(const vector<IndexEntry> &entries, const CacheTree *cache_tree, const string *fsmonitor_token) {
+    string out;
+    out.reserve(12 + entries.size() * 96);
+    out.append(INDEX_MAGIC, 4);
+    index_put_be32(out, INDEX_VERSION);
+    index_put_be32(out, (uint32_t)entries.size());
     for (auto &e: entries) {
-        ss << get<1>(e) << " " << get<0>(e) << "\t" << get<2>(e) << "\n";
+        index_put_be32(out, e.st.ctime_sec);
+        index_put_be32(out, e.st.ctime_nsec);
+        index_put_be32(out, e.st.mtime_sec);
+        index_put_be32(out, e.st.mtime_nsec);
+        index_put_be32(out, e.st.dev);
+        index_put_be32(out, e.st.ino);
+        index_put_be32(out, e.st.mode);
+        index_put_be32(out, (uint32_t)strtoul(e.mode.c_str(), nullptr, 8));
+        index_put_be32(out, (uint32_t)(e.st.size >> 32));
+        index_put_be32(out, (uint32_t)e.st.size);
+        unsigned char raw[SHA_DIGEST_LENGTH] = {0};
+        from_hex(e.sha, raw);
+        out.append((const char *)raw, SHA_DIGEST_LENGTH);
+        if (e.path.size() > 0xffff) {
+            cerr << "error: path too long for the index: " << e.path.substr(0, 64) << "...\n";
+            return false;
+        }
+        out.push_back((char)(e.path.size() >> 8));
+        out.push_back((char)e.path.size());
+        out += e.path;
+    }
+    if (cache_tree && !cache_tree->empty()) {
+        string payload;
+        for (auto &kv : *cache_tree) {
+            payload += kv.first;
+            payload.push_back('\0');
+            index_put_be32(payload, kv.second.entry_count);
+            unsigned char raw[SHA_DIGEST_LENGTH] = {0};
+            from_hex(kv.second.sha, raw);
+            payload.append((const char *)raw, SHA_DIGEST_LENGTH);
+        }
+        out += "TREE";
+        index_put_be32(out, (uint32_t)payload.size());
+        out += payload;
     }
-    return write_file(REPO_DIR + "/index", ss.str());
+    if (fsmonitor_token && !fsmonitor_token->empty()) {
+        out += "FSMN";
+        index_put_be32(out, (uint32_t)fsmonitor_token->size());
+        out += *fsmonitor_token;
+    }
+    unsigned char digest[SHA_DIGEST_LENGTH];
+    {
+        TraceTimer t(TRACE_SHA1);
+        trace_count(TRACE_BYTES_HASHED, out.size());
+        SHA1((const unsigned char *)out.data(), out.size(), digest);
+    }
+    out.append((const char *)digest, SHA_DIGEST_LENGTH);
+    return write_file(REPO_DIR + "/index", out);
 }
 
-bool add_files_to_index(const vector<string> &files) {
-    vector<tuple<string,string,string>> index = read_index();
-    
-    unordered_map<string,string> m;
-    for (auto &e: index) m[get<0>(e)] = get<2>(e);
+struct BlobRead {
+    size_t slot;
+    string data;
+    bool streamed;  // too large to load; the hasher streams it from disk
+};
 
-    for (const string &f: files) {
-        string data;
-        try {
-            data = read_file(f);
-        } catch (...) { data = string(); }
-        if (data.empty() && access(f.c_str(), F_OK) != 0) {
+struct BlobObject {
+    size_t slot;
+    string sha;
+    string compressed;
+    bool stored;  // already in the store, or written by the streaming path
+};
+
+// Small files are hashed in batches of up to BLOB_BATCH (and, when read
+// serially, about BLOB_BATCH_BYTES), so sha1_batch can fill its lanes.
+static const size_t BLOB_BATCH = 64;
+static const size_t BLOB_BATCH_BYTES = 4 << 20;
+
+// Hashes `batch` with one sha1_batch call and hands each object to `emit`:
+// those already in the store as stored, the rest compressed and ready to
+// be written.
+static bool hash_blob_batch(vector<BlobRead> &batch, const vector<string> &paths,
+                            const function<bool(BlobObject &&)> &emit) {
+    vector<string> bufs(batch.size());
+    vector<const string *> ptrs(batch.size());
+    for (size_t i = 0; i < batch.size(); ++i) {
+        bufs[i] = build_object_buffer("blob", batch[i].data);
+        string().swap(batch[i].data);
+        ptrs[i] = &bufs[i];
+    }
+    vector<string> shas = sha1_hex_batch(ptrs);
+    bool ok = true;
+    for (size_t i = 0; i < batch.size(); ++i) {
+        size_t slot = batch[i].slot;
+        if (object_exists(shas[i])) {
+            ok = emit({slot, std::move(shas[i]), string(), true}) && ok;
+            continue;
+        }
+        string compressed = compress_data(bufs[i]);
+        string().swap(bufs[i]);
+        if (compressed.empty()) {
+            cerr << "error: failed to compress " << paths[slot] << "\n";
+            ok = false;
             continue;
         }
-        string sha = hash_object_from_data("blob", data, true);
-        m[f] = sha;
+        ok = emit({slot, std::move(shas[i]), std::move(compressed), false}) && ok;
+    }
+    return ok;
+}
+
+// Large files are streamed (or chunked) in one pass instead of being
+// loaded and batched.
+static bool stream_blob(uint64_t size) {
+    return size >= STREAM_THRESHOLD || (chunk_threshold() && size >= chunk_threshold());
+}
+
+// Hashes and stores `paths` as blobs. With more than one job this runs as a
+// pipeline: reader threads feed file contents to hasher/compressor threads,
+// which feed finished objects to writer threads. Every result is stored at
+// its input position, so the outcome does not depend on scheduling. Files
+// that vanish before they are read get an empty sha.
+static bool store_blobs(const vector<string> &paths, const vector<uint64_t> &sizes,
+                        unsigned jobs, vector<string> &shas) {
+    shas.assign(paths.size(), string());
+    if (jobs <= 1 || paths.size() < 2) {
+        vector<BlobRead> batch;
+        size_t batch_bytes = 0;
+        auto flush = [&] {
+            bool ok = hash_blob_batch(batch, paths, [&](BlobObject &&obj) {
+                if (!obj.stored && !write_loose_object(obj.sha, obj.compressed)) {
+                    cerr << "error: failed to write object " << obj.sha << "\n";
+                    return false;
+                }
+                shas[obj.slot] = std::move(obj.sha);
+                return true;
+            });
+            batch.clear();
+            batch_bytes = 0;
+            return ok;
+        };
+        for (size_t i = 0; i < paths.size(); ++i) {
+            if (stream_blob(sizes[i])) {
+                shas[i] = hash_object_from_file(paths[i], true);
+                if (shas[i].empty() && access(paths[i].c_str(), F_OK) == 0) return false;
+                continue;
+            }
+            string data = read_file(paths[i]);
+            if (data.empty() && access(paths[i].c_str(), F_OK) != 0) continue;
+            batch_bytes += data.size();
+            batch.push_back({i, std::move(data), false});
+            if ((batch.size() == BLOB_BATCH || batch_bytes >= BLOB_BATCH_BYTES) && !flush()) return false;
+        }
+        return flush();
+    }
+
+    unsigned readers = max(1u, jobs / 4);
+    unsigned hashers = jobs;
+    unsigned writers = max(1u, jobs / 4);
+    BoundedQueue<BlobRead> read_q(max<size_t>(2 * jobs, BLOB_BATCH));
+    BoundedQueue<BlobObject> write_q(2 * jobs);
+    atomic<size_t> next(0);
+    atomic<bool> failed(false);
+
+    vector<thread> reader_threads, hasher_threads, writer_threads;
+    for (unsigned t = 0; t < readers; ++t) {
+        reader_threads.emplace_back([&] {
+            for (size_t i; (i = next++) < paths.size();) {
+                if (stream_blob(sizes[i])) {
+                    read_q.push({i, string(), true});
+                    continue;
+                }
+                string data = read_file(paths[i]);
+                if (data.empty() && access(paths[i].c_str(), F_OK) != 0) continue;
+                read_q.push({i, std::move(data), false});
+            }
+        });
     }
+    for (unsigned t = 0; t < hashers; ++t) {
+        hasher_threads.emplace_back([&] {
+            vector<BlobRead> work, batch;
+            while (read_q.pop_some(work, BLOB_BATCH)) {
+                batch.clear();
+                for (BlobRead &in : work) {
+                    if (!in.streamed) {
+                        batch.push_back(std::move(in));
+                        continue;
+                    }
+                    string sha = hash_object_from_file(paths[in.slot], true);
+                    if (!sha.empty()) write_q.push({in.slot, std::move(sha), string(), true});
+                    else if (access(paths[in.slot].c_str(), F_OK) == 0) failed = true;
+                }
+                bool ok = hash_blob_batch(batch, paths, [&](BlobObject &&obj) {
+                    write_q.push(std::move(obj));
+                    return true;
+                });
+                if (!ok) failed = true;
+            }
+        });
+    }
+    for (unsigned t = 0; t < writers; ++t) {
+        writer_threads.emplace_back([&] {
+            BlobObject obj;
+            while (write_q.pop(obj)) {
+                if (!obj.stored && !write_loose_object(obj.sha, obj.compressed)) {
+                    cerr << "error: failed to write object " << obj.sha << "\n";
+                    failed = true;
+                    continue;
+                }
+                shas[obj.slot] = obj.sha;
+            }
+        });
+    }
+
+    for (auto &t : reader_threads) t.join();
+    read_q.close();
+    for (auto &t : hasher_threads) t.join();
+    write_q.close();
+    for (auto &t : writer_threads) t.join();
+    return !failed;
+}
 
-    vector<tuple<string,string,string>> out;
-    out.reserve(m.size());
-    for (auto &kv: m) out.emplace_back(kv.first, "100644", kv.second);
+// Files whose stat data still matches their index entry are assumed
+// unchanged and are not read or hashed again.
+bool add_files_to_index(const vector<string> &files, unsigned jobs, const string *fsmonitor_token,
+                        const vector<string> *prune) {
+    CacheTree cache_tree;
+    vector<IndexEntry> index;
+    if (!read_index(index, &cache_tree)) return false;
+
+    vector<string> tracked;
+    if (prune) {
+        unordered_set<string> present(files.begin(), files.end());
+        auto under = [&](const string &path) {
+            for (const string &d : *prune) {
+                if (d.empty() || path == d ||
+                    (path.size() > d.size() && path.compare(0, d.size(), d) == 0 && path[d.size()] == '/')) {
+                    return true;
+                }
+            }
+            return false;
+        };
+        vector<IndexEntry> kept;
+        kept.reserve(index.size());
+        for (auto &e : index) {
+            struct stat st;
+            if (!present.count(e.path) && under(e.path)) {
+                if (lstat(e.path.c_str(), &st) != 0 || !S_ISREG(st.st_mode)) {
+                    invalidate_cache_tree(cache_tree, e.path);
+                    continue;
+                }
+                tracked.push_back(e.path);
+            }
+            kept.push_back(std::move(e));
+        }
+        index.swap(kept);
+    }
     
-    sort(out.begin(), out.end(), [](auto &a, auto &b){ return get<0>(a) < get<0>(b); });
-    return write_index(out);
+    unordered_map<string,size_t> pos;
+    for (size_t i = 0; i < index.size(); ++i) pos[index[i].path] = i;
+
+    vector<string> changed;
+    vector<uint64_t> changed_size;
+    vector<struct stat> changed_st;
+    auto check = [&](const string &f) {
+        struct stat st;
+        trace_count(TRACE_STAT_CALLS);
+        if (lstat(f.c_str(), &st) != 0 || !S_ISREG(st.st_mode)) return;
+        auto it = pos.find(f);
+        if (it != pos.end() && index_stat_matches(index[it->second].st, st)) return;
+        changed.push_back(f);
+        changed_size.push_back(st.st_size);
+        changed_st.push_back(st);
+    };
+    for (const string &f : files) check(f);
+    for (const string &f : tracked) check(f);
+
+    vector<string> shas;
+    if (!store_blobs(changed, changed_size, jobs, shas)) return false;
+
+    for (size_t i = 0; i < changed.size(); ++i) {
+        if (shas[i].empty()) continue;
+        auto it = pos.find(changed[i]);
+        if (it == pos.end()) {
+            it = pos.emplace(changed[i], index.size()).first;
+            index.push_back(IndexEntry());
+            index.back().path = changed[i];
+        }
+        IndexEntry &e = index[it->second];
+        if (e.sha != shas[i]) invalidate_cache_tree(cache_tree, e.path);
+        e.mode = "100644";
+        e.sha = shas[i];
+        fill_index_stat(e.st, changed_st[i]);
+    }
+
+    sort(index.begin(), index.end(), [](const IndexEntry &a, const IndexEntry &b){ return a.path < b.path; });
+    return write_index(index, &cache_tree, fsmonitor_token);
 }
 
 
+// Only directories invalidated since the last write-tree/commit are
+// rehashed; the refreshed cache tree is saved back into the index.
 string build_tree_from_index() {
-    vector<tuple<string,string,string>> entries = read_index();
-    return build_tree_from_index_entries(entries);
+    CacheTree cache_tree;
+    string fsmonitor_token;
+    vector<IndexEntry> entries;
+    if (!read_index(entries, &cache_tree, &fsmonitor_token)) return string();
+    CacheTree before = cache_tree;
+    string sha = build_tree_from_index_entries(entries, &cache_tree);
+    if (!sha.empty() && cache_tree != before) write_index(entries, &cache_tree, &fsmonitor_token);
+    return sha;
+}
+
+// Compares index entries [lo, hi), all under `dir`, with the tree that
+// `dir` has in HEAD. A directory whose cache-tree entry matches the HEAD
+// tree is skipped without reading anything beneath it.
+static bool diff_index_range(const vector<IndexEntry> &entries, size_t lo, size_t hi, const string &dir,
+                             const string &tree_sha, const CacheTree &cache_tree, vector<StatusChange> &out) {
+    auto cached = cache_tree.find(dir);
+    if (!tree_sha.empty() && cached != cache_tree.end() && cached->second.sha == tree_sha &&
+        cached->second.entry_count == hi - lo) {
+        return true;
+    }
+
+    string body;
+    unordered_map<string_view, TreeEntry> head;
+    if (!tree_sha.empty()) {
+        auto p = read_object(tree_sha);
+        if (p.first != "tree") return false;
+        body = move(p.second);
+        TreeIterator it(body);
+        TreeEntry e;
+        while (it.next(e)) head.emplace(e.name, e);
+        if (it.bad()) return false;
+    }
+
+    size_t prefix_len = dir.empty() ? 0 : dir.size() + 1;
+    auto removed = [&](const TreeEntry &e) {
+        string path = dir.empty() ? string(e.name) : dir + "/" + string(e.name);
+        if (!e.is_tree()) {
+            out.push_back({path, 'D'});
+            return;
+        }
+        unordered_map<string, string> files;
+        collect_tree_files(e.sha_hex(), path, files);
+        for (auto &kv : files) out.push_back({kv.first, 'D'});
+    };
+
+    size_t i = lo;
+    while (i < hi) {
+        const string &path = entries[i].path;
+        size_t slash = path.find('/', prefix_len);
+        string_view name = string_view(path).substr(prefix_len, slash == string::npos ? string::npos : slash - prefix_len);
+        auto h = head.find(name);
+        const TreeEntry *he = h == head.end() ? nullptr : &h->second;
+        if (slash == string::npos) {
+            if (he && he->is_tree()) removed(*he);
+            if (!he || he->is_tree()) out.push_back({path, 'A'});
+            else if (he->sha_hex() != entries[i].sha || he->mode != entries[i].mode) out.push_back({path, 'M'});
+            if (he) head.erase(h);
+            ++i;
+            continue;
+        }
+        size_t j = i + 1;
+        while (j < hi && entries[j].path.compare(0, slash + 1, path, 0, slash + 1) == 0) ++j;
+        string sub_tree;
+        if (he && he->is_tree()) sub_tree = he->sha_hex();
+        else if (he) removed(*he);
+        if (he) head.erase(h);
+        if (!diff_index_range(entries, i, j, path.substr(0, slash), sub_tree, cache_tree, out)) return false;
+        i = j;
+    }
+    for (auto &kv : head) removed(kv.second);
+    return true;
+}
+
+bool diff_index_against_tree(const vector<IndexEntry> &entries, const CacheTree &cache_tree,
+                             const string &tree_sha, vector<StatusChange> &out) {
+    return diff_index_range(entries, 0, entries.size(), "", tree_sha, cache_tree, out);
+}
+
+// Workers take entries from a shared counter. Only entries whose stat data
+// differs from the index are hashed; one that hashes to the indexed SHA is
+// clean after all and gets fresh stat data.
+bool check_worktree(vector<IndexEntry> &entries, const vector<size_t> &which, unsigned jobs,
+                    vector<StatusChange> &out) {
+    vector<char> code(which.size(), 0);
+    vector<char> refreshed(which.size(), 0);
+    atomic<size_t> next{0};
+    auto worker = [&]() {
+        for (size_t k; (k = next++) < which.size();) {
+            IndexEntry &e = entries[which[k]];
+            struct stat st;
+            trace_count(TRACE_STAT_CALLS);
+            if (lstat(e.path.c_str(), &st) != 0 || !S_ISREG(st.st_mode)) {
+                code[k] = 'D';
+                continue;
+            }
+            if (index_stat_matches(e.st, st)) continue;
+            if (hash_object_from_file(e.path, false) != e.sha) {
+                code[k] = 'M';
+                continue;
+            }
+            fill_index_stat(e.st, st);
+            refreshed[k] = 1;
+        }
+    };
+    unsigned workers = max(1u, min<unsigned>(jobs, (unsigned)(which.size() / 256 + 1)));
+    vector<thread> pool;
+    for (unsigned t = 1; t < workers; ++t) pool.emplace_back(worker);
+    worker();
+    for (auto &t : pool) t.join();
+
+    bool any_refreshed = false;
+    for (size_t k = 0; k < which.size(); ++k) {
+        if (code[k]) out.push_back({entries[which[k]].path, code[k]});
+        if (refreshed[k]) any_refreshed = true;
+    }
+    return any_refreshed;
 }
 
 
@@ -310,8 +1554,11 @@ string read_ref(const string &ref) {
     return content;
 }
 
+// In batch mode the objects a ref points to are made durable before the
+// ref is, so a crash can lose the update but never leave a dangling ref.
 bool write_ref(const string &ref, const string &sha) {
     string path = REPO_DIR + "/" + ref;
+    if (!sync_written_files()) return false;
     return write_file(path, sha + "\n");
 }
 
@@ -343,10 +1590,17 @@ CommitInfo parse_commit(const string &commit_data) {
             info.message += line + "\n";
         } else if (line.empty()) {
             reading_message = true;
+        } else if (line.find("tree ") == 0) {
+            info.tree = line.substr(5);
         } else if (line.find("parent ") == 0) {
             info.parent = line.substr(7);  
         } else if (line.find("author ") == 0) {
             info.author = line.substr(7);
+        } else if (line.find("committer ") == 0) {
+            // "committer name <email> <timestamp> <tz>"
+            size_t tz = line.rfind(' ');
+            size_t ts = tz == string::npos ? string::npos : line.rfind(' ', tz - 1);
+            if (ts != string::npos) info.time = strtoll(line.c_str() + ts + 1, nullptr, 10);
         }
     }
     if (!info.message.empty() && info.message.back() == '\n') {
@@ -355,123 +1609,274 @@ CommitInfo parse_commit(const string &commit_data) {
     return info;
 }
 
-// Extract tree SHA from a commit object
-static string get_tree_sha_from_commit(const string &commit_sha) {
-    auto p = read_object(commit_sha);
-    if (p.first.empty() || p.first != "commit") return string();
-    
-    istringstream ss(p.second);
-    string line;
-    while (getline(ss, line)) {
-        if (line.find("tree ") == 0) {
-            return line.substr(5);  
-        }
-    }
-    return string();
+// Extract tree SHA from a commit (the commit-graph answers without
+// inflating the commit object)
+string get_tree_sha_from_commit(const string &commit_sha) {
+    GraphCommit c;
+    if (!load_commit(commit_sha, c)) return string();
+    return c.tree;
 }
 
 // Helper to recursively collect files from tree
 void collect_tree_files(const string &tree_sha, const string &prefix, unordered_map<string, string> &tree_files) {
     auto p = read_object(tree_sha);
     if (p.first.empty() || p.first != "tree") return;
-    
-    istringstream ss(p.second);
-    string line;
-    while (getline(ss, line)) {
-        if (line.empty()) continue;
-        size_t tab = line.find('\t');
-        if (tab == string::npos) continue;
-        string left = line.substr(0, tab);
-        string entry_sha = line.substr(tab + 1);
-        
-        size_t sp = left.find(' ');
-        if (sp == string::npos) continue;
-        string mode = left.substr(0, sp);
-        string name = left.substr(sp + 1);
-        
-        string full_path = prefix.empty() ? name : prefix + "/" + name;
-        
-        if (mode == "40000") {
-            collect_tree_files(entry_sha, full_path, tree_files);
+
+    TreeIterator it(p.second);
+    TreeEntry e;
+    string full_path = prefix;
+    if (!prefix.empty()) full_path += '/';
+    size_t base_len = full_path.size();
+    while (it.next(e)) {
+        full_path.resize(base_len);
+        full_path.append(e.name.data(), e.name.size());
+        if (e.is_tree()) {
+            collect_tree_files(e.sha_hex(), full_path, tree_files);
         } else {
-            tree_files[full_path] = entry_sha;
+            tree_files[full_path] = e.sha_hex();
         }
     }
 }
 
-// Helper to collect current working files (excluding hidden)
-static void collect_current_files(const string &path, const string &prefix, unordered_set<string> &current_files) {
-    filesystem::path fp(path);
-    try {
-        for (auto &entry: filesystem::directory_iterator(fp)) {
-            string filename = entry.path().filename().string();
-            if (filename[0] == '.') continue;  
-            
-            string full_path = prefix.empty() ? filename : prefix + "/" + filename;
-            if (filesystem::is_directory(entry.path())) {
-                collect_current_files(entry.path().string(), full_path, current_files);
-            } else if (filesystem::is_regular_file(entry.path())) {
-                current_files.insert(full_path);
-            }
+// Reads a tree into views over `body`, which must outlive `items`. An
+// empty SHA reads as an empty tree.
+static bool read_tree_entries(const string &tree_sha, string &body, vector<TreeEntry> &items) {
+    items.clear();
+    body.clear();
+    if (tree_sha.empty()) return true;
+    auto p = read_object(tree_sha);
+    if (p.first != "tree") return false;
+    body = move(p.second);
+    TreeIterator it(body);
+    TreeEntry e;
+    while (it.next(e)) items.push_back(e);
+    return !it.bad();
+}
+
+// Follows `path` one component at a time, reading only the trees on the
+// way. Returns false when the path does not exist in the tree.
+bool tree_entry(const string &tree_sha, const string &path, string &mode, string &sha) {
+    mode.clear();
+    sha.clear();
+    string cur = tree_sha;
+    size_t start = 0;
+    while (!cur.empty()) {
+        size_t slash = path.find('/', start);
+        string_view name = string_view(path).substr(start, slash == string::npos ? string::npos : slash - start);
+        auto p = read_object(cur);
+        if (p.first != "tree") return false;
+        TreeIterator it(p.second);
+        TreeEntry e;
+        bool found = false;
+        while (!found && it.next(e)) found = e.name == name;
+        if (!found) return false;
+        if (slash == string::npos) {
+            mode = string(e.mode);
+            sha = e.sha_hex();
+            return true;
         }
-    } catch (...) {}
+        if (!e.is_tree()) return false;
+        cur = e.sha_hex();
+        start = slash + 1;
+    }
+    return false;
 }
 
-vector<CheckoutChange> plan_checkout(const string &target_tree_sha, const string &current_commit_sha) {
-    vector<CheckoutChange> changes;
+// Both trees are sorted by name, so they are merged like two sorted lists.
+// Subtrees with the same SHA on both sides are skipped without being read;
+// an empty tree SHA stands for a tree that does not exist on that side.
+bool diff_trees(const string &old_tree, const string &new_tree, const string &prefix, vector<TreeChange> &out) {
+    if (old_tree == new_tree) return true;
+    string old_body, new_body;
+    vector<TreeEntry> a, b;
+    if (!read_tree_entries(old_tree, old_body, a) || !read_tree_entries(new_tree, new_body, b)) return false;
+
+    size_t i = 0, j = 0;
+    while (i < a.size() || j < b.size()) {
+        int cmp;
+        if (i == a.size()) cmp = 1;
+        else if (j == b.size()) cmp = -1;
+        else cmp = a[i].name.compare(b[j].name);
+
+        const TreeEntry *oi = cmp <= 0 ? &a[i] : nullptr;
+        const TreeEntry *ni = cmp >= 0 ? &b[j] : nullptr;
+        if (oi) ++i;
+        if (ni) ++j;
+        if (oi && ni && oi->mode == ni->mode && oi->same_sha(*ni)) continue;
+
+        string_view name = oi ? oi->name : ni->name;
+        string path = prefix.empty() ? string(name) : prefix + "/" + string(name);
+        bool old_dir = oi && oi->is_tree();
+        bool new_dir = ni && ni->is_tree();
+        string old_sub = old_dir ? oi->sha_hex() : string();
+        string new_sub = new_dir ? ni->sha_hex() : string();
+        if ((old_dir || new_dir) && !diff_trees(old_sub, new_sub, path, out)) return false;
+
+        string old_blob = oi && !old_dir ? oi->sha_hex() : string();
+        string new_blob = ni && !new_dir ? ni->sha_hex() : string();
+        if (old_blob != new_blob || (!old_blob.empty() && oi->mode != ni->mode)) {
+            out.push_back({path, old_blob, new_blob});
+        }
+    }
+    return true;
+}
+
+bool plan_checkout(const string &target_tree_sha, const string &current_commit_sha, vector<CheckoutChange> &changes) {
+    changes.clear();
     
-    unordered_map<string, string> current_tree_files;
+    string current_tree_sha;
     if (!current_commit_sha.empty()) {
-        string current_tree_sha = get_tree_sha_from_commit(current_commit_sha);
-        if (!current_tree_sha.empty()) {
-            collect_tree_files(current_tree_sha, "", current_tree_files);
+        current_tree_sha = get_tree_sha_from_commit(current_commit_sha);
+        if (current_tree_sha.empty()) {
+            cerr << "error: cannot read the tree of commit " << current_commit_sha << "\n";
+            return false;
         }
     }
     
-    unordered_map<string, string> target_tree_files;
-    collect_tree_files(target_tree_sha, "", target_tree_files);
-    
-    for (auto &kv: target_tree_files) {
-        const string &path = kv.first;
-        const string &target_sha = kv.second;
-        
-        auto it = current_tree_files.find(path);
-        if (it == current_tree_files.end()) {
-            changes.push_back({"restore", path});
-        } else if (it->second != target_sha) {
-            // File exists but with different content (different SHA)
-            changes.push_back({"restore", path});
-        }
+    vector<TreeChange> diff;
+    if (!diff_trees(current_tree_sha, target_tree_sha, "", diff)) {
+        cerr << "error: cannot compare the trees of HEAD and the target commit\n";
+        return false;
     }
     
-    for (auto &kv: current_tree_files) {
-        const string &path = kv.first;
-        if (target_tree_files.find(path) == target_tree_files.end()) {
-            changes.push_back({"delete", path});
-        }
+    for (auto &d: diff) {
+        if (!d.new_sha.empty()) changes.push_back({"restore", d.path, d.new_sha});
+    }
+    for (auto &d: diff) {
+        if (d.new_sha.empty()) changes.push_back({"delete", d.path, string()});
     }
     
-    return changes;
+    return true;
 }
 
-vector<CheckoutChange> plan_checkout(const string &tree_sha, bool dry_run) {
-    vector<CheckoutChange> changes;
-    
-    unordered_map<string, string> tree_files;
-    collect_tree_files(tree_sha, "", tree_files);
-    
-    unordered_set<string> current_files;
-    collect_current_files(".", "", current_files);
-    
-    for (auto &kv: tree_files) {
-        changes.push_back({"restore", kv.first});
+static void add_parent_dirs(const string &path, set<string> &dirs) {
+    size_t slash = path.rfind('/');
+    while (slash != string::npos && slash > 0) {
+        if (!dirs.insert(path.substr(0, slash)).second) break;
+        slash = path.rfind('/', slash - 1);
     }
-    
-    for (auto &f: current_files) {
-        if (tree_files.find(f) == tree_files.end()) {
-            changes.push_back({"delete", f});
+}
+
+// Applies a checkout plan in three passes: all deletes (pruning directories
+// they leave empty), then every needed directory created once in sorted
+// order so parents precede children, then blobs streamed into files by a
+// pool of `jobs` workers.
+bool apply_checkout(const vector<CheckoutChange> &changes, unsigned jobs, CheckoutResult &result) {
+    auto start = chrono::steady_clock::now();
+    result = CheckoutResult();
+
+    vector<const CheckoutChange *> restores;
+    set<string> emptied;
+    for (auto &c : changes) {
+        if (c.action == "restore") {
+            restores.push_back(&c);
+            continue;
+        }
+        if (unlink(c.path.c_str()) == 0) {
+            result.deleted++;
+            add_parent_dirs(c.path, emptied);
+        } else if (errno != ENOENT) {
+            cerr << "warning: failed to delete: " << c.path << "\n";
         }
     }
-    
-    return changes;
+    for (auto it = emptied.rbegin(); it != emptied.rend(); ++it) {
+        rmdir(it->c_str());  // fails harmlessly when the directory is not empty
+    }
+
+    set<string> dirs;
+    for (auto *c : restores) add_parent_dirs(c->path, dirs);
+    for (const string &dir : dirs) {
+        if (mkdir(dir.c_str(), 0755) != 0 && errno != EEXIST) {
+            cerr << "warning: cannot create directory " << dir << "\n";
+        }
+    }
+
+    vector<struct stat> stats(restores.size());
+    vector<char> ok(restores.size(), 0);
+    atomic<size_t> next(0);
+    auto worker = [&] {
+        for (size_t i; (i = next++) < restores.size();) {
+            const CheckoutChange &c = *restores[i];
+            if (!write_blob_to_file(c.sha, c.path)) {
+                cerr << "error: failed to read blob: " << c.sha << "\n";
+                continue;
+            }
+            trace_count(TRACE_STAT_CALLS);
+            ok[i] = lstat(c.path.c_str(), &stats[i]) == 0;
+        }
+    };
+    unsigned workers = max(1u, min<unsigned>(jobs, (unsigned)restores.size()));
+    vector<thread> pool;
+    for (unsigned t = 1; t < workers; ++t) pool.emplace_back(worker);
+    worker();
+    for (auto &t : pool) t.join();
+
+    for (size_t i = 0; i < restores.size(); ++i) {
+        if (ok[i]) {
+            result.written++;
+            result.stats[restores[i]->path] = stats[i];
+        } else {
+            result.failed++;
+        }
+    }
+    result.seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+    return result.failed == 0;
+}
+
+// When the cache tree shows the index still matches the tree being left,
+// the checkout changes are applied to it in place; otherwise the index is
+// rebuilt from the target tree. Entries whose blob did not change keep
+// their stat data, and freshly written files take the stat from `written`.
+bool update_index_for_checkout(const string &current_tree_sha, const string &target_tree_sha,
+                               const vector<CheckoutChange> &changes,
+                               const unordered_map<string, struct stat> &written, vector<IndexEntry> &index,
+                               CacheTree &cache_tree) {
+    auto root = cache_tree.find("");
+    bool in_sync = !current_tree_sha.empty() && root != cache_tree.end() &&
+                   root->second.sha == current_tree_sha && root->second.entry_count == index.size();
+
+    vector<IndexEntry> out;
+    if (in_sync) {
+        unordered_map<string, const CheckoutChange *> by_path;
+        for (auto &c : changes) {
+            by_path[c.path] = &c;
+            invalidate_cache_tree(cache_tree, c.path);
+        }
+        for (auto &e : index) {
+            if (by_path.count(e.path)) continue;
+            out.push_back(std::move(e));
+        }
+        for (auto &c : changes) {
+            if (c.action != "restore") continue;
+            IndexEntry e;
+            e.path = c.path;
+            e.mode = "100644";
+            e.sha = c.sha;
+            out.push_back(std::move(e));
+        }
+    } else {
+        unordered_map<string, IndexStat> old_stat;
+        for (auto &e : index) old_stat[e.path + '\0' + e.sha] = e.st;
+        cache_tree.clear();
+
+        unordered_map<string, string> target_files;
+        collect_tree_files(target_tree_sha, "", target_files);
+        for (auto &kv : target_files) {
+            IndexEntry e;
+            e.path = kv.first;
+            e.mode = "100644";
+            e.sha = kv.second;
+            auto it = old_stat.find(e.path + '\0' + e.sha);
+            if (it != old_stat.end()) e.st = it->second;
+            out.push_back(std::move(e));
+        }
+    }
+
+    for (auto &e : out) {
+        auto it = written.find(e.path);
+        if (it != written.end()) fill_index_stat(e.st, it->second);
+    }
+    sort(out.begin(), out.end(), [](const IndexEntry &a, const IndexEntry &b) { return a.path < b.path; });
+    cache_tree[""] = {target_tree_sha, (uint32_t)out.size()};
+    return write_index(out, &cache_tree);
 }
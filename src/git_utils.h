@@ -6,6 +6,9 @@
 #include <vector>
 #include <unordered_map>
 #include <map>
+#include <functional>
+#include <cstdint>
+#include <sys/stat.h>
 
 
 extern const std::string REPO_DIR;
@@ -13,28 +16,162 @@ extern const std::string REPO_DIR;
 using namespace std;
 
 string to_hex(const unsigned char *hash, size_t len);
+bool from_hex(const string &hex, unsigned char *out);
 string sha1_hex(const string &data);
 
+// Incremental SHA-1 for data that is produced piecewise (pack files, streams).
+class Sha1Stream {
+public:
+    Sha1Stream();
+    ~Sha1Stream();
+    Sha1Stream(const Sha1Stream &) = delete;
+    Sha1Stream &operator=(const Sha1Stream &) = delete;
+    void update(const void *data, size_t len);
+    void final_raw(unsigned char *out);  // 20 bytes
+    string final_hex();
+private:
+    void *ctx;
+};
+
 bool ensure_dir(const string &path);
 string read_file(const string &path);
+// Files are written to a temp file and renamed into place, so neither
+// readers nor a crash ever see a partial file. core.fsync chooses what is
+// flushed to disk:
+//   none    nothing; a crash may lose recent writes
+//   object  each file is fsynced before its rename (slow for many objects)
+//   batch   the default: each file's writeback is only started, and a
+//           single fsync makes all of them durable before a ref update
+//           and when the command exits
 bool write_file(const string &path, const string &data);
+// For writers that fill their own temp file: fsyncs `fd` in object mode
+// and records the write for batch mode. Call before closing the file.
+bool sync_new_file(int fd);
+// Flushes everything written since the last call (batch mode only).
+bool sync_written_files();
 
-string compress_data(const string &data);  
+// Deflates at the level core.compression and core.adaptiveCompression
+// pick for this data.
+string compress_data(const string &data);
+int compression_level_for(const void *data, size_t len);
 
 string object_path_for_sha(const string &sha);
 string build_object_buffer(const string &type, const string &data);
+// Whether the object is stored, loose or packed. Loose names are listed
+// once per fan-out directory and process; see KnownObjects.
+bool object_exists(const string &sha);
+// Drops the loose-object listing after objects were removed behind it.
+void forget_known_objects();
+bool write_loose_object(const string &sha, const string &compressed);
 string hash_object_from_data(const string &type, const string &data, bool write);
 
+// Blobs at least this large are hashed and compressed in fixed-size chunks
+// instead of being loaded into memory.
+const uint64_t STREAM_THRESHOLD = 1 << 20;
+string hash_object_from_file(const string &path, bool write);
+
+// read_object goes through a process-wide LRU cache of decoded objects,
+// bounded to OBJECT_CACHE_BYTES.
+const size_t OBJECT_CACHE_BYTES = 64 << 20;
+
+struct ObjectCacheStats {
+    uint64_t hits;
+    uint64_t misses;
+    size_t entries;
+    size_t bytes;
+};
+
 pair<string, string> read_object(const string &sha);
+pair<string, string> read_loose_object(const string &sha);
+// Inflates only as far as the "type size" header; a chunked blob reports
+// its manifest.
+bool read_loose_object_header(const string &sha, string &type, uint64_t &size);
+ObjectCacheStats object_cache_stats();
+
+// Object bodies inflated from disk (cache hits excluded) and objects
+// written by this process.
+struct ObjectIoStats {
+    uint64_t read;
+    uint64_t written;
+};
+ObjectIoStats object_io_stats();
+
+// Receives an object body in bounded chunks; returning false aborts.
+typedef function<bool(const char *data, size_t len)> ObjectSink;
+
+// Reads only the "type size" header of an object.
+bool read_object_header(const string &sha, string &type, uint64_t &size);
+// Streams an object body to `sink` without materialising it.
+bool stream_object(const string &sha, string &type, const ObjectSink &sink);
+bool write_blob_to_file(const string &sha, const string &path);
 bool repo_exists();
 
+// Stat data cached in the index so unchanged files need not be rehashed.
+// All zero means "unknown": the file is always rehashed.
+struct IndexStat {
+    uint32_t ctime_sec = 0;
+    uint32_t ctime_nsec = 0;
+    uint32_t mtime_sec = 0;
+    uint32_t mtime_nsec = 0;
+    uint32_t dev = 0;
+    uint32_t ino = 0;
+    uint32_t mode = 0;
+    uint64_t size = 0;
+};
+
+struct IndexEntry {
+    string path;
+    string mode;  // tree entry mode, e.g. "100644"
+    string sha;
+    IndexStat st;
+};
+
+// Cache tree: tree SHAs of directories whose contents have not changed
+// since their tree was last written, keyed by directory path ("" is the
+// root). Stored as an index extension; a directory is dropped from it when
+// anything beneath it changes.
+struct CachedTree {
+    string sha;
+    uint32_t entry_count;  // index entries beneath the directory
+    bool operator==(const CachedTree &o) const { return sha == o.sha && entry_count == o.entry_count; }
+    bool operator!=(const CachedTree &o) const { return !(*this == o); }
+};
+typedef map<string, CachedTree> CacheTree;
+
 string write_tree_recursive(const string &path);
-vector<tuple<string,string,string>> read_index();
-string build_tree_from_index_entries(const vector<tuple<string,string,string>> &entries);
-bool write_index(const vector<tuple<string,string,string>> &entries);
+// A missing index reads as empty. A damaged one is reported and fails the
+// read: treating it as empty would let the next write drop every entry.
+bool read_index(vector<IndexEntry> &entries, CacheTree *cache_tree = nullptr, string *fsmonitor_token = nullptr);
+string read_index_fsmonitor_token();
+string build_tree_from_index_entries(const vector<IndexEntry> &entries, CacheTree *cache_tree = nullptr);
+bool write_index(const vector<IndexEntry> &entries, const CacheTree *cache_tree = nullptr,
+                 const string *fsmonitor_token = nullptr);
+void invalidate_cache_tree(CacheTree &cache_tree, const string &path);
+void fill_index_stat(IndexStat &ist, const struct stat &st);
+bool index_stat_matches(const IndexStat &ist, const struct stat &st);
 
 string build_tree_from_index();  
-bool add_files_to_index(const vector<string> &files);
+// Stages `files`. Tracked files at or beneath a path in `prune` are looked
+// at even when `files` leaves them out (as ignored): those gone from the
+// working tree are removed from the index, the rest are staged.
+// `fsmonitor_token` is stored in the index when given (only "add ." may
+// record one, as the index then matches the working tree) and dropped
+// otherwise.
+bool add_files_to_index(const vector<string> &files, unsigned jobs, const string *fsmonitor_token = nullptr,
+                        const vector<string> *prune = nullptr);
+
+// One side of a status line: 'A'dded, 'M'odified or 'D'eleted.
+struct StatusChange {
+    string path;
+    char code;
+};
+// Staged changes: the index (sorted by path) compared with a tree.
+bool diff_index_against_tree(const vector<IndexEntry> &entries, const CacheTree &cache_tree,
+                             const string &tree_sha, vector<StatusChange> &out);
+// Unstaged changes among entries[which[...]], using `jobs` threads. Returns
+// whether any entry got fresh stat data worth writing back to the index.
+bool check_worktree(vector<IndexEntry> &entries, const vector<size_t> &which, unsigned jobs,
+                    vector<StatusChange> &out);
 
 string read_head();  
 string read_ref(const string &ref);
@@ -42,20 +179,49 @@ bool write_ref(const string &ref, const string &sha);
 string create_commit_object(const string &tree_sha, const string &message, const string &parent_sha);
 
 struct CommitInfo {
+    string tree;
     string parent;
     string author;
     string message;
+    int64_t time = 0;  // committer timestamp
 };
 
 CommitInfo parse_commit(const string &commit_data);
 
 
+string get_tree_sha_from_commit(const string &commit_sha);
 void collect_tree_files(const string &tree_sha, const string &prefix, unordered_map<string, string> &tree_files);
 
+// A file that differs between two trees; old_sha is empty for an added
+// file and new_sha is empty for a deleted one.
+struct TreeChange {
+    string path;
+    string old_sha;
+    string new_sha;
+};
+bool diff_trees(const string &old_tree, const string &new_tree, const string &prefix, vector<TreeChange> &out);
+// Looks up the entry at a slash-separated path inside a tree.
+bool tree_entry(const string &tree_sha, const string &path, string &mode, string &sha);
+
 struct CheckoutChange {
     string action;  // "restore", "delete"
     string path;
+    string sha;     // blob to restore
+};
+// Fails, with a message, when either tree cannot be read completely.
+bool plan_checkout(const string &target_tree_sha, const string &current_commit_sha, vector<CheckoutChange> &changes);
+struct CheckoutResult {
+    size_t written = 0;
+    size_t deleted = 0;
+    size_t failed = 0;
+    double seconds = 0;
+    unordered_map<string, struct stat> stats;  // of the files written
 };
-vector<CheckoutChange> plan_checkout(const string &target_tree_sha, const string &current_commit_sha);
+bool apply_checkout(const vector<CheckoutChange> &changes, unsigned jobs, CheckoutResult &result);
+// `index` and `cache_tree` are the index as read before the checkout.
+bool update_index_for_checkout(const string &current_tree_sha, const string &target_tree_sha,
+                               const vector<CheckoutChange> &changes,
+                               const unordered_map<string, struct stat> &written, vector<IndexEntry> &index,
+                               CacheTree &cache_tree);
 
 #endif // GIT_UTILS_H
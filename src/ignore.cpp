@@ -0,0 +1,217 @@
+#include "ignore.h"
+#include "git_utils.h"
+
+#include <bits/stdc++.h>
+
+using namespace std;
+
+// Glob match in the gitignore dialect. '*', '?' and classes stop at '/';
+// "**/" matches any number of leading directories and a "**" anywhere
+// else matches across them.
+static bool glob_match(const char *p, const char *pe, const char *s, const char *se) {
+    while (p < pe) {
+        char c = *p;
+        if (c == '*') {
+            if (p + 1 < pe && p[1] == '*') {
+                p += 2;
+                if (p == pe) return true;
+                if (*p == '/') {
+                    ++p;
+                    for (const char *t = s;;) {
+                        if (glob_match(p, pe, t, se)) return true;
+                        t = (const char *)memchr(t, '/', se - t);
+                        if (!t) return false;
+                        ++t;
+                    }
+                }
+                for (const char *t = s; t <= se; ++t) {
+                    if (glob_match(p, pe, t, se)) return true;
+                }
+                return false;
+            }
+            ++p;
+            for (const char *t = s;; ++t) {
+                if (glob_match(p, pe, t, se)) return true;
+                if (t == se || *t == '/') return false;
+            }
+        }
+        if (s == se) return false;
+        if (c == '?') {
+            if (*s == '/') return false;
+            ++p;
+            ++s;
+            continue;
+        }
+        if (c == '[') {
+            const char *q = p + 1;
+            bool negate = q < pe && (*q == '!' || *q == '^');
+            if (negate) ++q;
+            bool hit = false;
+            for (bool first = true; q < pe && (*q != ']' || first); ++q) {
+                first = false;
+                unsigned char lo = *q;
+                if (lo == '\\' && q + 1 < pe) lo = *++q;
+                unsigned char hi = lo;
+                if (q + 2 < pe && q[1] == '-' && q[2] != ']') {
+                    q += 2;
+                    if (*q == '\\' && q + 1 < pe) ++q;
+                    hi = *q;
+                }
+                if ((unsigned char)*s >= lo && (unsigned char)*s <= hi) hit = true;
+            }
+            if (q < pe) {
+                if (hit == negate || *s == '/') return false;
+                p = q + 1;
+                ++s;
+                continue;
+            }
+            // No closing ']': the '[' is literal.
+        }
+        if (c == '\\' && p + 1 < pe) c = *++p;
+        if (c != *s) return false;
+        ++p;
+        ++s;
+    }
+    return s == se;
+}
+
+static bool has_wildcard(const string &s, size_t from, size_t to) {
+    for (size_t i = from; i < to; ++i) {
+        if (s[i] == '*' || s[i] == '?' || s[i] == '[' || s[i] == '\\') return true;
+    }
+    return false;
+}
+
+IgnoreList::IgnoreList(const string &content) {
+    istringstream in(content);
+    string line;
+    while (getline(in, line)) {
+        if (!line.empty() && line.back() == '\r') line.pop_back();
+        while (!line.empty() && line.back() == ' ' && !(line.size() > 1 && line[line.size() - 2] == '\\')) {
+            line.pop_back();
+        }
+        if (line.empty() || line[0] == '#') continue;
+
+        IgnorePattern p = {IgnorePattern::GLOB, string(), false, false, false};
+        size_t start = 0;
+        if (line[0] == '!') {
+            p.negate = true;
+            start = 1;
+        }
+        if (line.back() == '/') {
+            p.dir_only = true;
+            line.pop_back();
+        }
+        if (start < line.size() && line[start] == '/') {
+            p.anchored = true;
+            ++start;
+        }
+        p.text = line.substr(min(start, line.size()));
+        if (p.text.empty()) continue;
+        if (p.text.find('/') != string::npos) p.anchored = true;
+
+        size_t n = p.text.size();
+        if (!has_wildcard(p.text, 0, n)) {
+            p.kind = IgnorePattern::LITERAL;
+        } else if (!p.anchored && p.text[n - 1] == '*' && !has_wildcard(p.text, 0, n - 1)) {
+            p.kind = IgnorePattern::PREFIX;
+            p.text.pop_back();
+        } else if (!p.anchored && p.text[0] == '*' && !has_wildcard(p.text, 1, n)) {
+            p.kind = IgnorePattern::SUFFIX;
+            p.text.erase(0, 1);
+        }
+
+        size_t index = patterns.size();
+        if (p.kind == IgnorePattern::LITERAL && !p.anchored) (p.dir_only ? dir_names : names)[p.text] = index;
+        else if (p.kind == IgnorePattern::PREFIX && !p.text.empty()) prefixes[p.text[0]].push_back(index);
+        else if (p.kind == IgnorePattern::SUFFIX && !p.text.empty()) suffixes[p.text.back()].push_back(index);
+        else scanned.push_back(index);
+        patterns.push_back(std::move(p));
+    }
+}
+
+static bool pattern_matches(const IgnorePattern &p, const string &rel, const string &name, bool is_dir) {
+    if (p.dir_only && !is_dir) return false;
+    const string &s = p.anchored ? rel : name;
+    switch (p.kind) {
+        case IgnorePattern::LITERAL:
+            return s == p.text;
+        case IgnorePattern::PREFIX:
+            return s.size() >= p.text.size() && s.compare(0, p.text.size(), p.text) == 0;
+        case IgnorePattern::SUFFIX:
+            return s.size() >= p.text.size() && s.compare(s.size() - p.text.size(), p.text.size(), p.text) == 0;
+        case IgnorePattern::GLOB:
+            return glob_match(p.text.data(), p.text.data() + p.text.size(), s.data(), s.data() + s.size());
+    }
+    return false;
+}
+
+// The literal lookups give the last matching literal. Each candidate list
+// is then scanned backwards, only as far as the best match so far, since
+// an earlier pattern could not override it.
+int IgnoreList::match(const string &rel, const string &name, bool is_dir) const {
+    long best = -1;
+    auto it = names.find(name);
+    if (it != names.end()) best = (long)it->second;
+    if (is_dir) {
+        it = dir_names.find(name);
+        if (it != dir_names.end()) best = max(best, (long)it->second);
+    }
+    auto scan = [&](const vector<size_t> &list) {
+        for (auto k = list.rbegin(); k != list.rend() && (long)*k > best; ++k) {
+            if (pattern_matches(patterns[*k], rel, name, is_dir)) {
+                best = (long)*k;
+                return;
+            }
+        }
+    };
+    if (!name.empty()) {
+        auto p = prefixes.find(name[0]);
+        if (p != prefixes.end()) scan(p->second);
+        auto s = suffixes.find(name.back());
+        if (s != suffixes.end()) scan(s->second);
+    }
+    scan(scanned);
+    if (best < 0) return -1;
+    return patterns[best].negate ? 0 : 1;
+}
+
+IgnoreStack push_ignore_rules(const IgnoreStack &rules, const string &dir, const string &content) {
+    IgnoreList list(content);
+    if (list.empty()) return rules;
+    return make_shared<IgnoreFrame>(IgnoreFrame{rules, dir, std::move(list)});
+}
+
+bool is_ignored(const IgnoreStack &rules, const string &path, bool is_dir) {
+    if (!rules) return false;
+    size_t slash = path.rfind('/');
+    string name = slash == string::npos ? path : path.substr(slash + 1);
+    for (const IgnoreFrame *f = rules.get(); f; f = f->parent.get()) {
+        int m = f->dir.empty() ? f->list.match(path, name, is_dir)
+                               : f->list.match(path.substr(f->dir.size() + 1), name, is_dir);
+        if (m >= 0) return m == 1;
+    }
+    return false;
+}
+
+IgnoreStack ignore_rules_for(const string &path, bool is_dir, bool &ignored) {
+    ignored = false;
+    IgnoreStack rules = push_ignore_rules(nullptr, "", read_file(IGNORE_FILE));
+    size_t pos = 0;
+    for (size_t slash; (slash = path.find('/', pos)) != string::npos; pos = slash + 1) {
+        string dir = path.substr(0, slash);
+        if (is_ignored(rules, dir, true)) {
+            ignored = true;
+            return rules;
+        }
+        rules = push_ignore_rules(rules, dir, read_file(dir + "/" + IGNORE_FILE));
+    }
+    ignored = !path.empty() && is_ignored(rules, path, is_dir);
+    return rules;
+}
+
+bool path_ignored(const string &path, bool is_dir) {
+    bool ignored;
+    ignore_rules_for(path, is_dir, ignored);
+    return ignored;
+}
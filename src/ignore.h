@@ -0,0 +1,87 @@
+#ifndef IGNORE_H
+#define IGNORE_H
+
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+using namespace std;
+
+// .mygitignore files. Any directory of the working tree may have one; its
+// patterns apply to paths beneath that directory, one per line, in the
+// gitignore syntax:
+//   blank lines and lines starting with '#' are skipped
+//   "!pattern" re-includes what an earlier pattern excluded
+//   "pattern/" only matches directories
+//   a pattern with a '/' other than a trailing one is anchored to the
+//   directory of its file; without one it matches a name at any depth
+//   '*' and '?' do not match '/', "[a-z]" is a class, "**" spans
+//   directories, and '\' escapes the next character
+// The last matching pattern wins, and the file nearest the path wins over
+// those above it. Nothing beneath an ignored directory is looked at, so a
+// file inside one cannot be re-included. Only untracked files are kept
+// out: add still checks tracked files that match against the index.
+//
+// Each file is compiled once when the walker enters its directory.
+// Patterns without wildcards become hash lookups, and "name*" and "*.ext"
+// become prefix and suffix compares, bucketed by their first and last
+// byte so a name is only compared with the ones that could match it; only
+// the rest go through the glob matcher.
+
+const char IGNORE_FILE[] = ".mygitignore";
+
+struct IgnorePattern {
+    enum Kind { LITERAL, PREFIX, SUFFIX, GLOB };
+    Kind kind;
+    string text;  // the literal, the fixed prefix or suffix, or the glob
+    bool negate;
+    bool dir_only;
+    bool anchored;  // matched against the path below the file's directory
+};
+
+// One .mygitignore file, compiled.
+class IgnoreList {
+public:
+    explicit IgnoreList(const string &content);
+
+    bool empty() const { return patterns.empty(); }
+
+    // 1 when the last matching pattern excludes `rel` (the path below this
+    // file's directory, whose last component is `name`), 0 when it
+    // re-includes it, -1 when no pattern matches.
+    int match(const string &rel, const string &name, bool is_dir) const;
+
+private:
+    vector<IgnorePattern> patterns;
+    // Last index of each unanchored literal, by name; dir-only ones apart.
+    unordered_map<string, size_t> names, dir_names;
+    // Indexes of the other patterns, in file order: prefixes by their
+    // first byte, suffixes by their last, and everything else.
+    unordered_map<unsigned char, vector<size_t>> prefixes, suffixes;
+    vector<size_t> scanned;
+};
+
+// The ignore files in effect at some directory, nearest first.
+struct IgnoreFrame {
+    shared_ptr<const IgnoreFrame> parent;
+    string dir;  // "" is the top of the working tree
+    IgnoreList list;
+};
+typedef shared_ptr<const IgnoreFrame> IgnoreStack;
+
+// `rules` plus the .mygitignore `content` of `dir`.
+IgnoreStack push_ignore_rules(const IgnoreStack &rules, const string &dir, const string &content);
+
+// Whether `path` (relative to the top of the working tree) is excluded by
+// `rules`, not counting its parent directories.
+bool is_ignored(const IgnoreStack &rules, const string &path, bool is_dir);
+
+// Reads the ignore files that apply to `path`, from the top of the working
+// tree down to its parent directory. Sets `ignored` when `path` itself or
+// one of the directories above it is excluded.
+IgnoreStack ignore_rules_for(const string &path, bool is_dir, bool &ignored);
+
+bool path_ignored(const string &path, bool is_dir);
+
+#endif // IGNORE_H
@@ -1,17 +1,11 @@
 #include "commands.h"
+#include "git_utils.h"
+#include "trace.h"
+#include "config.h"
 
 #include <bits/stdc++.h>
 
-int main(int argc, char **argv) {
-    
-    if (argc < 2) {
-        std::cerr << "usage: mygit <command> [args...]\n";
-        return 1;
-    }
-    std::string cmd = argv[1];
-    std::vector<std::string> args;
-    for (int i = 2; i < argc; ++i) args.emplace_back(argv[i]);
-
+static int run_command(const std::string &cmd, const std::vector<std::string> &args) {
     if (cmd == "init") {
         return cmd_init();
     } else if (cmd == "hash-object") {
@@ -22,6 +16,10 @@ int main(int argc, char **argv) {
         return cmd_write_tree();
     } else if (cmd == "ls-tree") {
         return cmd_ls_tree(args);
+    } else if (cmd == "status") {
+        return cmd_status(args);
+    } else if (cmd == "diff") {
+        return cmd_diff(args);
     } else if (cmd == "add") {
         return cmd_add(args);
     } else if (cmd == "commit") {
@@ -30,8 +28,44 @@ int main(int argc, char **argv) {
         return cmd_log(args);
     } else if (cmd == "checkout") {
         return cmd_checkout(args);
+    } else if (cmd == "repack") {
+        return cmd_repack();
+    } else if (cmd == "rev-list") {
+        return cmd_rev_list(args);
+    } else if (cmd == "commit-graph") {
+        return cmd_commit_graph(args);
+    } else if (cmd == "merge-base") {
+        return cmd_merge_base(args);
+    } else if (cmd == "fsmonitor") {
+        return cmd_fsmonitor(args);
     } else {
         std::cerr << "unknown command: " << cmd << "\n";
         return 1;
     }
 }
+
+// MYGIT_STATS=<file> records how many objects the command read and wrote,
+// for bench/bench.cpp.
+static void write_stats(const char *path) {
+    ObjectIoStats io = object_io_stats();
+    std::ofstream out(path, std::ios::trunc);
+    out << "{\"objects_read\": " << io.read << ", \"objects_written\": " << io.written << "}\n";
+}
+
+int main(int argc, char **argv) {
+    if (argc < 2) {
+        std::cerr << "usage: mygit <command> [args...]\n";
+        return 1;
+    }
+    std::string cmd = argv[1];
+    std::vector<std::string> args;
+    for (int i = 2; i < argc; ++i) args.emplace_back(argv[i]);
+
+    if (cmd != "init" && repo_exists() && !check_repository_format()) return 1;
+    trace_init();
+    int rc = run_command(cmd, args);
+    if (!sync_written_files() && rc == 0) rc = 1;
+    trace_finish(cmd, rc);
+    if (const char *stats = getenv("MYGIT_STATS")) write_stats(stats);
+    return rc;
+}
@@ -0,0 +1,819 @@
+#include "pack.h"
+#include "chunked.h"
+#include "trace.h"
+#include "git_utils.h"
+
+#include <bits/stdc++.h>
+#include <zlib.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <unistd.h>
+
+using namespace std;
+
+static const size_t RAW_SHA_LEN = 20;
+static const size_t DELTA_BLOCK = 16;
+static const size_t DELTA_WINDOW = 10;
+static const int MAX_DELTA_DEPTH = 50;
+
+static uint32_t get_be32(const unsigned char *p) {
+    return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | (uint32_t)p[3];
+}
+
+static uint64_t get_be64(const unsigned char *p) {
+    return ((uint64_t)get_be32(p) << 32) | get_be32(p + 4);
+}
+
+static void put_be32(string &out, uint32_t v) {
+    out.push_back((char)(v >> 24));
+    out.push_back((char)(v >> 16));
+    out.push_back((char)(v >> 8));
+    out.push_back((char)v);
+}
+
+static void put_be64(string &out, uint64_t v) {
+    put_be32(out, (uint32_t)(v >> 32));
+    put_be32(out, (uint32_t)v);
+}
+
+static void put_varint(string &out, uint64_t v) {
+    while (v >= 0x80) {
+        out.push_back((char)((v & 0x7f) | 0x80));
+        v >>= 7;
+    }
+    out.push_back((char)v);
+}
+
+static bool get_varint(const unsigned char *&p, const unsigned char *end, uint64_t &v) {
+    v = 0;
+    int shift = 0;
+    while (p < end && shift < 64) {
+        unsigned char c = *p++;
+        v |= (uint64_t)(c & 0x7f) << shift;
+        if (!(c & 0x80)) return true;
+        shift += 7;
+    }
+    return false;
+}
+
+static bool is_hex(const string &s) {
+    for (char c : s) {
+        if (!isxdigit((unsigned char)c) || isupper((unsigned char)c)) return false;
+    }
+    return true;
+}
+
+static const char *pack_type_name(int type) {
+    switch (type) {
+        case PACK_OBJ_COMMIT: return "commit";
+        case PACK_OBJ_TREE: return "tree";
+        case PACK_OBJ_BLOB: return "blob";
+        default: return nullptr;
+    }
+}
+
+static int pack_type_code(const string &type) {
+    if (type == "commit") return PACK_OBJ_COMMIT;
+    if (type == "tree") return PACK_OBJ_TREE;
+    if (type == "blob") return PACK_OBJ_BLOB;
+    return 0;
+}
+
+struct PackFile {
+    string pack_path;
+    const unsigned char *idx = nullptr;
+    size_t idx_size = 0;
+    const unsigned char *pack = nullptr;
+    size_t pack_size = 0;
+    uint32_t count = 0;
+    const unsigned char *names = nullptr;
+    const unsigned char *offsets32 = nullptr;
+    const unsigned char *offsets64 = nullptr;
+};
+
+static const unsigned char *map_file(const string &path, size_t &size) {
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0) return nullptr;
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size == 0) {
+        close(fd);
+        return nullptr;
+    }
+    void *p = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (p == MAP_FAILED) return nullptr;
+    size = st.st_size;
+    return (const unsigned char *)p;
+}
+
+class PackStore {
+public:
+    vector<PackFile> packs;
+
+    PackStore() { load(); }
+
+    void load() {
+        string dir = REPO_DIR + "/objects/pack";
+        DIR *d = opendir(dir.c_str());
+        if (!d) return;
+        vector<string> idx_names;
+        while (struct dirent *de = readdir(d)) {
+            string name = de->d_name;
+            if (name.size() > 4 && name.compare(name.size() - 4, 4, ".idx") == 0) {
+                idx_names.push_back(name);
+            }
+        }
+        closedir(d);
+        sort(idx_names.begin(), idx_names.end());
+
+        for (const string &name : idx_names) {
+            PackFile pf;
+            string idx_path = dir + "/" + name;
+            pf.pack_path = dir + "/" + name.substr(0, name.size() - 4) + ".pack";
+            pf.idx = map_file(idx_path, pf.idx_size);
+            if (!pf.idx) continue;
+            pf.pack = map_file(pf.pack_path, pf.pack_size);
+            if (!pf.pack || !open_pack(pf)) {
+                cerr << "warning: ignoring corrupt pack " << idx_path << "\n";
+                unmap(pf);
+                continue;
+            }
+            packs.push_back(pf);
+        }
+    }
+
+    void unload() {
+        for (auto &pf : packs) unmap(pf);
+        packs.clear();
+    }
+
+private:
+    static bool open_pack(PackFile &pf) {
+        static const unsigned char idx_magic[4] = {0xff, 't', 'O', 'c'};
+        if (pf.idx_size < 8 + 256 * 4 + 2 * RAW_SHA_LEN) return false;
+        if (memcmp(pf.idx, idx_magic, 4) != 0 || get_be32(pf.idx + 4) != 2) return false;
+        if (pf.pack_size < 12 + RAW_SHA_LEN || memcmp(pf.pack, "PACK", 4) != 0) return false;
+
+        pf.count = get_be32(pf.idx + 8 + 255 * 4);
+        size_t min_size = 8 + 256 * 4 + (size_t)pf.count * (RAW_SHA_LEN + 4 + 4) + 2 * RAW_SHA_LEN;
+        if (pf.idx_size < min_size || get_be32(pf.pack + 8) != pf.count) return false;
+
+        pf.names = pf.idx + 8 + 256 * 4;
+        pf.offsets32 = pf.names + (size_t)pf.count * (RAW_SHA_LEN + 4);
+        pf.offsets64 = pf.offsets32 + (size_t)pf.count * 4;
+        return true;
+    }
+
+    static void unmap(PackFile &pf) {
+        if (pf.idx) munmap((void *)pf.idx, pf.idx_size);
+        if (pf.pack) munmap((void *)pf.pack, pf.pack_size);
+        pf.idx = pf.pack = nullptr;
+    }
+};
+
+static PackStore &pack_store() {
+    static PackStore store;
+    return store;
+}
+
+void reload_packs() {
+    PackStore &store = pack_store();
+    store.unload();
+    store.load();
+}
+
+static bool find_offset(const PackFile &pf, const unsigned char *raw, uint64_t &offset) {
+    const unsigned char *fanout = pf.idx + 8;
+    uint32_t lo = raw[0] ? get_be32(fanout + 4 * (raw[0] - 1)) : 0;
+    uint32_t hi = get_be32(fanout + 4 * raw[0]);
+    while (lo < hi) {
+        uint32_t mid = lo + (hi - lo) / 2;
+        int cmp = memcmp(pf.names + (size_t)mid * RAW_SHA_LEN, raw, RAW_SHA_LEN);
+        if (cmp == 0) {
+            uint32_t off32 = get_be32(pf.offsets32 + (size_t)mid * 4);
+            if (off32 & 0x80000000u) {
+                offset = get_be64(pf.offsets64 + (size_t)(off32 & 0x7fffffffu) * 8);
+            } else {
+                offset = off32;
+            }
+            return offset + 1 < pf.pack_size - RAW_SHA_LEN;
+        }
+        if (cmp < 0) lo = mid + 1;
+        else hi = mid;
+    }
+    return false;
+}
+
+static bool inflate_exact(const unsigned char *src, size_t avail, size_t out_size, string &out) {
+    TraceTimer t(TRACE_DECOMPRESS);
+    trace_count(TRACE_BYTES_INFLATED, out_size);
+    out.resize(out_size);
+    z_stream zs;
+    memset(&zs, 0, sizeof(zs));
+    if (inflateInit(&zs) != Z_OK) return false;
+    zs.next_in = (Bytef *)src;
+    zs.avail_in = (uInt)min<size_t>(avail, UINT_MAX);
+    zs.next_out = (Bytef *)&out[0];
+    zs.avail_out = (uInt)out_size;
+    int ret = inflate(&zs, Z_FINISH);
+    bool ok = ret == Z_STREAM_END && zs.total_out == out_size;
+    inflateEnd(&zs);
+    return ok;
+}
+
+struct PackEntry {
+    int code;
+    uint64_t size;                // inflated size of the object or delta
+    const unsigned char *base;    // REF_DELTA base name, else null
+    const unsigned char *data;    // start of the zlib stream
+    const unsigned char *end;     // end of the pack data
+};
+
+static bool parse_entry(const PackFile &pf, uint64_t offset, PackEntry &e) {
+    trace_count(TRACE_OBJECTS_OPENED);
+    const unsigned char *p = pf.pack + offset;
+    e.end = pf.pack + pf.pack_size - RAW_SHA_LEN;
+
+    unsigned char c = *p++;
+    e.code = (c >> 4) & 7;
+    e.size = c & 15;
+    int shift = 4;
+    while (c & 0x80) {
+        if (p >= e.end || shift > 57) return false;
+        c = *p++;
+        e.size |= (uint64_t)(c & 0x7f) << shift;
+        shift += 7;
+    }
+    e.base = nullptr;
+    if (e.code == PACK_OBJ_REF_DELTA) {
+        if ((size_t)(e.end - p) < RAW_SHA_LEN) return false;
+        e.base = p;
+        p += RAW_SHA_LEN;
+    } else if (!pack_type_name(e.code)) {
+        return false;
+    }
+    e.data = p;
+    return true;
+}
+
+static bool locate_raw(const unsigned char *raw, const PackFile *&pack, uint64_t &offset) {
+    for (const PackFile &pf : pack_store().packs) {
+        if (find_offset(pf, raw, offset)) {
+            pack = &pf;
+            return true;
+        }
+    }
+    return false;
+}
+
+// A REF_DELTA base is looked for in its own pack first and then in the
+// others, and read with the same depth budget wherever it is, so deltas
+// that point at each other across packs fail instead of recursing without
+// end. Only a base that no pack holds goes through the loose objects.
+static bool find_base(const PackFile &pf, const unsigned char *raw, const PackFile *&base_pf,
+                      uint64_t &base_offset) {
+    base_pf = &pf;
+    return find_offset(pf, raw, base_offset) || locate_raw(raw, base_pf, base_offset);
+}
+
+static bool read_entry(const PackFile &pf, uint64_t offset, string &type, string &data, int depth) {
+    if (depth > 10000) return false;
+    PackEntry e;
+    if (!parse_entry(pf, offset, e)) return false;
+
+    if (e.base) {
+        string delta;
+        if (!inflate_exact(e.data, e.end - e.data, e.size, delta)) return false;
+
+        string base;
+        const PackFile *base_pf;
+        uint64_t base_offset;
+        if (find_base(pf, e.base, base_pf, base_offset)) {
+            if (!read_entry(*base_pf, base_offset, type, base, depth + 1)) return false;
+        } else {
+            auto obj = read_object(to_hex(e.base, RAW_SHA_LEN));
+            if (obj.first.empty()) return false;
+            type = obj.first;
+            base = std::move(obj.second);
+        }
+        return apply_delta(base, delta, data);
+    }
+
+    type = pack_type_name(e.code);
+    return inflate_exact(e.data, e.end - e.data, e.size, data);
+}
+
+static bool locate(const string &sha, const PackFile *&pack, uint64_t &offset) {
+    if (sha.size() != 2 * RAW_SHA_LEN) return false;
+    unsigned char raw[RAW_SHA_LEN];
+    if (!from_hex(sha, raw)) return false;
+    return locate_raw(raw, pack, offset);
+}
+
+bool read_packed_object(const string &sha, string &type, string &data) {
+    const PackFile *pf;
+    uint64_t offset;
+    if (!locate(sha, pf, offset)) return false;
+    return read_entry(*pf, offset, type, data, 0);
+}
+
+static bool read_entry_header(const PackFile &pf, uint64_t offset, string &type, uint64_t &size, int depth) {
+    if (depth > 10000) return false;
+    PackEntry e;
+    if (!parse_entry(pf, offset, e)) return false;
+    if (!e.base) {
+        type = pack_type_name(e.code);
+        size = e.size;
+        return true;
+    }
+
+    // The result size is the second varint at the start of the delta; only
+    // that prefix is inflated. The type comes from the end of the chain.
+    unsigned char prefix[20];
+    z_stream zs;
+    memset(&zs, 0, sizeof(zs));
+    if (inflateInit(&zs) != Z_OK) return false;
+    zs.next_in = (Bytef *)e.data;
+    zs.avail_in = (uInt)min<size_t>(e.end - e.data, UINT_MAX);
+    zs.next_out = prefix;
+    zs.avail_out = (uInt)min<uint64_t>(sizeof(prefix), e.size);
+    int ret;
+    {
+        TraceTimer t(TRACE_DECOMPRESS);
+        ret = inflate(&zs, Z_SYNC_FLUSH);
+    }
+    trace_count(TRACE_BYTES_INFLATED, zs.total_out);
+    size_t got = zs.total_out;
+    inflateEnd(&zs);
+    if (ret != Z_OK && ret != Z_STREAM_END && ret != Z_BUF_ERROR) return false;
+
+    const unsigned char *p = prefix, *end = prefix + got;
+    uint64_t base_size;
+    if (!get_varint(p, end, base_size) || !get_varint(p, end, size)) return false;
+
+    const PackFile *base_pf;
+    uint64_t base_offset, ignored;
+    if (find_base(pf, e.base, base_pf, base_offset)) {
+        return read_entry_header(*base_pf, base_offset, type, ignored, depth + 1);
+    }
+    return read_object_header(to_hex(e.base, RAW_SHA_LEN), type, ignored);
+}
+
+bool read_packed_object_header(const string &sha, string &type, uint64_t &size) {
+    const PackFile *pf;
+    uint64_t offset;
+    if (!locate(sha, pf, offset)) return false;
+    return read_entry_header(*pf, offset, type, size, 0);
+}
+
+// Whole objects are inflated from the mmapped pack in bounded chunks.
+// Deltified objects have to be rebuilt in memory before they can be
+// streamed.
+bool stream_packed_object(const string &sha, string &type, const ObjectSink &sink) {
+    static const size_t CHUNK = 64 * 1024;
+    const PackFile *pf;
+    uint64_t offset;
+    if (!locate(sha, pf, offset)) return false;
+    PackEntry e;
+    if (!parse_entry(*pf, offset, e)) return false;
+
+    if (e.base) {
+        string data;
+        if (!read_entry(*pf, offset, type, data, 0)) return false;
+        for (size_t pos = 0; pos < data.size(); pos += CHUNK) {
+            if (!sink(data.data() + pos, min(CHUNK, data.size() - pos))) return false;
+        }
+        return true;
+    }
+
+    type = pack_type_name(e.code);
+    z_stream zs;
+    memset(&zs, 0, sizeof(zs));
+    if (inflateInit(&zs) != Z_OK) return false;
+    zs.next_in = (Bytef *)e.data;
+    zs.avail_in = (uInt)min<size_t>(e.end - e.data, UINT_MAX);
+    vector<unsigned char> out(CHUNK);
+    bool ok = true;
+    int ret = Z_OK;
+    while (ok && ret != Z_STREAM_END) {
+        zs.next_out = out.data();
+        zs.avail_out = (uInt)out.size();
+        {
+            TraceTimer t(TRACE_DECOMPRESS);
+            ret = inflate(&zs, Z_NO_FLUSH);
+        }
+        if (ret != Z_OK && ret != Z_STREAM_END) ok = false;
+        size_t have = out.size() - zs.avail_out;
+        trace_count(TRACE_BYTES_INFLATED, have);
+        if (ok && have && !sink((const char *)out.data(), have)) ok = false;
+        if (ok && ret == Z_OK && have == 0 && zs.avail_in == 0) ok = false;
+    }
+    ok = ok && zs.total_out == e.size;
+    inflateEnd(&zs);
+    return ok;
+}
+
+bool has_packed_object(const string &sha) {
+    const PackFile *pf;
+    uint64_t offset;
+    return locate(sha, pf, offset);
+}
+
+// ---- delta encoding ----
+
+static uint32_t block_hash(const unsigned char *p) {
+    uint32_t h = 2166136261u;
+    for (size_t i = 0; i < DELTA_BLOCK; ++i) {
+        h ^= p[i];
+        h *= 16777619u;
+    }
+    return h;
+}
+
+static void flush_insert(string &out, string &pending) {
+    size_t pos = 0;
+    while (pos < pending.size()) {
+        size_t n = min<size_t>(127, pending.size() - pos);
+        out.push_back((char)n);
+        out.append(pending, pos, n);
+        pos += n;
+    }
+    pending.clear();
+}
+
+static void emit_copy(string &out, uint64_t offset, uint64_t len) {
+    while (len > 0) {
+        uint64_t n = min<uint64_t>(len, 0x10000);
+        unsigned char cmd = 0x80;
+        string args;
+        for (int i = 0; i < 4; ++i) {
+            unsigned char b = (offset >> (8 * i)) & 0xff;
+            if (b) { cmd |= 1 << i; args.push_back((char)b); }
+        }
+        if (n != 0x10000) {
+            for (int i = 0; i < 3; ++i) {
+                unsigned char b = (n >> (8 * i)) & 0xff;
+                if (b) { cmd |= 0x10 << i; args.push_back((char)b); }
+            }
+        }
+        out.push_back((char)cmd);
+        out += args;
+        offset += n;
+        len -= n;
+    }
+}
+
+// The base is indexed in fixed 16-byte blocks; the target is scanned byte by
+// byte, and any block hit is extended forwards (and backwards into pending
+// literal bytes) to the longest match before emitting a copy.
+string create_delta(const string &base, const string &target) {
+    string out;
+    put_varint(out, base.size());
+    put_varint(out, target.size());
+
+    const unsigned char *b = (const unsigned char *)base.data();
+    const unsigned char *t = (const unsigned char *)target.data();
+    size_t nb = base.size(), nt = target.size();
+    string pending;
+
+    if (nb < DELTA_BLOCK || nb > 0xffffffffu) {
+        pending = target;
+        flush_insert(out, pending);
+        return out;
+    }
+
+    size_t nblocks = nb / DELTA_BLOCK;
+    size_t buckets = 1;
+    while (buckets < nblocks * 2) buckets <<= 1;
+    vector<int64_t> head(buckets, -1), next(nblocks, -1);
+    for (size_t i = nblocks; i-- > 0;) {
+        uint32_t h = block_hash(b + i * DELTA_BLOCK) & (buckets - 1);
+        next[i] = head[h];
+        head[h] = (int64_t)i;
+    }
+
+    size_t i = 0;
+    while (i < nt) {
+        size_t best_len = 0, best_off = 0;
+        if (i + DELTA_BLOCK <= nt) {
+            uint32_t h = block_hash(t + i) & (buckets - 1);
+            int steps = 0;
+            for (int64_t blk = head[h]; blk >= 0 && steps < 64; blk = next[blk], ++steps) {
+                size_t off = (size_t)blk * DELTA_BLOCK;
+                size_t len = 0;
+                while (off + len < nb && i + len < nt && b[off + len] == t[i + len]) ++len;
+                if (len > best_len) {
+                    best_len = len;
+                    best_off = off;
+                }
+            }
+        }
+        if (best_len < DELTA_BLOCK) {
+            pending.push_back((char)t[i]);
+            ++i;
+            continue;
+        }
+
+        size_t forward = best_len;
+        while (!pending.empty() && best_off > 0 && b[best_off - 1] == (unsigned char)pending.back()) {
+            pending.pop_back();
+            --best_off;
+            ++best_len;
+        }
+        flush_insert(out, pending);
+        emit_copy(out, best_off, best_len);
+        i += forward;
+    }
+    flush_insert(out, pending);
+    return out;
+}
+
+bool apply_delta(const string &base, const string &delta, string &out) {
+    const unsigned char *p = (const unsigned char *)delta.data();
+    const unsigned char *end = p + delta.size();
+    uint64_t base_size, result_size;
+    if (!get_varint(p, end, base_size) || !get_varint(p, end, result_size)) return false;
+    if (base_size != base.size()) return false;
+
+    out.clear();
+    out.reserve(result_size);
+    while (p < end) {
+        unsigned char cmd = *p++;
+        if (cmd & 0x80) {
+            uint64_t offset = 0, len = 0;
+            for (int i = 0; i < 4; ++i) {
+                if (!(cmd & (1 << i))) continue;
+                if (p >= end) return false;
+                offset |= (uint64_t)*p++ << (8 * i);
+            }
+            for (int i = 0; i < 3; ++i) {
+                if (!(cmd & (0x10 << i))) continue;
+                if (p >= end) return false;
+                len |= (uint64_t)*p++ << (8 * i);
+            }
+            if (len == 0) len = 0x10000;
+            if (offset + len > base.size() || out.size() + len > result_size) return false;
+            out.append(base, offset, len);
+        } else if (cmd) {
+            if ((size_t)(end - p) < cmd || out.size() + cmd > result_size) return false;
+            out.append((const char *)p, cmd);
+            p += cmd;
+        } else {
+            return false;
+        }
+    }
+    return out.size() == result_size;
+}
+
+// ---- repack ----
+
+static vector<string> list_loose_objects() {
+    vector<string> shas;
+    string objdir = REPO_DIR + "/objects";
+    DIR *d = opendir(objdir.c_str());
+    if (!d) return shas;
+    vector<string> fanout;
+    while (struct dirent *de = readdir(d)) {
+        string name = de->d_name;
+        if (name.size() == 2 && is_hex(name)) fanout.push_back(name);
+    }
+    closedir(d);
+
+    for (const string &sub : fanout) {
+        DIR *sd = opendir((objdir + "/" + sub).c_str());
+        if (!sd) continue;
+        while (struct dirent *de = readdir(sd)) {
+            string name = de->d_name;
+            if (name.size() == 2 * RAW_SHA_LEN - 2 && is_hex(name)) shas.push_back(sub + name);
+        }
+        closedir(sd);
+    }
+    sort(shas.begin(), shas.end());
+    return shas;
+}
+
+struct PackIdxEntry {
+    unsigned char raw[RAW_SHA_LEN];
+    uint64_t offset;
+    uint32_t crc;
+};
+
+struct DeltaCandidate {
+    string sha;
+    string data;
+    int depth;
+};
+
+static string entry_header(int code, uint64_t size) {
+    string hdr;
+    unsigned char c = (unsigned char)((code << 4) | (size & 15));
+    size >>= 4;
+    while (size) {
+        hdr.push_back((char)(c | 0x80));
+        c = size & 0x7f;
+        size >>= 7;
+    }
+    hdr.push_back((char)c);
+    return hdr;
+}
+
+static string build_idx(vector<PackIdxEntry> &entries, const unsigned char *pack_sha) {
+    sort(entries.begin(), entries.end(), [](const PackIdxEntry &a, const PackIdxEntry &b) {
+        return memcmp(a.raw, b.raw, RAW_SHA_LEN) < 0;
+    });
+
+    string idx;
+    idx += "\xfftOc";
+    put_be32(idx, 2);
+    uint32_t counts[256] = {0};
+    for (auto &e : entries) counts[e.raw[0]]++;
+    uint32_t running = 0;
+    for (int i = 0; i < 256; ++i) {
+        running += counts[i];
+        put_be32(idx, running);
+    }
+    for (auto &e : entries) idx.append((const char *)e.raw, RAW_SHA_LEN);
+    for (auto &e : entries) put_be32(idx, e.crc);
+    vector<uint64_t> large;
+    for (auto &e : entries) {
+        if (e.offset >= 0x80000000u) {
+            put_be32(idx, 0x80000000u | (uint32_t)large.size());
+            large.push_back(e.offset);
+        } else {
+            put_be32(idx, (uint32_t)e.offset);
+        }
+    }
+    for (uint64_t off : large) put_be64(idx, off);
+    idx.append((const char *)pack_sha, RAW_SHA_LEN);
+
+    unsigned char idx_sha[RAW_SHA_LEN];
+    Sha1Stream s;
+    s.update(idx.data(), idx.size());
+    s.final_raw(idx_sha);
+    idx.append((const char *)idx_sha, RAW_SHA_LEN);
+    return idx;
+}
+
+long repack_loose_objects(size_t &deltas, size_t &pruned) {
+    deltas = 0;
+    pruned = 0;
+    vector<string> loose = list_loose_objects();
+    if (loose.empty()) return 0;
+
+    struct Candidate {
+        string sha;
+        string type;
+        size_t size;
+    };
+    // Only the headers are read here; each body is inflated once, when it
+    // is written to the pack.
+    vector<Candidate> objs;
+    for (const string &sha : loose) {
+        if (has_packed_object(sha)) continue;
+        string type;
+        uint64_t size;
+        if (!read_loose_object_header(sha, type, size)) type.clear();
+        if (type == CHUNKED_TYPE) continue;  // manifests stay loose; their chunks are packed
+        if (type.empty() || !pack_type_code(type)) {
+            cerr << "warning: skipping unreadable object " << sha << "\n";
+            continue;
+        }
+        objs.push_back({sha, type, (size_t)size});
+    }
+
+    // Group by type and walk from largest to smallest, so deltas mostly
+    // remove data from a bigger base rather than add it.
+    sort(objs.begin(), objs.end(), [](const Candidate &a, const Candidate &b) {
+        if (a.type != b.type) return pack_type_code(a.type) < pack_type_code(b.type);
+        if (a.size != b.size) return a.size > b.size;
+        return a.sha < b.sha;
+    });
+
+    string pack_dir = REPO_DIR + "/objects/pack";
+    if (!objs.empty()) {
+        if (!ensure_dir(pack_dir)) {
+            cerr << "error: cannot create " << pack_dir << "\n";
+            return -1;
+        }
+        string tmp_pack = pack_dir + "/tmp_pack_" + to_string(getpid());
+        FILE *fp = fopen(tmp_pack.c_str(), "wb");
+        if (!fp) {
+            cerr << "error: cannot write " << tmp_pack << "\n";
+            return -1;
+        }
+
+        Sha1Stream pack_hash;
+        bool ok = true;
+        auto emit = [&](const string &bytes) {
+            pack_hash.update(bytes.data(), bytes.size());
+            if (fwrite(bytes.data(), 1, bytes.size(), fp) != bytes.size()) ok = false;
+        };
+
+        string hdr = "PACK";
+        put_be32(hdr, 2);
+        put_be32(hdr, (uint32_t)objs.size());
+        emit(hdr);
+
+        vector<PackIdxEntry> idx_entries;
+        idx_entries.reserve(objs.size());
+        deque<DeltaCandidate> window;
+        string window_type;
+        uint64_t offset = hdr.size();
+
+        for (const Candidate &obj : objs) {
+            auto p = read_loose_object(obj.sha);
+            string &data = p.second;
+            if (p.first != obj.type || data.size() != obj.size) {
+                cerr << "error: cannot read object " << obj.sha << "\n";
+                ok = false;
+                break;
+            }
+            if (obj.type != window_type) {
+                window.clear();
+                window_type = obj.type;
+            }
+
+            string best_delta;
+            const DeltaCandidate *best_base = nullptr;
+            if (data.size() >= 2 * DELTA_BLOCK) {
+                for (const DeltaCandidate &cand : window) {
+                    if (cand.depth >= MAX_DELTA_DEPTH) continue;
+                    if (cand.data.size() / 32 > data.size()) continue;
+                    string d = create_delta(cand.data, data);
+                    if (d.size() + RAW_SHA_LEN >= data.size() / 2) continue;
+                    if (!best_base || d.size() < best_delta.size()) {
+                        best_delta = std::move(d);
+                        best_base = &cand;
+                    }
+                }
+            }
+
+            string entry;
+            if (best_base) {
+                entry = entry_header(PACK_OBJ_REF_DELTA, best_delta.size());
+                unsigned char base_raw[RAW_SHA_LEN];
+                from_hex(best_base->sha, base_raw);
+                entry.append((const char *)base_raw, RAW_SHA_LEN);
+                entry += compress_data(best_delta);
+                deltas++;
+            } else {
+                entry = entry_header(pack_type_code(obj.type), data.size());
+                entry += compress_data(data);
+            }
+
+            PackIdxEntry ie;
+            from_hex(obj.sha, ie.raw);
+            ie.offset = offset;
+            ie.crc = (uint32_t)crc32(0, (const Bytef *)entry.data(), (uInt)entry.size());
+            idx_entries.push_back(ie);
+            emit(entry);
+            offset += entry.size();
+
+            int depth = best_base ? best_base->depth + 1 : 0;
+            window.push_back({obj.sha, std::move(data), depth});
+            if (window.size() > DELTA_WINDOW) window.pop_front();
+        }
+
+        unsigned char pack_sha[RAW_SHA_LEN];
+        pack_hash.final_raw(pack_sha);
+        if (fwrite(pack_sha, 1, RAW_SHA_LEN, fp) != RAW_SHA_LEN) ok = false;
+        if (fflush(fp) != 0 || !sync_new_file(fileno(fp))) ok = false;
+        if (fclose(fp) != 0) ok = false;
+        if (!ok) {
+            cerr << "error: failed to write pack\n";
+            unlink(tmp_pack.c_str());
+            return -1;
+        }
+
+        string base_name = pack_dir + "/pack-" + to_hex(pack_sha, RAW_SHA_LEN);
+        string tmp_idx = pack_dir + "/tmp_idx_" + to_string(getpid());
+        // The pack must be in place before its idx: readers discover packs
+        // through the idx files.
+        if (rename(tmp_pack.c_str(), (base_name + ".pack").c_str()) != 0 ||
+            !write_file(tmp_idx, build_idx(idx_entries, pack_sha)) ||
+            rename(tmp_idx.c_str(), (base_name + ".idx").c_str()) != 0) {
+            cerr << "error: failed to install pack " << base_name << "\n";
+            unlink(tmp_pack.c_str());
+            unlink(tmp_idx.c_str());
+            return -1;
+        }
+        reload_packs();
+    }
+
+    // Only drop loose copies the packs can now serve, and only once the
+    // pack is on disk.
+    if (!sync_written_files()) return -1;
+    set<string> fanout_dirs;
+    for (const string &sha : loose) {
+        if (!has_packed_object(sha)) continue;
+        if (unlink(object_path_for_sha(sha).c_str()) == 0) pruned++;
+        fanout_dirs.insert(REPO_DIR + "/objects/" + sha.substr(0, 2));
+    }
+    for (const string &dir : fanout_dirs) rmdir(dir.c_str());
+    forget_known_objects();
+
+    return (long)objs.size();
+}
@@ -0,0 +1,41 @@
+#ifndef PACK_H
+#define PACK_H
+
+#include "git_utils.h"
+
+#include <string>
+#include <vector>
+
+using namespace std;
+
+// Pack files live in .mygit/objects/pack as pack-<sha>.pack with a matching
+// pack-<sha>.idx. The layout follows git's v2 format: the pack is a "PACK"
+// header, a sequence of zlib-deflated entries (whole objects or REF_DELTAs
+// against another object in the same pack) and a SHA-1 trailer; the idx is
+// a 256-entry fan-out table over the sorted object names, followed by CRC32s
+// and pack offsets. Both files are mmapped on first use.
+
+// Object type codes used in pack entry headers.
+enum PackObjectType {
+    PACK_OBJ_COMMIT = 1,
+    PACK_OBJ_TREE = 2,
+    PACK_OBJ_BLOB = 3,
+    PACK_OBJ_REF_DELTA = 7,
+};
+
+bool read_packed_object(const string &sha, string &type, string &data);
+bool read_packed_object_header(const string &sha, string &type, uint64_t &size);
+bool stream_packed_object(const string &sha, string &type, const ObjectSink &sink);
+bool has_packed_object(const string &sha);
+void reload_packs();
+
+// Delta encoding: copy/insert instructions that rebuild `target` from `base`.
+string create_delta(const string &base, const string &target);
+bool apply_delta(const string &base, const string &delta, string &out);
+
+// Moves every loose object into a single new pack. Returns the number of
+// objects packed, or -1 on error. `pruned` counts the loose copies removed,
+// including those of objects some pack already held.
+long repack_loose_objects(size_t &deltas, size_t &pruned);
+
+#endif // PACK_H
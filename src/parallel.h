@@ -0,0 +1,88 @@
+#ifndef PARALLEL_H
+#define PARALLEL_H
+
+#include <algorithm>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+// Default worker count for commands that take -j.
+inline unsigned default_jobs() {
+    unsigned n = std::thread::hardware_concurrency();
+    return n ? n : 1;
+}
+
+// Parses the value of a -j option ("-j8" or "-j 8"). Returns 0 when the
+// value is not a positive number.
+inline unsigned parse_jobs(const std::string &value) {
+    try {
+        size_t used = 0;
+        long n = std::stol(value, &used);
+        if (used != value.size() || n <= 0) return 0;
+        return (unsigned)std::min<long>(n, 1024);
+    } catch (...) {
+        return 0;
+    }
+}
+
+// Blocking FIFO with a fixed capacity. Producers wait while it is full, so
+// a fast pipeline stage cannot run arbitrarily far ahead of a slow one.
+// After close(), push() fails and pop() drains what is left, then fails.
+template <typename T>
+class BoundedQueue {
+public:
+    explicit BoundedQueue(size_t capacity) : capacity(capacity ? capacity : 1) {}
+
+    bool push(T item) {
+        std::unique_lock<std::mutex> lk(m);
+        not_full.wait(lk, [&] { return q.size() < capacity || closed; });
+        if (closed) return false;
+        q.push_back(std::move(item));
+        not_empty.notify_one();
+        return true;
+    }
+
+    bool pop(T &item) {
+        std::unique_lock<std::mutex> lk(m);
+        not_empty.wait(lk, [&] { return !q.empty() || closed; });
+        if (q.empty()) return false;
+        item = std::move(q.front());
+        q.pop_front();
+        not_full.notify_one();
+        return true;
+    }
+
+    // Waits like pop(), then takes up to `max` items at once, for consumers
+    // that work on batches. `items` is replaced, not appended to.
+    bool pop_some(std::vector<T> &items, size_t max) {
+        std::unique_lock<std::mutex> lk(m);
+        not_empty.wait(lk, [&] { return !q.empty() || closed; });
+        items.clear();
+        while (!q.empty() && items.size() < max) {
+            items.push_back(std::move(q.front()));
+            q.pop_front();
+        }
+        not_full.notify_all();
+        return !items.empty();
+    }
+
+    void close() {
+        std::lock_guard<std::mutex> lk(m);
+        closed = true;
+        not_empty.notify_all();
+        not_full.notify_all();
+    }
+
+private:
+    size_t capacity;
+    bool closed = false;
+    std::deque<T> q;
+    std::mutex m;
+    std::condition_variable not_empty, not_full;
+};
+
+#endif // PARALLEL_H
@@ -0,0 +1,325 @@
+#include "sha1_batch.h"
+#include "git_utils.h"
+#include "trace.h"
+
+#include <bits/stdc++.h>
+#include <cpuid.h>
+#include <immintrin.h>
+#include <openssl/sha.h>
+
+using namespace std;
+
+static const uint32_t SHA1_INIT[5] = {0x67452301, 0xefcdab89, 0x98badcfe, 0x10325476, 0xc3d2e1f0};
+static const uint32_t SHA1_K[4] = {0x5a827999, 0x6ed9eba1, 0x8f1bbcdc, 0xca62c1d6};
+
+// A message as its whole 64-byte blocks, read in place, followed by one or
+// two padded tail blocks.
+struct Sha1Message {
+    const unsigned char *data;
+    size_t full;
+    size_t blocks;
+    unsigned char tail[128];
+
+    const unsigned char *block(size_t b) const { return b < full ? data + 64 * b : tail + 64 * (b - full); }
+};
+
+static void prepare(Sha1Message &m, const void *data, size_t len) {
+    m.data = (const unsigned char *)data;
+    m.full = len / 64;
+    size_t rest = len - m.full * 64;
+    memset(m.tail, 0, sizeof(m.tail));
+    if (rest) memcpy(m.tail, m.data + m.full * 64, rest);
+    m.tail[rest] = 0x80;
+    size_t tail_blocks = rest + 9 <= 64 ? 1 : 2;
+    uint64_t bits = (uint64_t)len * 8;
+    for (int i = 0; i < 8; ++i) m.tail[tail_blocks * 64 - 1 - i] = (unsigned char)(bits >> (8 * i));
+    m.blocks = m.full + tail_blocks;
+}
+
+static void store_digest(const uint32_t h[5], unsigned char *out) {
+    for (int i = 0; i < 5; ++i) {
+        out[4 * i] = (unsigned char)(h[i] >> 24);
+        out[4 * i + 1] = (unsigned char)(h[i] >> 16);
+        out[4 * i + 2] = (unsigned char)(h[i] >> 8);
+        out[4 * i + 3] = (unsigned char)h[i];
+    }
+}
+
+// ---- single buffer: SHA-NI ----
+
+// Four rounds per sha1rnds4. The message schedule for later rounds is
+// computed in the shadow of the current ones, rotating through M[0..3];
+// the conditions trim it at the start (words not loaded yet) and the end
+// (words never used).
+#define SHANI_ROUNDS(g, f)                                                                          \
+    {                                                                                               \
+        __m128i &cur = (g) % 2 ? E1 : E0;                                                           \
+        __m128i &next = (g) % 2 ? E0 : E1;                                                          \
+        __m128i &w = M[(g) % 4];                                                                    \
+        if ((g) < 4) w = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(p + 16 * (g))), BSWAP); \
+        cur = (g) == 0 ? _mm_add_epi32(cur, w) : _mm_sha1nexte_epu32(cur, w);                       \
+        next = ABCD;                                                                                \
+        if ((g) >= 3 && (g) <= 18) M[((g) + 1) % 4] = _mm_sha1msg2_epu32(M[((g) + 1) % 4], w);      \
+        ABCD = _mm_sha1rnds4_epu32(ABCD, cur, f);                                                   \
+        if ((g) >= 1 && (g) <= 16) M[((g) + 3) % 4] = _mm_sha1msg1_epu32(M[((g) + 3) % 4], w);      \
+        if ((g) >= 2 && (g) <= 17) M[((g) + 2) % 4] = _mm_xor_si128(M[((g) + 2) % 4], w);           \
+    }
+
+__attribute__((target("sha,sse4.1")))
+static void sha1_shani(const Sha1Message &m, unsigned char *out) {
+    const __m128i BSWAP = _mm_set_epi64x(0x0001020304050607ULL, 0x08090a0b0c0d0e0fULL);
+    __m128i ABCD = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i *)SHA1_INIT), 0x1b);
+    __m128i E0 = _mm_set_epi32((int)SHA1_INIT[4], 0, 0, 0);
+    __m128i E1 = _mm_setzero_si128();
+    for (size_t b = 0; b < m.blocks; ++b) {
+        const unsigned char *p = m.block(b);
+        __m128i ABCD_SAVE = ABCD, E0_SAVE = E0;
+        __m128i M[4];
+        SHANI_ROUNDS(0, 0) SHANI_ROUNDS(1, 0) SHANI_ROUNDS(2, 0) SHANI_ROUNDS(3, 0) SHANI_ROUNDS(4, 0)
+        SHANI_ROUNDS(5, 1) SHANI_ROUNDS(6, 1) SHANI_ROUNDS(7, 1) SHANI_ROUNDS(8, 1) SHANI_ROUNDS(9, 1)
+        SHANI_ROUNDS(10, 2) SHANI_ROUNDS(11, 2) SHANI_ROUNDS(12, 2) SHANI_ROUNDS(13, 2) SHANI_ROUNDS(14, 2)
+        SHANI_ROUNDS(15, 3) SHANI_ROUNDS(16, 3) SHANI_ROUNDS(17, 3) SHANI_ROUNDS(18, 3) SHANI_ROUNDS(19, 3)
+        E0 = _mm_sha1nexte_epu32(E0, E0_SAVE);
+        ABCD = _mm_add_epi32(ABCD, ABCD_SAVE);
+    }
+    uint32_t h[5];
+    _mm_storeu_si128((__m128i *)h, _mm_shuffle_epi32(ABCD, 0x1b));
+    h[4] = (uint32_t)_mm_extract_epi32(E0, 3);
+    store_digest(h, out);
+}
+
+// ---- multi-buffer: one message per 32-bit lane ----
+
+// Block b of every lane, transposed so that w[t] holds word t of each
+// lane's block. Lanes that have run out of blocks read zeros; their
+// results are masked off.
+template <int LANES>
+static void gather_words(const Sha1Message *const *lane, int count, size_t b, uint32_t (*w)[LANES]) {
+    static const unsigned char zero[64] = {0};
+    for (int i = 0; i < LANES; ++i) {
+        const unsigned char *p = i < count && b < lane[i]->blocks ? lane[i]->block(b) : zero;
+        for (int t = 0; t < 16; ++t) {
+            uint32_t v;
+            memcpy(&v, p + 4 * t, 4);
+            w[t][i] = __builtin_bswap32(v);
+        }
+    }
+}
+
+template <int LANES>
+static void scatter_digests(const uint32_t (*h)[LANES], int count, unsigned char *const *out) {
+    for (int i = 0; i < count; ++i) {
+        uint32_t d[5] = {h[0][i], h[1][i], h[2][i], h[3][i], h[4][i]};
+        store_digest(d, out[i]);
+    }
+}
+
+#define ROL256(x, n) _mm256_or_si256(_mm256_slli_epi32(x, n), _mm256_srli_epi32(x, 32 - (n)))
+
+__attribute__((target("avx2")))
+static void sha1_x8(const Sha1Message *const *lane, int count, unsigned char *const *out) {
+    size_t max_blocks = 0;
+    alignas(32) uint32_t nblocks[8] = {0};
+    for (int i = 0; i < count; ++i) {
+        nblocks[i] = (uint32_t)lane[i]->blocks;
+        max_blocks = max(max_blocks, lane[i]->blocks);
+    }
+    __m256i live_until = _mm256_load_si256((const __m256i *)nblocks);
+    __m256i h[5];
+    for (int k = 0; k < 5; ++k) h[k] = _mm256_set1_epi32((int)SHA1_INIT[k]);
+    alignas(32) uint32_t w[16][8];
+    for (size_t b = 0; b < max_blocks; ++b) {
+        gather_words<8>(lane, count, b, w);
+        __m256i W[16];
+        for (int t = 0; t < 16; ++t) W[t] = _mm256_load_si256((const __m256i *)w[t]);
+        __m256i A = h[0], B = h[1], C = h[2], D = h[3], E = h[4];
+#pragma GCC unroll 80
+        for (int t = 0; t < 80; ++t) {
+            if (t >= 16) {
+                __m256i x = _mm256_xor_si256(_mm256_xor_si256(W[(t - 3) & 15], W[(t - 8) & 15]),
+                                             _mm256_xor_si256(W[(t - 14) & 15], W[t & 15]));
+                W[t & 15] = ROL256(x, 1);
+            }
+            __m256i f;
+            if (t < 20) f = _mm256_xor_si256(D, _mm256_and_si256(B, _mm256_xor_si256(C, D)));
+            else if (t < 40 || t >= 60) f = _mm256_xor_si256(_mm256_xor_si256(B, C), D);
+            else f = _mm256_or_si256(_mm256_and_si256(B, C), _mm256_and_si256(D, _mm256_or_si256(B, C)));
+            __m256i tmp = _mm256_add_epi32(_mm256_add_epi32(ROL256(A, 5), f),
+                                           _mm256_add_epi32(_mm256_add_epi32(E, _mm256_set1_epi32((int)SHA1_K[t / 20])),
+                                                            W[t & 15]));
+            E = D;
+            D = C;
+            C = ROL256(B, 30);
+            B = A;
+            A = tmp;
+        }
+        __m256i live = _mm256_cmpgt_epi32(live_until, _mm256_set1_epi32((int)b));
+        h[0] = _mm256_add_epi32(h[0], _mm256_and_si256(live, A));
+        h[1] = _mm256_add_epi32(h[1], _mm256_and_si256(live, B));
+        h[2] = _mm256_add_epi32(h[2], _mm256_and_si256(live, C));
+        h[3] = _mm256_add_epi32(h[3], _mm256_and_si256(live, D));
+        h[4] = _mm256_add_epi32(h[4], _mm256_and_si256(live, E));
+    }
+    alignas(32) uint32_t hs[5][8];
+    for (int k = 0; k < 5; ++k) _mm256_store_si256((__m256i *)hs[k], h[k]);
+    scatter_digests<8>(hs, count, out);
+}
+
+// AVX-512 has a rotate and a three-input logic instruction, so each round
+// function is a single vpternlogd: 0xca is "b ? c : d", 0x96 is
+// b ^ c ^ d and 0xe8 is majority.
+__attribute__((target("avx512f")))
+static void sha1_x16(const Sha1Message *const *lane, int count, unsigned char *const *out) {
+    size_t max_blocks = 0;
+    alignas(64) uint32_t nblocks[16] = {0};
+    for (int i = 0; i < count; ++i) {
+        nblocks[i] = (uint32_t)lane[i]->blocks;
+        max_blocks = max(max_blocks, lane[i]->blocks);
+    }
+    __m512i live_until = _mm512_load_si512(nblocks);
+    __m512i h[5];
+    for (int k = 0; k < 5; ++k) h[k] = _mm512_set1_epi32((int)SHA1_INIT[k]);
+    alignas(64) uint32_t w[16][16];
+    for (size_t b = 0; b < max_blocks; ++b) {
+        gather_words<16>(lane, count, b, w);
+        __m512i W[16];
+        for (int t = 0; t < 16; ++t) W[t] = _mm512_load_si512(w[t]);
+        __m512i A = h[0], B = h[1], C = h[2], D = h[3], E = h[4];
+#pragma GCC unroll 80
+        for (int t = 0; t < 80; ++t) {
+            if (t >= 16) {
+                __m512i x = _mm512_ternarylogic_epi32(W[(t - 3) & 15], W[(t - 8) & 15], W[(t - 14) & 15], 0x96);
+                W[t & 15] = _mm512_rol_epi32(_mm512_xor_si512(x, W[t & 15]), 1);
+            }
+            __m512i f;
+            if (t < 20) f = _mm512_ternarylogic_epi32(B, C, D, 0xca);
+            else if (t < 40 || t >= 60) f = _mm512_ternarylogic_epi32(B, C, D, 0x96);
+            else f = _mm512_ternarylogic_epi32(B, C, D, 0xe8);
+            __m512i tmp = _mm512_add_epi32(_mm512_add_epi32(_mm512_rol_epi32(A, 5), f),
+                                           _mm512_add_epi32(_mm512_add_epi32(E, _mm512_set1_epi32((int)SHA1_K[t / 20])),
+                                                            W[t & 15]));
+            E = D;
+            D = C;
+            C = _mm512_rol_epi32(B, 30);
+            B = A;
+            A = tmp;
+        }
+        __mmask16 live = _mm512_cmpgt_epu32_mask(live_until, _mm512_set1_epi32((int)b));
+        h[0] = _mm512_mask_add_epi32(h[0], live, h[0], A);
+        h[1] = _mm512_mask_add_epi32(h[1], live, h[1], B);
+        h[2] = _mm512_mask_add_epi32(h[2], live, h[2], C);
+        h[3] = _mm512_mask_add_epi32(h[3], live, h[3], D);
+        h[4] = _mm512_mask_add_epi32(h[4], live, h[4], E);
+    }
+    alignas(64) uint32_t hs[5][16];
+    for (int k = 0; k < 5; ++k) _mm512_store_si512(hs[k], h[k]);
+    scatter_digests<16>(hs, count, out);
+}
+
+// ---- dispatch ----
+
+enum Sha1Impl { SHA1_OPENSSL, SHA1_SHANI, SHA1_AVX2, SHA1_AVX512 };
+static const char *const IMPL_NAMES[] = {"openssl", "sha-ni", "avx2", "avx512"};
+
+static bool cpu_supports(Sha1Impl impl) {
+    switch (impl) {
+        case SHA1_OPENSSL:
+            return true;
+        case SHA1_SHANI: {
+            unsigned eax, ebx, ecx, edx;
+            return __get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx) && (ebx & (1u << 29)) &&
+                   __builtin_cpu_supports("sse4.1");
+        }
+        case SHA1_AVX2:
+            return __builtin_cpu_supports("avx2");
+        case SHA1_AVX512:
+            return __builtin_cpu_supports("avx512f");
+    }
+    return false;
+}
+
+static Sha1Impl best_impl() {
+    for (Sha1Impl impl : {SHA1_AVX512, SHA1_AVX2, SHA1_SHANI}) {
+        if (cpu_supports(impl)) return impl;
+    }
+    return SHA1_OPENSSL;
+}
+
+static const bool have_shani = cpu_supports(SHA1_SHANI);
+static Sha1Impl active_impl = best_impl();
+
+const char *sha1_batch_impl() {
+    return IMPL_NAMES[active_impl];
+}
+
+bool sha1_batch_select(const string &impl) {
+    for (int i = 0; i < 4; ++i) {
+        if (impl == IMPL_NAMES[i] && cpu_supports((Sha1Impl)i)) {
+            active_impl = (Sha1Impl)i;
+            return true;
+        }
+    }
+    return false;
+}
+
+// Lanes of one group may differ in length by at most this factor, so a
+// long message does not keep a group of short ones running on empty
+// lanes; groups that would be less than half full are hashed one by one.
+static const size_t MAX_LENGTH_SPREAD = 2;
+
+void sha1_batch(const Sha1Input *in, size_t n, unsigned char (*out)[20]) {
+    TraceTimer t(TRACE_SHA1);
+    if (trace_enabled) {
+        for (size_t i = 0; i < n; ++i) trace_count(TRACE_BYTES_HASHED, in[i].len);
+    }
+    Sha1Impl impl = active_impl;
+    if (impl == SHA1_OPENSSL) {
+        for (size_t i = 0; i < n; ++i) SHA1((const unsigned char *)in[i].data, in[i].len, out[i]);
+        return;
+    }
+
+    vector<Sha1Message> msgs(n);
+    for (size_t i = 0; i < n; ++i) prepare(msgs[i], in[i].data, in[i].len);
+    auto single = [&](size_t i) {
+        if (have_shani) sha1_shani(msgs[i], out[i]);
+        else SHA1((const unsigned char *)in[i].data, in[i].len, out[i]);
+    };
+    if (impl == SHA1_SHANI) {
+        for (size_t i = 0; i < n; ++i) single(i);
+        return;
+    }
+
+    int lanes = impl == SHA1_AVX512 ? 16 : 8;
+    vector<size_t> order(n);
+    iota(order.begin(), order.end(), 0);
+    sort(order.begin(), order.end(), [&](size_t a, size_t b) { return msgs[a].blocks < msgs[b].blocks; });
+    const Sha1Message *lane[16];
+    unsigned char *lane_out[16];
+    size_t i = 0;
+    while (i < n) {
+        size_t limit = msgs[order[i]].blocks * MAX_LENGTH_SPREAD;
+        int count = 0;
+        while (i + count < n && count < lanes && msgs[order[i + count]].blocks <= limit) {
+            lane[count] = &msgs[order[i + count]];
+            lane_out[count] = out[order[i + count]];
+            ++count;
+        }
+        if (count * 2 < lanes) {
+            single(order[i++]);
+            continue;
+        }
+        if (impl == SHA1_AVX512) sha1_x16(lane, count, lane_out);
+        else sha1_x8(lane, count, lane_out);
+        i += count;
+    }
+}
+
+vector<string> sha1_hex_batch(const vector<const string *> &bufs) {
+    vector<Sha1Input> in(bufs.size());
+    for (size_t i = 0; i < bufs.size(); ++i) in[i] = {bufs[i]->data(), bufs[i]->size()};
+    vector<array<unsigned char, 20>> digests(bufs.size());
+    sha1_batch(in.data(), in.size(), (unsigned char (*)[20])digests.data());
+    vector<string> hex(bufs.size());
+    for (size_t i = 0; i < bufs.size(); ++i) hex[i] = to_hex(digests[i].data(), 20);
+    return hex;
+}
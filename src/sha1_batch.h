@@ -0,0 +1,36 @@
+#ifndef SHA1_BATCH_H
+#define SHA1_BATCH_H
+
+#include <cstddef>
+#include <string>
+#include <vector>
+
+using namespace std;
+
+// SHA-1 of many independent buffers at once. Most objects are a few KiB,
+// where a one-shot SHA1() call is dominated by setup and by a compression
+// function that runs serially. Multi-buffer implementations instead run
+// one message per SIMD lane (8 with AVX2, 16 with AVX-512), so a block of
+// every message is processed for the price of one vector round function.
+// Buffers are grouped by length so lanes finish together; whatever is
+// left over goes through a single-buffer SHA-NI (or OpenSSL) path. The
+// implementation is picked once per process from the CPU's features.
+
+struct Sha1Input {
+    const void *data;
+    size_t len;
+};
+
+// out[i] receives the 20-byte digest of in[i].
+void sha1_batch(const Sha1Input *in, size_t n, unsigned char (*out)[20]);
+
+// Hex digests of `bufs`, in order.
+vector<string> sha1_hex_batch(const vector<const string *> &bufs);
+
+// Name of the implementation in use: "avx512", "avx2", "sha-ni" or "openssl".
+const char *sha1_batch_impl();
+
+// Switches implementation, for benchmarks. False when the CPU lacks it.
+bool sha1_batch_select(const string &impl);
+
+#endif // SHA1_BATCH_H
@@ -0,0 +1,69 @@
+#include "trace.h"
+#include "git_utils.h"
+
+#include <bits/stdc++.h>
+
+using namespace std;
+
+bool trace_enabled = false;
+TracePhaseTotals trace_phases[TRACE_PHASE_COUNT];
+atomic<uint64_t> trace_counters[TRACE_COUNTER_COUNT];
+
+static const char *const PHASE_NAMES[TRACE_PHASE_COUNT] = {
+    "read_file", "sha1", "compress", "decompress", "ensure_dir", "walk_dir", "fsync",
+};
+
+static const char *const COUNTER_NAMES[TRACE_COUNTER_COUNT] = {
+    "bytes_read", "bytes_hashed", "bytes_deflated", "bytes_inflated",
+    "objects_opened", "stat_calls", "dirs_walked",
+};
+
+static string trace_target;
+static uint64_t trace_start_ns;
+
+void trace_init() {
+    const char *v = getenv("MYGIT_TRACE");
+    if (!v || !*v || strcmp(v, "0") == 0 || strcmp(v, "false") == 0) return;
+    trace_target = v;
+    trace_enabled = true;
+    trace_start_ns = trace_now_ns();
+}
+
+static string json_escape(const string &s) {
+    string out;
+    for (char c : s) {
+        if (c == '"' || c == '\\') out += '\\';
+        out += c;
+    }
+    return out;
+}
+
+void trace_finish(const string &command, int exit_code) {
+    if (!trace_enabled) return;
+    double wall_ms = (trace_now_ns() - trace_start_ns) / 1e6;
+    ObjectIoStats io = object_io_stats();
+    ObjectCacheStats cache = object_cache_stats();
+
+    ostringstream o;
+    o << fixed << setprecision(3);
+    o << "{\"command\": \"" << json_escape(command) << "\", \"exit_code\": " << exit_code
+      << ", \"wall_ms\": " << wall_ms << ", \"phases\": {";
+    for (int i = 0; i < TRACE_PHASE_COUNT; ++i) {
+        o << (i ? ", " : "") << "\"" << PHASE_NAMES[i] << "\": {\"calls\": " << trace_phases[i].calls.load()
+          << ", \"ms\": " << trace_phases[i].ns.load() / 1e6 << "}";
+    }
+    o << "}, \"counters\": {";
+    for (int i = 0; i < TRACE_COUNTER_COUNT; ++i) {
+        o << (i ? ", " : "") << "\"" << COUNTER_NAMES[i] << "\": " << trace_counters[i].load();
+    }
+    o << ", \"objects_read\": " << io.read << ", \"objects_written\": " << io.written
+      << ", \"object_cache_hits\": " << cache.hits << ", \"object_cache_misses\": " << cache.misses << "}}\n";
+
+    if (trace_target[0] == '/') {
+        ofstream f(trace_target, ios::app);
+        f << o.str();
+        if (f) return;
+        cerr << "warning: cannot write trace to " << trace_target << "\n";
+    }
+    cerr << o.str();
+}
@@ -0,0 +1,82 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <atomic>
+#include <cstdint>
+#include <ctime>
+#include <string>
+
+using namespace std;
+
+// Hot-path instrumentation, enabled by MYGIT_TRACE. "1" or "true" prints a
+// JSON summary to stderr when the command exits; any value starting with
+// '/' names a file the summary is appended to instead, one line per run.
+// Phase times are inclusive and summed over threads, so nested phases
+// (hashing inside read_file callers, say) overlap and a parallel phase can
+// exceed the wall time. When tracing is off every hook is a single
+// predictable branch on trace_enabled.
+
+enum TracePhase {
+    TRACE_READ_FILE,
+    TRACE_SHA1,
+    TRACE_COMPRESS,
+    TRACE_DECOMPRESS,
+    TRACE_ENSURE_DIR,
+    TRACE_WALK_DIR,
+    TRACE_FSYNC,
+    TRACE_PHASE_COUNT
+};
+
+enum TraceCounter {
+    TRACE_BYTES_READ,       // by read_file
+    TRACE_BYTES_HASHED,
+    TRACE_BYTES_DEFLATED,   // compressor input
+    TRACE_BYTES_INFLATED,   // decompressor output
+    TRACE_OBJECTS_OPENED,   // loose object files and pack entries
+    TRACE_STAT_CALLS,
+    TRACE_DIRS_WALKED,
+    TRACE_COUNTER_COUNT
+};
+
+extern bool trace_enabled;
+
+struct TracePhaseTotals {
+    atomic<uint64_t> calls{0};
+    atomic<uint64_t> ns{0};
+};
+extern TracePhaseTotals trace_phases[TRACE_PHASE_COUNT];
+extern atomic<uint64_t> trace_counters[TRACE_COUNTER_COUNT];
+
+inline uint64_t trace_now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + ts.tv_nsec;
+}
+
+inline void trace_count(TraceCounter c, uint64_t n = 1) {
+    if (trace_enabled) trace_counters[c].fetch_add(n, memory_order_relaxed);
+}
+
+// Adds the lifetime of the object to `phase`.
+class TraceTimer {
+public:
+    explicit TraceTimer(TracePhase phase) : phase(phase), start(trace_enabled ? trace_now_ns() : 0) {}
+    ~TraceTimer() {
+        if (!start) return;
+        trace_phases[phase].calls.fetch_add(1, memory_order_relaxed);
+        trace_phases[phase].ns.fetch_add(trace_now_ns() - start, memory_order_relaxed);
+    }
+    TraceTimer(const TraceTimer &) = delete;
+    TraceTimer &operator=(const TraceTimer &) = delete;
+
+private:
+    TracePhase phase;
+    uint64_t start;
+};
+
+// Reads MYGIT_TRACE; call once before any traced work.
+void trace_init();
+// Emits the summary for `command` if tracing is on.
+void trace_finish(const string &command, int exit_code);
+
+#endif // TRACE_H
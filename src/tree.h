@@ -0,0 +1,99 @@
+#ifndef TREE_H
+#define TREE_H
+
+#include "git_utils.h"
+
+#include <cstring>
+#include <string>
+#include <string_view>
+
+using namespace std;
+
+// One entry of a tree object, pointing into the object body: nothing is
+// copied or allocated while iterating. `sha` holds 20 raw bytes for a
+// binary tree and 40 hex digits for a text tree (see config.h).
+struct TreeEntry {
+    string_view mode;
+    string_view name;
+    string_view sha;
+    bool raw = false;
+
+    bool is_tree() const { return mode == "40000"; }
+
+    string sha_hex() const {
+        return raw ? to_hex((const unsigned char *)sha.data(), sha.size()) : string(sha);
+    }
+
+    bool same_sha(const TreeEntry &o) const {
+        return raw == o.raw ? sha == o.sha : sha_hex() == o.sha_hex();
+    }
+};
+
+// Walks the entries of a tree body in stored (name) order. Both encodings
+// are understood. Every binary entry holds a NUL and no text entry can
+// (names never contain one and the SHA is hex), so any NUL marks a binary
+// tree; names and raw SHAs may contain tabs and newlines either way.
+class TreeIterator {
+public:
+    explicit TreeIterator(string_view body)
+        : p(body.data()), end(body.data() + body.size()), binary(memchr(p, '\0', body.size()) != nullptr) {}
+
+    // Fills `e` with the next entry. Returns false at the end of the tree
+    // or on a malformed entry (then bad() is true).
+    bool next(TreeEntry &e) {
+        return binary ? next_binary(e) : next_text(e);
+    }
+
+    bool bad() const { return malformed; }
+
+private:
+    const char *p;
+    const char *end;
+    bool binary;
+    bool malformed = false;
+
+    bool fail() {
+        malformed = true;
+        p = end;
+        return false;
+    }
+
+    bool next_binary(TreeEntry &e) {
+        if (p == end) return false;
+        const char *sp = (const char *)memchr(p, ' ', end - p);
+        if (!sp) return fail();
+        const char *nul = (const char *)memchr(sp + 1, '\0', end - sp - 1);
+        if (!nul || end - nul - 1 < 20) return fail();
+        e.mode = string_view(p, sp - p);
+        e.name = string_view(sp + 1, nul - sp - 1);
+        e.sha = string_view(nul + 1, 20);
+        e.raw = true;
+        p = nul + 21;
+        return true;
+    }
+
+    bool next_text(TreeEntry &e) {
+        while (p < end) {
+            const char *nl = (const char *)memchr(p, '\n', end - p);
+            const char *line_end = nl ? nl : end;
+            const char *line = p;
+            p = nl ? nl + 1 : end;
+            if (line == line_end) continue;
+            const char *tab = (const char *)memchr(line, '\t', line_end - line);
+            if (!tab) return fail();
+            const char *sp = (const char *)memchr(line, ' ', tab - line);
+            if (!sp) return fail();
+            e.mode = string_view(line, sp - line);
+            e.name = string_view(sp + 1, tab - sp - 1);
+            e.sha = string_view(tab + 1, line_end - tab - 1);
+            e.raw = false;
+            return true;
+        }
+        return false;
+    }
+};
+
+// Appends one entry to a tree body in the repository's tree encoding.
+void append_tree_entry(string &body, const string &mode, const string &name, const string &sha);
+
+#endif // TREE_H
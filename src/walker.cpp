@@ -0,0 +1,194 @@
+#include "walker.h"
+#include "git_utils.h"
+#include "ignore.h"
+#include "trace.h"
+
+#include <bits/stdc++.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+using namespace std;
+
+// Record layout returned by getdents64; glibc does not declare it.
+struct LinuxDirent64 {
+    uint64_t d_ino;
+    int64_t d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[];
+};
+
+static const size_t DIRENT_BUFFER = 64 << 10;
+
+// One thread's directories still to be read. The owner pushes and pops at
+// the back, so it goes depth first and its queue stays short; thieves take
+// from the front, where the directories nearest the root (and so the
+// largest subtrees) wait.
+struct WalkDir {
+    string path;
+    IgnoreStack ignore;  // rules of the directories above it
+};
+
+struct WalkQueue {
+    mutex m;
+    deque<WalkDir> dirs;
+};
+
+class TreeWalk {
+public:
+    explicit TreeWalk(unsigned jobs) : queues(jobs), found(jobs) {}
+
+    // The root is read before any thread starts; its subdirectories seed
+    // the first queue and the other threads steal from there.
+    vector<string> run(const string &root, const IgnoreStack &ignore) {
+        vector<char> buf(DIRENT_BUFFER);
+        read_dir(0, {root, ignore}, buf, true);
+        vector<thread> threads;
+        for (unsigned t = 1; t < queues.size(); ++t) threads.emplace_back([this, t] { work(t); });
+        work(0);
+        for (auto &t : threads) t.join();
+
+        size_t total = 0;
+        for (auto &f : found) total += f.size();
+        vector<string> files;
+        files.reserve(total);
+        for (auto &f : found) move(f.begin(), f.end(), back_inserter(files));
+        sort(files.begin(), files.end());
+        return files;
+    }
+
+private:
+    vector<WalkQueue> queues;
+    vector<vector<string>> found;
+    atomic<size_t> pending{0};  // directories queued or being read
+    atomic<size_t> queued{0};   // directories waiting in some queue
+    // Threads with nothing to steal sleep here until a directory is queued
+    // or the walk is over.
+    mutex idle_m;
+    condition_variable idle_cv;
+    atomic<unsigned> sleepers{0};
+
+    void push(unsigned self, WalkDir dir) {
+        ++pending;
+        {
+            lock_guard<mutex> lk(queues[self].m);
+            queues[self].dirs.push_back(std::move(dir));
+        }
+        ++queued;
+        wake(false);
+    }
+
+    // Taking idle_m orders the wakeup after a sleeper's last check of the
+    // queues, so it cannot be lost.
+    void wake(bool all) {
+        if (sleepers == 0) return;
+        { lock_guard<mutex> lk(idle_m); }
+        if (all) idle_cv.notify_all();
+        else idle_cv.notify_one();
+    }
+
+    bool next_dir(unsigned self, WalkDir &dir) {
+        {
+            WalkQueue &q = queues[self];
+            lock_guard<mutex> lk(q.m);
+            if (!q.dirs.empty()) {
+                dir = std::move(q.dirs.back());
+                q.dirs.pop_back();
+                --queued;
+                return true;
+            }
+        }
+        for (size_t k = 1; k < queues.size(); ++k) {
+            WalkQueue &q = queues[(self + k) % queues.size()];
+            lock_guard<mutex> lk(q.m);
+            if (!q.dirs.empty()) {
+                dir = std::move(q.dirs.front());
+                q.dirs.pop_front();
+                --queued;
+                return true;
+            }
+        }
+        return false;
+    }
+
+    // A directory's children are queued before it stops counting as
+    // pending, so pending only reaches zero once the walk is complete.
+    void work(unsigned self) {
+        vector<char> buf(DIRENT_BUFFER);
+        WalkDir dir;
+        while (true) {
+            if (next_dir(self, dir)) {
+                read_dir(self, dir, buf, false);
+                if (--pending == 0) wake(true);
+            } else if (pending == 0) {
+                return;
+            } else {
+                unique_lock<mutex> lk(idle_m);
+                ++sleepers;
+                idle_cv.wait(lk, [this] { return pending == 0 || queued > 0; });
+                --sleepers;
+            }
+        }
+    }
+
+    // Subdirectories are known to be directories from d_type, so only the
+    // root is opened following symlinks. Directories that cannot be opened
+    // (removed meanwhile, or unreadable) are skipped. The entries are
+    // collected before any is classified, since the directory's own
+    // .mygitignore may come after them; ignored subdirectories are never
+    // queued.
+    void read_dir(unsigned self, const WalkDir &dir, vector<char> &buf, bool root) {
+        int flags = O_RDONLY | O_DIRECTORY | O_CLOEXEC | (root ? 0 : O_NOFOLLOW);
+        int fd = openat(AT_FDCWD, dir.path.empty() ? "." : dir.path.c_str(), flags);
+        if (fd < 0) return;
+        trace_count(TRACE_DIRS_WALKED);
+        string prefix = dir.path.empty() ? string() : dir.path + "/";
+        vector<pair<string, unsigned char>> entries;
+        bool has_ignore_file = false;
+        while (true) {
+            long n = syscall(SYS_getdents64, fd, buf.data(), buf.size());
+            if (n <= 0) break;
+            for (long off = 0; off < n;) {
+                const LinuxDirent64 *d = (const LinuxDirent64 *)(buf.data() + off);
+                off += d->d_reclen;
+                if (d->d_name[0] == '.') {
+                    if (!strcmp(d->d_name, IGNORE_FILE)) has_ignore_file = true;
+                    continue;
+                }
+                unsigned char type = d->d_type;
+                if (type == DT_UNKNOWN) {
+                    struct stat st;
+                    trace_count(TRACE_STAT_CALLS);
+                    if (fstatat(fd, d->d_name, &st, AT_SYMLINK_NOFOLLOW) != 0) continue;
+                    type = S_ISDIR(st.st_mode) ? DT_DIR : S_ISREG(st.st_mode) ? DT_REG : DT_UNKNOWN;
+                }
+                if (type == DT_REG || type == DT_DIR) entries.emplace_back(d->d_name, type);
+            }
+        }
+        close(fd);
+
+        IgnoreStack ignore = dir.ignore;
+        if (has_ignore_file) ignore = push_ignore_rules(ignore, dir.path, read_file(prefix + IGNORE_FILE));
+        for (auto &e : entries) {
+            string path = prefix + e.first;
+            bool is_dir = e.second == DT_DIR;
+            if (is_ignored(ignore, path, is_dir)) continue;
+            if (is_dir) push(self, {std::move(path), ignore});
+            else found[self].push_back(std::move(path));
+        }
+    }
+};
+
+vector<string> walk_worktree(const string &dir, unsigned jobs) {
+    TraceTimer t(TRACE_WALK_DIR);
+    IgnoreStack ignore;
+    if (!dir.empty()) {
+        bool ignored;
+        ignore = ignore_rules_for(dir, true, ignored);
+        if (ignored) return vector<string>();
+    }
+    return TreeWalk(max(1u, jobs)).run(dir, ignore);
+}
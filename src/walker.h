@@ -0,0 +1,27 @@
+#ifndef WALKER_H
+#define WALKER_H
+
+#include "parallel.h"
+
+#include <string>
+#include <vector>
+
+using namespace std;
+
+// Working-tree walker shared by add and status. Directories are read with
+// getdents64 through openat, and the d_type of each entry decides whether
+// it is a file, a directory to descend into, or something to skip, so no
+// entry is stat'ed unless the filesystem leaves d_type unknown.
+// Subdirectories are spread over `jobs` threads: each works depth-first
+// through its own queue and steals from the far end of another's when it
+// runs dry, sleeping while there is nothing to steal.
+//
+// Returns the regular files beneath `dir` (relative to the current
+// directory; "" walks the whole tree), sorted, as paths relative to the
+// current directory. Entries whose names start with '.' are skipped, and
+// so are symbolic links, which add never stores. Paths excluded by
+// .mygitignore files are left out, and ignored directories are not read
+// at all; a `dir` that is itself ignored yields nothing.
+vector<string> walk_worktree(const string &dir = string(), unsigned jobs = default_jobs());
+
+#endif // WALKER_H